@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+//a load generator for the chat server, every connection is driven by one
+//epoll loop so tens of thousands of them fit in one process
+//usage: ./bench MODE [ip:IP] [port:PORT] [clients:N] [seconds:N] [window:N] [rate:N] [pid:SERVER_PID]
+//  idle    - clients idle connections that never log in, then one client pings
+//            itself through a room of its own, so every round trip is one read
+//            and one write for the server whatever the number of idle sockets
+//  fanout  - clients members of one room and a sender keeping window
+//            messages in flight, counts the deliveries
+//  login   - logs clients in, rate per second or as fast as they're accepted,
+//            then keeps them connected for seconds (the soak test)
+//  http    - clients kept alive connections requesting GET / back to back
+//  history - a room filled with window messages is joined and left by the
+//            clients over and over, every JOIN replays the room's history
+//with pid the server's CPU time is read from /proc and divided by the work done
+
+typedef struct sockaddr SA;
+typedef struct sockaddr_in SA_IN;
+
+#define FRAME_HEADER_LEN 4
+//the start of a frame's body is kept to tell frames apart, the rest is skipped
+#define PREFIX_LEN 64
+#define READ_LEN (64 * 1024)
+#define HTTP_HEAD_LEN 1024
+//connections whose handshake is still going on, more would overflow the
+//server's listen backlog
+#define CONNECTING_MAX 256
+#define EVENTS_LEN 256
+//latencies are counted in 10 us buckets up to a second
+#define LATENCY_BUCKETS 100000
+#define LATENCY_STEP 10
+
+typedef enum {
+  CONN_CONNECTING,
+  CONN_LOGIN,
+  CONN_READY,
+  CONN_CLOSED
+} conn_state_t;
+
+typedef struct {
+  int fd;
+  int index;
+  conn_state_t state;
+  //the text frame being read
+  unsigned char header[FRAME_HEADER_LEN];
+  int header_len;
+  int body_len;
+  int body_read;
+  char prefix[PREFIX_LEN + 1];
+  //an HTTP response being read
+  char *head;
+  int head_len;
+  long body_left;
+  long sent_at;
+  int outstanding;
+  unsigned long frames;
+  unsigned long counted;
+} conn_t;
+
+struct {
+  SA_IN address;
+  int clients;
+  int seconds;
+  int window;
+  int rate;
+  int pid;
+  int epollfd;
+  conn_t *conns;
+  int count;
+  int connecting;
+  int logged;
+  int refused;
+  int closed;
+  void (*on_frame)(conn_t *conn);
+  void (*on_response)(conn_t *conn);
+  bool http;
+  //connections that stay open without logging in
+  bool quiet;
+  unsigned long latency[LATENCY_BUCKETS + 1];
+  unsigned long samples;
+} bench;
+
+long now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+bool starts_with(const char *str1, const char *str2) {
+  return strncmp(str1, str2, strlen(str2)) == 0;
+}
+
+long server_cpu_us(void) {
+  //user and system time of the whole server process
+  if (bench.pid <= 0) return 0;
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", bench.pid);
+  FILE *file = fopen(path, "r");
+  if (!file) return 0;
+  char buf[1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+  fclose(file);
+  buf[len] = '\0';
+  //the fields after the command name, which may contain spaces
+  char *fields = strrchr(buf, ')');
+  unsigned long utime = 0, stime = 0;
+  if (!fields || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+    return 0;
+  }
+  return (long)((utime + stime) * 1000000UL / sysconf(_SC_CLK_TCK));
+}
+
+long server_rss_kb(void) {
+  if (bench.pid <= 0) return 0;
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", bench.pid);
+  FILE *file = fopen(path, "r");
+  if (!file) return 0;
+  char line[256];
+  long rss = 0;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "VmRSS: %ld", &rss) == 1) break;
+  }
+  fclose(file);
+  return rss;
+}
+
+void record_latency(long us) {
+  long bucket = us / LATENCY_STEP;
+  bench.latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS]++;
+  bench.samples++;
+}
+
+long latency_percentile(double p) {
+  unsigned long rank = (unsigned long)(bench.samples * p);
+  unsigned long seen = 0;
+  for (int i = 0; i <= LATENCY_BUCKETS; i++) {
+    seen += bench.latency[i];
+    if (seen > rank) return (long)(i + 1) * LATENCY_STEP;
+  }
+  return 0;
+}
+
+int write_all(int fd, const char *data, int len) {
+  //bench sockets are non-blocking, a full socket is waited for
+  while (len > 0) {
+    int w = write(fd, data, len);
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      poll(&pfd, 1, 1000);
+      continue;
+    }
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return -1;
+    data += w;
+    len -= w;
+  }
+  return 0;
+}
+
+int send_frame(conn_t *conn, const char *body) {
+  char buf[1024];
+  int len = strlen(body);
+  int header = htonl(len);
+  memcpy(buf, &header, FRAME_HEADER_LEN);
+  memcpy(buf + FRAME_HEADER_LEN, body, len);
+  return write_all(conn->fd, buf, FRAME_HEADER_LEN + len);
+}
+
+void close_conn(conn_t *conn) {
+  if (conn->state == CONN_CLOSED) return;
+  if (conn->state == CONN_CONNECTING) bench.connecting--;
+  conn->state = CONN_CLOSED;
+  bench.closed++;
+  close(conn->fd);
+}
+
+conn_t *open_conn(void) {
+  conn_t *conn = bench.conns + bench.count;
+  memset(conn, 0, sizeof(conn_t));
+  conn->index = bench.count;
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->fd < 0) {
+    perror("Socket error");
+    exit(1);
+  }
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  bench.count++;
+  conn->state = CONN_CONNECTING;
+  bench.connecting++;
+  if (connect(conn->fd, (SA *)&bench.address, sizeof(bench.address)) < 0 && errno != EINPROGRESS) {
+    perror("Connect error");
+    close_conn(conn);
+    return conn;
+  }
+  struct epoll_event event = {EPOLLIN | EPOLLOUT | EPOLLRDHUP, {.ptr = conn}};
+  epoll_ctl(bench.epollfd, EPOLL_CTL_ADD, conn->fd, &event);
+  return conn;
+}
+
+void connected(conn_t *conn) {
+  //the handshake is done, chat clients log in right away
+  bench.connecting--;
+  struct epoll_event event = {EPOLLIN | EPOLLRDHUP, {.ptr = conn}};
+  epoll_ctl(bench.epollfd, EPOLL_CTL_MOD, conn->fd, &event);
+  if (bench.http) {
+    conn->state = CONN_READY;
+    bench.on_response(conn);
+    return;
+  }
+  if (bench.quiet) {
+    conn->state = CONN_READY;
+    return;
+  }
+  conn->state = CONN_LOGIN;
+  char login[64];
+  int len = snprintf(login, sizeof(login), "LOGIN b%d", conn->index);
+  if (write_all(conn->fd, login, len) < 0) close_conn(conn);
+}
+
+void handle_frame(conn_t *conn) {
+  conn->frames++;
+  if (conn->state == CONN_LOGIN) {
+    if (strcmp(conn->prefix, "LOGGED") == 0) {
+      conn->state = CONN_READY;
+      bench.logged++;
+    } else {
+      //BUSY or TAKEN
+      bench.refused++;
+      close_conn(conn);
+      return;
+    }
+  }
+  if (bench.on_frame) bench.on_frame(conn);
+}
+
+void read_frames(conn_t *conn, const char *buf, int len) {
+  //frames are parsed as they stream in, only their prefix is kept
+  while (len > 0 && conn->state != CONN_CLOSED) {
+    if (conn->header_len < FRAME_HEADER_LEN) {
+      int n = FRAME_HEADER_LEN - conn->header_len;
+      if (n > len) n = len;
+      memcpy(conn->header + conn->header_len, buf, n);
+      conn->header_len += n;
+      buf += n;
+      len -= n;
+      if (conn->header_len < FRAME_HEADER_LEN) return;
+      int body_len;
+      memcpy(&body_len, conn->header, FRAME_HEADER_LEN);
+      conn->body_len = ntohl(body_len);
+      conn->body_read = 0;
+    }
+    int n = conn->body_len - conn->body_read;
+    if (n > len) n = len;
+    if (conn->body_read < PREFIX_LEN) {
+      int keep = PREFIX_LEN - conn->body_read < n ? PREFIX_LEN - conn->body_read : n;
+      memcpy(conn->prefix + conn->body_read, buf, keep);
+    }
+    conn->body_read += n;
+    buf += n;
+    len -= n;
+    if (conn->body_read == conn->body_len) {
+      conn->prefix[conn->body_len < PREFIX_LEN ? conn->body_len : PREFIX_LEN] = '\0';
+      conn->header_len = 0;
+      handle_frame(conn);
+    }
+  }
+}
+
+void read_responses(conn_t *conn, const char *buf, int len) {
+  //the head is collected until its blank line, the body is only counted
+  while (len > 0 && conn->state != CONN_CLOSED) {
+    if (conn->body_left > 0) {
+      int n = conn->body_left < len ? conn->body_left : len;
+      conn->body_left -= n;
+      buf += n;
+      len -= n;
+      if (conn->body_left == 0) bench.on_response(conn);
+      continue;
+    }
+    if (!conn->head) conn->head = malloc(HTTP_HEAD_LEN);
+    int n = HTTP_HEAD_LEN - 1 - conn->head_len < len ? HTTP_HEAD_LEN - 1 - conn->head_len : len;
+    memcpy(conn->head + conn->head_len, buf, n);
+    conn->head_len += n;
+    conn->head[conn->head_len] = '\0';
+    char *end = strstr(conn->head, "\r\n\r\n");
+    if (!end) {
+      if (conn->head_len == HTTP_HEAD_LEN - 1) close_conn(conn);
+      return;
+    }
+    int used = end + 4 - conn->head;
+    char *length = strcasestr(conn->head, "Content-Length:");
+    conn->body_left = length ? strtol(length + strlen("Content-Length:"), NULL, 10) : 0;
+    //whatever followed the head in this read is handed over again
+    int rest = conn->head_len - used;
+    buf += n - rest;
+    len -= n - rest;
+    conn->head_len = 0;
+    if (!starts_with(conn->head, "HTTP/1.1 200")) {
+      close_conn(conn);
+      return;
+    }
+    if (conn->body_left == 0) bench.on_response(conn);
+  }
+}
+
+void run_until(bool (*done)(void), long deadline) {
+  //drives every connection until done says so or the deadline passes
+  static char buf[READ_LEN];
+  struct epoll_event events[EVENTS_LEN];
+  while (!(done && done()) && (deadline == 0 || now_us() < deadline)) {
+    int n = epoll_wait(bench.epollfd, events, EVENTS_LEN, 100);
+    for (int i = 0; i < n; i++) {
+      conn_t *conn = (conn_t *)events[i].data.ptr;
+      if (conn->state == CONN_CLOSED) continue;
+      if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (err || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+          close_conn(conn);
+          continue;
+        }
+        if (!(events[i].events & EPOLLOUT)) continue;
+        connected(conn);
+      }
+      while (conn->state != CONN_CLOSED) {
+        int r = read(conn->fd, buf, sizeof(buf));
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+          close_conn(conn);
+          break;
+        }
+        if (bench.http) {
+          read_responses(conn, buf, r);
+        } else {
+          read_frames(conn, buf, r);
+        }
+      }
+    }
+  }
+}
+
+int target;
+
+bool all_logged(void) {
+  return bench.logged + bench.refused + bench.closed >= target;
+}
+
+bool all_connected(void) {
+  return bench.connecting == 0;
+}
+
+void open_clients(int count) {
+  //connections are opened as the earlier handshakes finish, at most rate
+  //per second when it's set
+  long start = now_us();
+  target = bench.count + count;
+  for (int opened = 0; opened < count; opened++) {
+    while (bench.connecting >= CONNECTING_MAX) {
+      run_until(NULL, now_us() + 1000);
+    }
+    if (bench.rate > 0) {
+      long due = start + (long)opened * 1000000L / bench.rate;
+      while (now_us() < due) run_until(NULL, due);
+    }
+    open_conn();
+  }
+}
+
+void wait_logged(void) {
+  //every login is announced to everyone already in the lobby, so logging in
+  //thousands of clients takes a while
+  run_until(all_logged, 0);
+}
+
+void settle(long us) {
+  //lets the presence frames of the logins drain
+  run_until(NULL, now_us() + us);
+}
+
+void print_cpu(long cpu, unsigned long work, const char *unit) {
+  if (bench.pid > 0 && work > 0) {
+    printf("server cpu: %.2f s, %.2f us per %s\n", cpu / 1e6, (double)cpu / work, unit);
+  }
+}
+
+//idle: one client pings itself through a room nobody else is in
+conn_t *pinger;
+unsigned long round_trips;
+
+void ping(conn_t *conn) {
+  conn->sent_at = now_us();
+  if (send_frame(conn, "SAY bench ping") < 0) close_conn(conn);
+}
+
+void on_ping(conn_t *conn) {
+  if (conn != pinger || !starts_with(conn->prefix, "SAY bench ")) return;
+  record_latency(now_us() - conn->sent_at);
+  round_trips++;
+  ping(conn);
+}
+
+bool pinger_logged(void) {
+  return pinger->state == CONN_CLOSED || pinger->state == CONN_READY;
+}
+
+bool pinger_joined(void) {
+  return pinger->state == CONN_CLOSED || (pinger->counted > 0);
+}
+
+bool own_frame(conn_t *conn) {
+  //presence frames end with the name of the client they're about
+  char name[16];
+  snprintf(name, sizeof(name), " b%d", conn->index);
+  char *last = strrchr(conn->prefix, ' ');
+  return last && strcmp(last, name) == 0;
+}
+
+void on_join(conn_t *conn) {
+  //the roster of a room ends with the joiner's own JOIN
+  if (starts_with(conn->prefix, "JOIN ") && own_frame(conn)) {
+    conn->counted++;
+  }
+}
+
+void run_idle(void) {
+  //the idle connections never log in, the server watches their sockets all
+  //the same without announcing thousands of logins to each other
+  bench.quiet = true;
+  open_clients(bench.clients);
+  run_until(all_connected, 0);
+  settle(1000000);
+  bench.quiet = false;
+  printf("idle connections: %d open, %d closed\n", bench.count - bench.closed, bench.closed);
+  bench.on_frame = on_join;
+  pinger = bench.conns + bench.count;
+  open_clients(1);
+  run_until(pinger_logged, 0);
+  if (pinger->state == CONN_CLOSED) {
+    printf("the pinger couldn't log in\n");
+    return;
+  }
+  send_frame(pinger, "JOIN bench");
+  run_until(pinger_joined, now_us() + 10 * 1000000L);
+  settle(1000000);
+  bench.on_frame = on_ping;
+  long cpu = server_cpu_us();
+  long start = now_us();
+  ping(pinger);
+  run_until(NULL, start + bench.seconds * 1000000L);
+  long elapsed = now_us() - start;
+  cpu = server_cpu_us() - cpu;
+  printf("round trips: %lu (%.0f/s), p50 %ld us, p99 %ld us\n", round_trips, round_trips * 1e6 / elapsed,
+    latency_percentile(0.5), latency_percentile(0.99));
+  print_cpu(cpu, round_trips, "round trip");
+}
+
+//fanout: every member of a room gets what the sender says
+conn_t *sender;
+unsigned long deliveries;
+unsigned long sent;
+bool counting;
+
+void say(conn_t *conn) {
+  while (conn->outstanding < bench.window) {
+    if (send_frame(conn, "SAY fan abcdefghijklmnopqrstuvwxyz0123456789") < 0) {
+      close_conn(conn);
+      return;
+    }
+    conn->outstanding++;
+    sent++;
+  }
+}
+
+void on_fanout(conn_t *conn) {
+  if (!starts_with(conn->prefix, "SAY fan ")) {
+    on_join(conn);
+    return;
+  }
+  if (counting) deliveries++;
+  if (conn == sender) {
+    conn->outstanding--;
+    if (counting) say(conn);
+  }
+}
+
+bool members_joined(void) {
+  for (int i = 0; i < bench.count; i++) {
+    if (bench.conns[i].state != CONN_CLOSED && bench.conns[i].counted == 0) return false;
+  }
+  return true;
+}
+
+void run_fanout(void) {
+  bench.on_frame = on_fanout;
+  open_clients(bench.clients);
+  wait_logged();
+  sender = bench.conns + bench.count;
+  open_clients(1);
+  wait_logged();
+  for (int i = 0; i < bench.count; i++) {
+    if (bench.conns[i].state != CONN_CLOSED) send_frame(bench.conns + i, "JOIN fan");
+  }
+  run_until(members_joined, now_us() + 60 * 1000000L);
+  settle(1000000);
+  printf("room members: %d (%d refused, %d closed)\n", bench.logged, bench.refused, bench.closed);
+  counting = true;
+  long cpu = server_cpu_us();
+  long start = now_us();
+  say(sender);
+  run_until(NULL, start + bench.seconds * 1000000L);
+  long elapsed = now_us() - start;
+  cpu = server_cpu_us() - cpu;
+  counting = false;
+  printf("messages sent: %lu (%.0f/s), deliveries: %lu (%.0f/s)\n", sent, sent * 1e6 / elapsed,
+    deliveries, deliveries * 1e6 / elapsed);
+  print_cpu(cpu, deliveries, "delivery");
+  printf("closed during the run: %d\n", bench.closed);
+}
+
+//login: the soak test
+void run_login(void) {
+  long cpu = server_cpu_us();
+  long rss = server_rss_kb();
+  long start = now_us();
+  open_clients(bench.clients);
+  wait_logged();
+  long elapsed = now_us() - start;
+  cpu = server_cpu_us() - cpu;
+  printf("logged in: %d of %d in %.1f s (%.0f/s), %d refused, %d closed\n", bench.logged, bench.clients,
+    elapsed / 1e6, bench.logged * 1e6 / elapsed, bench.refused, bench.closed);
+  print_cpu(cpu, bench.logged, "login");
+  int closed = bench.closed;
+  settle(bench.seconds * 1000000L);
+  long grown = server_rss_kb() - rss;
+  if (bench.pid > 0) {
+    printf("server rss: %ld MB, %.0f bytes per client\n", server_rss_kb() / 1024,
+      bench.logged ? grown * 1024.0 / bench.logged : 0.0);
+  }
+  printf("connections dropped while idle for %d s: %d\n", bench.seconds, bench.closed - closed);
+}
+
+//http: requests back to back on kept alive connections
+unsigned long responses;
+
+void on_response(conn_t *conn) {
+  if (conn->sent_at) {
+    record_latency(now_us() - conn->sent_at);
+    responses++;
+  }
+  static const char request[] = "GET / HTTP/1.1\r\nHost: bench\r\n\r\n";
+  conn->sent_at = now_us();
+  if (write_all(conn->fd, request, sizeof(request) - 1) < 0) close_conn(conn);
+}
+
+void run_http(void) {
+  bench.http = true;
+  bench.on_response = on_response;
+  open_clients(bench.clients);
+  run_until(all_connected, now_us() + 60 * 1000000L);
+  settle(1000000);
+  memset(bench.latency, 0, sizeof(bench.latency));
+  bench.samples = 0;
+  responses = 0;
+  long cpu = server_cpu_us();
+  long start = now_us();
+  run_until(NULL, start + bench.seconds * 1000000L);
+  long elapsed = now_us() - start;
+  cpu = server_cpu_us() - cpu;
+  printf("connections: %d (%d closed)\n", bench.count, bench.closed);
+  printf("requests: %lu (%.0f/s), p50 %ld us, p99 %ld us\n", responses, responses * 1e6 / elapsed,
+    latency_percentile(0.5), latency_percentile(0.99));
+  print_cpu(cpu, responses, "request");
+}
+
+//history: the room's backlog is sent again with every JOIN
+unsigned long replays;
+unsigned long replayed;
+
+void on_history(conn_t *conn) {
+  if (conn == sender) {
+    if (starts_with(conn->prefix, "SAY hist ")) conn->counted++;
+    return;
+  }
+  if (starts_with(conn->prefix, "SAY hist ")) {
+    replayed++;
+  } else if (starts_with(conn->prefix, "HISTORY hist ")) {
+    record_latency(now_us() - conn->sent_at);
+    replays++;
+    send_frame(conn, "PART hist");
+  } else if (starts_with(conn->prefix, "PART hist ") && own_frame(conn)) {
+    conn->sent_at = now_us();
+    send_frame(conn, "JOIN hist");
+  }
+}
+
+bool history_full(void) {
+  return sender->state == CONN_CLOSED || sender->counted >= (unsigned long)bench.window;
+}
+
+void run_history(void) {
+  bench.on_frame = on_history;
+  open_clients(bench.clients);
+  wait_logged();
+  sender = bench.conns + bench.count;
+  open_clients(1);
+  wait_logged();
+  send_frame(sender, "JOIN hist");
+  for (int i = 0; i < bench.window; i++) {
+    send_frame(sender, "SAY hist abcdefghijklmnopqrstuvwxyz0123456789");
+  }
+  run_until(history_full, now_us() + 10 * 1000000L);
+  settle(500000);
+  long cpu = server_cpu_us();
+  long start = now_us();
+  for (int i = 0; i < bench.count - 1; i++) {
+    if (bench.conns[i].state == CONN_CLOSED) continue;
+    bench.conns[i].sent_at = now_us();
+    send_frame(bench.conns + i, "JOIN hist");
+  }
+  run_until(NULL, start + bench.seconds * 1000000L);
+  long elapsed = now_us() - start;
+  cpu = server_cpu_us() - cpu;
+  printf("replays: %lu (%.0f/s, %.1f messages each), p50 %ld us, p99 %ld us\n", replays, replays * 1e6 / elapsed,
+    replays ? (double)replayed / replays : 0.0, latency_percentile(0.5), latency_percentile(0.99));
+  print_cpu(cpu, replays, "JOIN and PART");
+}
+
+void usage(char *name) {
+  printf("usage: %s idle|fanout|login|http|history [ip:IP] [port:PORT] [clients:N] [seconds:N] [window:N] [rate:N] [pid:N]\n", name);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) usage(argv[0]);
+  char *mode = argv[1];
+  char *ip = "127.0.0.1";
+  int port = 8000;
+  bench.clients = 100;
+  bench.seconds = 5;
+  bench.window = 8;
+  for (int i = 2; i < argc; i++) {
+    char *value = strchr(argv[i], ':');
+    if (value == NULL) usage(argv[0]);
+    value++;
+    if (starts_with(argv[i], "ip:")) {
+      ip = value;
+    } else if (starts_with(argv[i], "port:")) {
+      port = atoi(value);
+    } else if (starts_with(argv[i], "clients:")) {
+      bench.clients = atoi(value);
+    } else if (starts_with(argv[i], "seconds:")) {
+      bench.seconds = atoi(value);
+    } else if (starts_with(argv[i], "window:")) {
+      bench.window = atoi(value);
+    } else if (starts_with(argv[i], "rate:")) {
+      bench.rate = atoi(value);
+    } else if (starts_with(argv[i], "pid:")) {
+      bench.pid = atoi(value);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (port < 1 || bench.clients < 0 || bench.seconds < 1 || bench.window < 1) usage(argv[0]);
+
+  memset(&bench.address, 0, sizeof(bench.address));
+  bench.address.sin_family = AF_INET;
+  bench.address.sin_port = htons(port);
+  if (inet_pton(AF_INET, ip, &bench.address.sin_addr) <= 0) {
+    printf("%s is not a valid ip\n", ip);
+    exit(0);
+  }
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  bench.conns = calloc(bench.clients + 2, sizeof(conn_t));
+  bench.epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (!bench.conns || bench.epollfd < 0) {
+    perror("Setup error");
+    exit(1);
+  }
+  if (strcmp(mode, "idle") == 0) {
+    run_idle();
+  } else if (strcmp(mode, "fanout") == 0) {
+    run_fanout();
+  } else if (strcmp(mode, "login") == 0) {
+    run_login();
+  } else if (strcmp(mode, "http") == 0) {
+    run_http();
+  } else if (strcmp(mode, "history") == 0) {
+    run_history();
+  } else {
+    usage(argv[0]);
+  }
+  return 0;
+}
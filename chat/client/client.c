@@ -9,6 +9,7 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
@@ -19,6 +20,22 @@ typedef struct sockaddr_in SA_IN;
 #define BUFFER_SIZE 4096
 #define MAX_MESSAGE 8192
 #define MSG_SIZE 2048
+#define PROTOCOL_TEXT 1
+#define PROTOCOL_BINARY 2
+#define OP_MSG 1
+#define OP_NEW 2
+#define OP_OUT 3
+#define OP_LOGOUT 4
+#define OP_JOIN 5
+#define OP_PART 6
+#define OP_SAY 7
+#define OP_DM 8
+#define OP_MISSED 9
+#define OP_REPLAY 11
+#define OPCODES 12
+#define MAX_VARINT_LEN 5
+//a power of two holding a few of the largest frames the server sends
+#define RING_LEN (MAX_MESSAGE * 4)
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -33,13 +50,37 @@ struct {
   WINDOW *chatbox, *onlinelist, *msgbox;
 } chat;
 
+struct {
+  int protocol;
+  //messages typed without a command go to this room, the lobby by default
+  char room[NAME_LEN];
+  //binary frames name users by id, NEW and JOIN tell which name an id stands
+  //for, a user stays known while it shares a room with us
+  struct {
+    unsigned int id;
+    int refs;
+    char *name;
+  } *users;
+  int count;
+  int capacity;
+} session;
+
+//frames from the server are read in large chunks into a ring and handled
+//where they landed, only a body wrapping around its end is copied out
+struct {
+  char buf[RING_LEN];
+  char scratch[RING_LEN];
+  int head;
+  int len;
+} ring;
+
 struct tm *timestamp(void) {
   time_t now = time(0);
   return localtime(&now);
 }
 
 bool starts_with(char *str1, char *str2) {
-  return strncmp(str1, str2, strlen(str2) - 1) == 0;
+  return strncmp(str1, str2, strlen(str2)) == 0;
 }
 
 void cleanup(void) {
@@ -82,9 +123,13 @@ void add_user(char *user) {
 void remove_user(char *user) {
   pthread_mutex_lock(&mutex);
   int index = 0;
-  while (strcmp(chat.users[index], user) != 0) {
+  while (index < chat.max_lines && (chat.users[index] == NULL || strcmp(chat.users[index], user) != 0)) {
     index++;
   }
+  if (index == chat.max_lines) {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
   free(chat.users[index]);
   int start = 1;
   for (int i = index; i < chat.max_lines - 1; i++) {
@@ -97,6 +142,24 @@ void remove_user(char *user) {
   pthread_mutex_unlock(&mutex);
 }
 
+int send_frame(int serverfd, int op, const char *body) {
+  //binary frames are the opcode, the length as a varint and the body
+  int len = strlen(body);
+  char *frame = calloc(1 + MAX_VARINT_LEN + len, sizeof(char));
+  int header = 1;
+  frame[0] = op;
+  unsigned int value = len;
+  while (value >= 0x80) {
+    frame[header++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  frame[header++] = (char)value;
+  memcpy(frame + header, body, len);
+  int w = write(serverfd, frame, header + len);
+  free(frame);
+  return w;
+}
+
 int send_msg(int serverfd, const char *msg) {
   int datalen = strlen(msg);
   int data = htonl(datalen);
@@ -124,26 +187,165 @@ char *read_msg(int serverfd, int *err) {
     return NULL;
   }
   bufferlen = ntohl(bufferlen);
+  //the body is read straight into the message, NUL terminated by calloc
   char *newbuf = calloc(bufferlen + 1, sizeof(char));
   int bytes_read = 0;
-  while (bufferlen > 0) {
-    char *buffer = calloc(bufferlen, sizeof(char));
-    int r = read(serverfd, buffer, bufferlen);
+  while (bytes_read < bufferlen) {
+    int r = read(serverfd, newbuf + bytes_read, bufferlen - bytes_read);
     if (r <= 0) {
       if (err) *err = r;
-      free(buffer);
       free(newbuf);
       return NULL;
     }
-    strncat(newbuf, buffer, bufferlen);
-    bufferlen -= r;
     bytes_read += r;
-    free(buffer);
   }
   if (err) *err = bytes_read;
   return newbuf;
 }
 
+void ring_copy(char *dst, int len) {
+  int first = RING_LEN - ring.head;
+  if (first > len) first = len;
+  memcpy(dst, ring.buf + ring.head, first);
+  memcpy(dst + first, ring.buf, len - first);
+}
+
+void ring_consume(int len) {
+  ring.head = (ring.head + len) & (RING_LEN - 1);
+  ring.len -= len;
+  if (ring.len == 0) {
+    //starting over keeps most bodies away from the end
+    ring.head = 0;
+  }
+}
+
+int ring_fill(int serverfd) {
+  //one readv takes whatever fits, a byte stays free to NUL terminate a body
+  int tail = (ring.head + ring.len) & (RING_LEN - 1);
+  int space = RING_LEN - 1 - ring.len;
+  int first = RING_LEN - tail;
+  if (first > space) first = space;
+  struct iovec iov[2] = {
+    {ring.buf + tail, first},
+    {ring.buf, space - first}
+  };
+  int r = readv(serverfd, iov, space > first ? 2 : 1);
+  if (r > 0) {
+    ring.len += r;
+  }
+  return r;
+}
+
+char *next_frame(int *op, int *len) {
+  //returns the body of the next complete frame and leaves its header consumed,
+  //NULL while it's incomplete, len is -1 for a frame that can never fit
+  unsigned char header[1 + MAX_VARINT_LEN];
+  int available = ring.len < (int)sizeof(header) ? ring.len : (int)sizeof(header);
+  ring_copy((char *)header, available);
+  int header_len = 0;
+  unsigned int value = 0;
+  *op = 0;
+  *len = 0;
+  if (session.protocol == PROTOCOL_BINARY) {
+    for (int i = 1; i < available && header_len == 0; i++) {
+      value |= (unsigned int)(header[i] & 0x7f) << (7 * (i - 1));
+      if (!(header[i] & 0x80)) header_len = i + 1;
+    }
+    *op = header[0];
+    if (header_len == 0 && available == (int)sizeof(header)) {
+      *len = -1;
+    }
+  } else if (available >= (int)sizeof(int)) {
+    memcpy(&value, header, sizeof(int));
+    value = ntohl(value);
+    header_len = sizeof(int);
+  }
+  if (header_len == 0) {
+    return NULL;
+  }
+  if (value > (unsigned int)(RING_LEN - 1 - header_len)) {
+    *len = -1;
+    return NULL;
+  }
+  if (ring.len < header_len + (int)value) {
+    return NULL;
+  }
+  ring_consume(header_len);
+  *len = value;
+  if (ring.head + *len < RING_LEN) {
+    return ring.buf + ring.head;
+  }
+  ring_copy(ring.scratch, *len);
+  return ring.scratch;
+}
+
+char *user_name(unsigned int id) {
+  for (int i = 0; i < session.count; i++) {
+    if (session.users[i].id == id) {
+      return session.users[i].name;
+    }
+  }
+  return NULL;
+}
+
+void intern_user(unsigned int id, const char *name) {
+  for (int i = 0; i < session.count; i++) {
+    if (session.users[i].id == id) {
+      session.users[i].refs++;
+      return;
+    }
+  }
+  if (session.count == session.capacity) {
+    session.capacity = session.capacity ? session.capacity * 2 : 64;
+    session.users = realloc(session.users, session.capacity * sizeof(*session.users));
+  }
+  session.users[session.count].id = id;
+  session.users[session.count].refs = 1;
+  session.users[session.count].name = strdup(name);
+  session.count++;
+}
+
+void forget_user(unsigned int id) {
+  for (int i = 0; i < session.count; i++) {
+    if (session.users[i].id == id) {
+      if (--session.users[i].refs > 0) return;
+      free(session.users[i].name);
+      session.users[i] = session.users[--session.count];
+      return;
+    }
+  }
+}
+
+void show_message(char *message);
+
+void send_command(int serverfd, int op, const char *room, const char *text) {
+  //room commands and direct messages name the room or user first, binary
+  //frames put the length of the name in front of it and text ones a space after it
+  static const char *names[OPCODES] = {
+    [OP_MSG] = "MSG", [OP_JOIN] = "JOIN", [OP_PART] = "PART", [OP_SAY] = "SAY", [OP_DM] = "DM"
+  };
+  char buffer[MSG_SIZE + NAME_LEN + 8];
+  int len = 0;
+  if (session.protocol == PROTOCOL_TEXT) {
+    len = sprintf(buffer, "%s ", names[op]);
+  }
+  if (room && text && session.protocol == PROTOCOL_BINARY) {
+    buffer[len++] = strlen(room);
+  }
+  if (room) {
+    len += sprintf(buffer + len, text && session.protocol == PROTOCOL_TEXT ? "%s " : "%s", room);
+  }
+  if (text) {
+    len += sprintf(buffer + len, "%s", text);
+  }
+  buffer[len] = '\0';
+  if (session.protocol == PROTOCOL_BINARY) {
+    send_frame(serverfd, op, buffer);
+  } else {
+    send_msg(serverfd, buffer);
+  }
+}
+
 void *read_input(void *arg) {
   int serverfd = *(int *)arg;
   char message[MSG_SIZE];
@@ -154,12 +356,47 @@ void *read_input(void *arg) {
       continue;
     }
     if (strcmp(message, "/exit") == 0) {
+      if (session.protocol == PROTOCOL_BINARY) {
+        send_frame(serverfd, OP_LOGOUT, "");
+      } else {
+        send_msg(serverfd, "LOGOUT");
+      }
       break;
     }
-    char buffer[MSG_SIZE + 6];
-    memset(buffer, 0, MSG_SIZE + 6);
-    sprintf(buffer, "MSG %s", message);
-    send_msg(serverfd, buffer);
+    if (starts_with(message, "/join ") || starts_with(message, "/part ")) {
+      //the room stays the current one until another is joined or it's left
+      char *room = message + strlen("/join ");
+      bool join = starts_with(message, "/join ");
+      int room_len = strlen(room);
+      if (room_len >= NAME_LEN) {
+        //the server doesn't know rooms with longer names either
+        show_message("Room names are at most 19 characters long");
+        refresh_input();
+        continue;
+      }
+      send_command(serverfd, join ? OP_JOIN : OP_PART, room, NULL);
+      if (join) {
+        memcpy(session.room, room, room_len + 1);
+      } else if (strcmp(room, session.room) == 0) {
+        strcpy(session.room, "lobby");
+      }
+    } else if (starts_with(message, "/msg ")) {
+      //direct message, "/msg user text"
+      char *user = message + strlen("/msg ");
+      char *text = strchr(user, ' ');
+      if (text) {
+        *text++ = '\0';
+        send_command(serverfd, OP_DM, user, text);
+        char buf[MSG_SIZE];
+        if (snprintf(buf, MSG_SIZE, "(to %s) %s", user, text) < MSG_SIZE) {
+          show_message(buf);
+        }
+      }
+    } else if (strcmp(session.room, "lobby") == 0) {
+      send_command(serverfd, OP_MSG, NULL, message);
+    } else {
+      send_command(serverfd, OP_SAY, session.room, message);
+    }
     refresh_input();
   }
   return 0;
@@ -193,11 +430,190 @@ void *refresh_all(void *arg) {
   }
 }
 
+void show_message(char *message) {
+  int mem = strlen(message) + strlen("00:00 ") + 1;
+  char *buf = calloc(mem, sizeof(char));
+  struct tm *now = timestamp();
+  snprintf(buf, mem, "%02d:%02d %s", now->tm_hour, now->tm_min, message);
+  int len = strlen(buf);
+  int copied = 0;
+  while (len > 0) {
+    char *line = calloc(chat.messages_width + 1, sizeof(char));
+    int tocopy = chat.messages_width - 4;
+    strncpy(line, buf + copied, tocopy);
+    add_message(line);
+    copied += tocopy;
+    len -= tocopy;
+  }
+  free(buf);
+}
+
+void on_msg(unsigned int id, char *body, int len) {
+  char *name = user_name(id);
+  int mem = (name ? strlen(name) : 1) + strlen(": ") + strlen(body) + 1;
+  char *buf = calloc(mem, sizeof(char));
+  snprintf(buf, mem, "%s: %s", name ? name : "?", body);
+  show_message(buf);
+  free(buf);
+}
+
+void on_new(unsigned int id, char *body, int len) {
+  intern_user(id, body);
+  add_user(strdup(body));
+}
+
+void on_out(unsigned int id, char *body, int len) {
+  char *name = user_name(id);
+  if (name) {
+    remove_user(name);
+    forget_user(id);
+  }
+}
+
+void show_room_event(const char *room, const char *name, const char *event) {
+  char buf[MSG_SIZE];
+  snprintf(buf, MSG_SIZE, "%s %s %s", name, event, room);
+  show_message(buf);
+}
+
+char *split_name(char *body, int len, char *room) {
+  //room frames and direct messages start with the length of the room or
+  //user name and the name
+  int name_len = len > 0 ? (unsigned char)body[0] : 0;
+  if (name_len >= len || name_len >= NAME_LEN) {
+    return NULL;
+  }
+  memcpy(room, body + 1, name_len);
+  room[name_len] = '\0';
+  return body + 1 + name_len;
+}
+
+void on_say(unsigned int id, char *body, int len) {
+  char room[NAME_LEN];
+  char *text = split_name(body, len, room);
+  char *name = user_name(id);
+  if (text == NULL) return;
+  char buf[MSG_SIZE];
+  snprintf(buf, MSG_SIZE, "[%s] %s: %s", room, name ? name : "?", text);
+  show_message(buf);
+}
+
+void on_replay(unsigned int id, char *body, int len) {
+  //a message from a room's history names its sender, who may have left
+  char room[NAME_LEN];
+  char name[NAME_LEN];
+  char *named = split_name(body, len, room);
+  if (named == NULL) return;
+  char *text = split_name(named, len - (named - body), name);
+  if (text == NULL) return;
+  char buf[MSG_SIZE];
+  if (strcmp(room, "lobby") == 0) {
+    snprintf(buf, MSG_SIZE, "%s: %s", name, text);
+  } else {
+    snprintf(buf, MSG_SIZE, "[%s] %s: %s", room, name, text);
+  }
+  show_message(buf);
+}
+
+void on_join(unsigned int id, char *body, int len) {
+  char room[NAME_LEN];
+  char *name = split_name(body, len, room);
+  if (name == NULL) return;
+  intern_user(id, name);
+  show_room_event(room, name, "joined");
+}
+
+void on_part(unsigned int id, char *body, int len) {
+  char room[NAME_LEN];
+  char *name = user_name(id);
+  if (split_name(body, len, room) == NULL || name == NULL) return;
+  show_room_event(room, name, "left");
+  forget_user(id);
+}
+
+void on_dm(unsigned int id, char *body, int len) {
+  char name[NAME_LEN];
+  char *text = split_name(body, len, name);
+  if (text == NULL) return;
+  char buf[MSG_SIZE];
+  snprintf(buf, MSG_SIZE, "(from %s) %s", name, text);
+  show_message(buf);
+}
+
+void show_missed(unsigned int count) {
+  //the server drops chat for readers that fall too far behind
+  char buf[MSG_SIZE];
+  snprintf(buf, MSG_SIZE, "(you missed %u messages)", count);
+  show_message(buf);
+}
+
+void on_missed(unsigned int count, char *body, int len) {
+  show_missed(count);
+}
+
+void (*handlers[OPCODES])(unsigned int id, char *body, int len) = {
+  [OP_MSG] = on_msg,
+  [OP_NEW] = on_new,
+  [OP_OUT] = on_out,
+  [OP_JOIN] = on_join,
+  [OP_PART] = on_part,
+  [OP_SAY] = on_say,
+  [OP_DM] = on_dm,
+  [OP_MISSED] = on_missed,
+  [OP_REPLAY] = on_replay
+};
+
+void handle_binary(int op, char *payload, int len) {
+  //every frame from the server starts with the id of the user it is about
+  unsigned int id;
+  if (op >= OPCODES || handlers[op] == NULL || len < (int)sizeof(id)) {
+    return;
+  }
+  memcpy(&id, payload, sizeof(id));
+  handlers[op](ntohl(id), payload + sizeof(id), len - sizeof(id));
+}
+
+void handle_text(char *message) {
+  if (starts_with(message, "MSG ")) {
+    show_message(message + strlen("MSG "));
+  } else if (starts_with(message, "NEW ")) {
+    add_user(strdup(message + strlen("NEW ")));
+  } else if (starts_with(message, "OUT ")) {
+    remove_user(message + strlen("OUT "));
+  } else if (starts_with(message, "SAY ")) {
+    //SAY room name: text
+    char *room = message + strlen("SAY ");
+    char *text = strchr(room, ' ');
+    if (text == NULL) return;
+    *text++ = '\0';
+    char buf[MSG_SIZE];
+    snprintf(buf, MSG_SIZE, "[%s] %s", room, text);
+    show_message(buf);
+  } else if (starts_with(message, "DM ")) {
+    //DM name: text
+    char *name = message + strlen("DM ");
+    char *text = strstr(name, ": ");
+    if (text == NULL) return;
+    *text = '\0';
+    char buf[MSG_SIZE];
+    snprintf(buf, MSG_SIZE, "(from %s) %s", name, text + strlen(": "));
+    show_message(buf);
+  } else if (starts_with(message, "JOIN ") || starts_with(message, "PART ")) {
+    //JOIN room name and PART room name
+    char *room = message + strlen("JOIN ");
+    char *name = strchr(room, ' ');
+    if (name == NULL) return;
+    *name++ = '\0';
+    show_room_event(room, name, starts_with(message, "JOIN ") ? "joined" : "left");
+  } else if (starts_with(message, "MISSED ")) {
+    show_missed(strtoul(message + strlen("MISSED "), NULL, 10));
+  }
+}
+
 void *listen_server(void *arg) {
   int serverfd = *(int *)arg;
   while (true) {
-    int bytes;
-    char *message = read_msg(serverfd, &bytes);
+    int bytes = ring_fill(serverfd);
     if (bytes == -1) {
       perror("Message read error");
       break;
@@ -210,40 +626,27 @@ void *listen_server(void *arg) {
       add_message(buf);
       break;
     }
-    if (starts_with(message, "MSG")) {
-      char *message_offset = message + strlen("MSG ");
-      int mem = strlen(message_offset) + strlen("00:00 ") + 1;
-      char *buf = calloc(mem, sizeof(char));
-      struct tm *now = timestamp();
-      snprintf(buf, mem, "%02d:%02d %s", now->tm_hour, now->tm_min, message_offset);
-      int len = strlen(buf);
-      int copied = 0;
-      while (len > 0) {
-        char *line = calloc(chat.messages_width + 1, sizeof(char));
-        int tocopy = chat.messages_width - 4;
-        strncpy(line, buf + copied, tocopy);
-        add_message(line);
-        copied += tocopy;
-        len -= tocopy;
+    int op, len;
+    char *message;
+    while ((message = next_frame(&op, &len)) != NULL) {
+      //handled in place, NUL terminated for the text commands
+      char next = message[len];
+      message[len] = '\0';
+      if (session.protocol == PROTOCOL_BINARY) {
+        handle_binary(op, message, len);
+      } else {
+        handle_text(message);
       }
-      free(buf);
+      message[len] = next;
+      ring_consume(len);
     }
-    if (starts_with(message, "NEW")) {
-      char *message_offset = message + strlen("NEW ");
-      int mem = strlen(message_offset) + 1;
-      char *buf = calloc(mem, sizeof(char));
-      strncpy(buf, message_offset, mem);
-      add_user(buf);
-    }
-    if (starts_with(message, "OUT")) {
-      char *message_offset = message + strlen("OUT ");
-      int mem = strlen(message_offset) + 1;
-      char *buf = calloc(mem, sizeof(char));
-      strncpy(buf, message_offset, mem);
-      remove_user(buf);
-      free(buf);
+    if (len < 0) {
+      char str[] = "Bad frame from the server";
+      char *buf = calloc(strlen(str) + 1, sizeof(char));
+      strcpy(buf, str);
+      add_message(buf);
+      break;
     }
-    free(message);
   }
   return 0;
 }
@@ -336,7 +739,8 @@ int main(int argc, char **argv) {
 
   char buffer[BUFFER_SIZE];
   memset(buffer, 0, BUFFER_SIZE);
-  sprintf(buffer, "LOGIN %s", name);
+  //ask for the binary protocol, servers that don't know it answer a plain LOGGED
+  sprintf(buffer, "LOGIN %s v2", name);
   write(connfd, buffer, strlen(buffer));
   int bytes;
   char *response = read_msg(connfd, &bytes);
@@ -350,13 +754,18 @@ int main(int argc, char **argv) {
     cleanup();
     exit(0);
   }
-  if (strcmp(response, "LOGGED") == 0) {
+  strcpy(session.room, "lobby");
+  if (strcmp(response, "LOGGED") == 0 || strcmp(response, "LOGGED v2") == 0) {
+    session.protocol = strcmp(response, "LOGGED v2") == 0 ? PROTOCOL_BINARY : PROTOCOL_TEXT;
     free(response);
     pthread_t input, listen_thread, refresh_thread;
     pthread_create(&listen_thread, NULL, listen_server, &connfd);
     pthread_create(&input, NULL, read_input, &connfd);
     pthread_create(&refresh_thread, NULL, refresh_all, NULL);
     pthread_join(input, NULL);
+  } else if (strcmp(response, "TAKEN") == 0) {
+    printf("The nickname %s is already taken\n", name);
+    free(response);
   } else {
     printf("Couldn't log in, server response: %s\n", response);
     free(response);
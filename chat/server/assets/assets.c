@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/inotify.h>
+#include "assets.h"
+#include "../frame/frame.h"
+#include "../epoch/epoch.h"
+#include "../log/log.h"
+
+struct assets_t *acreate(void) {
+  struct assets_t *assets = calloc(1, sizeof(struct assets_t));
+  if (!assets) return NULL;
+  assets->inotify = -1;
+  return assets;
+}
+
+static frame_t *head(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static frame_t *head(const char *format, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  if (len < 0 || len >= (int)sizeof(buf)) return NULL;
+  return fraw(buf, len);
+}
+
+static void destroy_version(void *arg) {
+  struct asset_version_t *version = (struct asset_version_t *)arg;
+  frelease(version->body);
+  for (int keep = 0; keep < 2; keep++) {
+    frelease(version->ok[keep]);
+    frelease(version->not_modified[keep]);
+  }
+  free(version);
+}
+
+static struct asset_version_t *load(struct asset_t *asset) {
+  //the whole file goes into one frame, its hash is the ETag
+  FILE *file = fopen(asset->file, "r");
+  if (!file) return NULL;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  struct asset_version_t *version = size < 0 ? NULL : calloc(1, sizeof(struct asset_version_t));
+  if (version) version->body = fraw(NULL, size);
+  if (!version || !version->body || fread(version->body->data, 1, size, file) != (size_t)size) {
+    fclose(file);
+    if (version) destroy_version(version);
+    return NULL;
+  }
+  fclose(file);
+  unsigned long hash = 14695981039346656037UL;
+  for (long i = 0; i < size; i++) {
+    hash = (hash ^ (unsigned char)version->body->data[i]) * 1099511628211UL;
+  }
+  snprintf(version->etag, ETAG_LEN, "\"%016lx\"", hash);
+  const char *connection[] = {"close", "keep-alive"};
+  for (int keep = 0; keep < 2; keep++) {
+    version->ok[keep] = head("HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n"
+      "ETag: %s\r\nConnection: %s\r\n\r\n", asset->type, size, version->etag, connection[keep]);
+    version->not_modified[keep] = head("HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: %s\r\n\r\n",
+      version->etag, connection[keep]);
+    if (!version->ok[keep] || !version->not_modified[keep]) {
+      destroy_version(version);
+      return NULL;
+    }
+  }
+  return version;
+}
+
+static void reload(struct asset_t *asset) {
+  struct asset_version_t *version = load(asset);
+  struct asset_version_t *old = __atomic_exchange_n(&asset->version, version, __ATOMIC_ACQ_REL);
+  if (old) {
+    epoch_retire(old, destroy_version);
+  }
+  if (version) {
+    LOG(LOG_INFO, "Loaded %s (%d bytes, ETag %s)", asset->file, version->body->len, version->etag);
+  } else {
+    LOG(LOG_WARN, "Couldn't load %s, it's served as not found", asset->file);
+  }
+}
+
+int aadd(struct assets_t *assets, const char *path, const char *file, const char *type) {
+  if (assets->count == MAX_ASSETS || strlen(path) >= sizeof(assets->list[0].path) ||
+      strlen(file) >= sizeof(assets->list[0].file)) {
+    return 1;
+  }
+  struct asset_t *asset = assets->list + assets->count++;
+  strcpy(asset->path, path);
+  strcpy(asset->file, file);
+  asset->type = type;
+  asset->watch = -1;
+  char *slash = strrchr(asset->file, '/');
+  asset->name = slash ? slash + 1 : asset->file;
+  reload(asset);
+  return 0;
+}
+
+static void *watch_files(void *arg) {
+  struct assets_t *assets = (struct assets_t *)arg;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    //read is a cancellation point, aclear stops the thread there
+    int r = read(assets->inotify, buf, sizeof(buf));
+    if (r <= 0) {
+      if (r < 0 && errno == EINTR) continue;
+      LOG(LOG_ERROR, "Asset watch error: %m");
+      break;
+    }
+    for (int offset = 0; offset < r;) {
+      struct inotify_event *event = (struct inotify_event *)(buf + offset);
+      offset += sizeof(struct inotify_event) + event->len;
+      for (int i = 0; i < assets->count; i++) {
+        struct asset_t *asset = assets->list + i;
+        if (event->wd == asset->watch && event->len && strcmp(event->name, asset->name) == 0) {
+          reload(asset);
+        }
+      }
+    }
+    epoch_collect();
+  }
+  return 0;
+}
+
+void awatch(struct assets_t *assets) {
+  //directories are watched so files replaced by a rename are seen too
+  assets->inotify = inotify_init1(IN_CLOEXEC);
+  if (assets->inotify < 0) {
+    LOG(LOG_WARN, "Assets won't be reloaded: %m");
+    return;
+  }
+  for (int i = 0; i < assets->count; i++) {
+    struct asset_t *asset = assets->list + i;
+    char dir[sizeof(asset->file)];
+    int dir_len = asset->name - asset->file;
+    if (dir_len == 0) {
+      strcpy(dir, ".");
+    } else {
+      memcpy(dir, asset->file, dir_len);
+      dir[dir_len] = '\0';
+    }
+    asset->watch = inotify_add_watch(assets->inotify, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM);
+    if (asset->watch < 0) {
+      LOG(LOG_WARN, "Can't watch %s: %m", dir);
+    }
+  }
+  assets->watching = pthread_create(&assets->watcher, NULL, watch_files, assets) == 0;
+}
+
+struct asset_t *afind(struct assets_t *assets, const char *path, int len) {
+  for (int i = 0; i < assets->count; i++) {
+    struct asset_t *asset = assets->list + i;
+    if ((int)strlen(asset->path) == len && strncmp(asset->path, path, len) == 0) {
+      return asset;
+    }
+  }
+  return NULL;
+}
+
+struct asset_version_t *aversion(struct asset_t *asset) {
+  return __atomic_load_n(&asset->version, __ATOMIC_ACQUIRE);
+}
+
+void aclear(struct assets_t *assets) {
+  //only once no worker serves requests anymore
+  if (assets->watching) {
+    pthread_cancel(assets->watcher);
+    pthread_join(assets->watcher, NULL);
+  }
+  if (assets->inotify >= 0) {
+    close(assets->inotify);
+  }
+  for (int i = 0; i < assets->count; i++) {
+    if (assets->list[i].version) {
+      destroy_version(assets->list[i].version);
+    }
+  }
+  free(assets);
+}
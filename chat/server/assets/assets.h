@@ -0,0 +1,55 @@
+#ifndef __ASSETS
+#define __ASSETS
+
+#include "../server_types.h"
+#include <pthread.h>
+
+//files served over HTTP are read once into frames with their response heads
+//prebuilt, a watcher thread reloads one when it changes on disk
+#define MAX_ASSETS 16
+#define ETAG_LEN 24
+
+//one loaded copy of a file, immutable, a reload swaps in a new one and the
+//old one is freed through the epoch once no reader can see it
+struct asset_version_t {
+  frame_t *body;
+  //response heads without and with keep-alive
+  frame_t *ok[2];
+  frame_t *not_modified[2];
+  char etag[ETAG_LEN];
+};
+
+struct asset_t {
+  char path[64];
+  char file[256];
+  const char *type;
+  //NULL while the file can't be read, readers load it inside an epoch
+  struct asset_version_t *version;
+  //the watch on the file's directory and the file's name in it
+  int watch;
+  const char *name;
+};
+
+struct assets_t {
+  struct asset_t list[MAX_ASSETS];
+  int count;
+  int inotify;
+  pthread_t watcher;
+  bool watching;
+};
+
+struct assets_t *acreate(void);
+
+//serves file under path, returns 1 when there's no room for it
+int aadd(struct assets_t *assets, const char *path, const char *file, const char *type);
+//starts reloading the assets when their files change
+void awatch(struct assets_t *assets);
+
+//the asset for a request path, NULL for an unknown one
+struct asset_t *afind(struct assets_t *assets, const char *path, int len);
+//the loaded copy, only valid until the caller's epoch_exit
+struct asset_version_t *aversion(struct asset_t *asset);
+
+void aclear(struct assets_t *assets);
+
+#endif
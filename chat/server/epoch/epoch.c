@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include "epoch.h"
+
+struct retired_t {
+  void *ptr;
+  void (*destroy)(void *);
+  unsigned long epoch;
+  struct retired_t *next;
+};
+
+static unsigned long global_epoch = 0;
+static struct epoch_record_t *records = NULL;
+static struct retired_t *limbo = NULL;
+static pthread_mutex_t limbo_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t record_key;
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static __thread struct epoch_record_t *local = NULL;
+
+static void release_record(void *arg) {
+  //a thread that exits gives its record back for the next one to reuse
+  struct epoch_record_t *record = (struct epoch_record_t *)arg;
+  __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void create_key(void) {
+  pthread_key_create(&record_key, release_record);
+}
+
+static struct epoch_record_t *get_record(void) {
+  if (local) return local;
+  pthread_once(&record_once, create_key);
+  struct epoch_record_t *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+  while (record) {
+    int free_record = 0;
+    if (__atomic_compare_exchange_n(&record->in_use, &free_record, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      break;
+    }
+    record = record->next;
+  }
+  if (!record) {
+    record = (struct epoch_record_t *)calloc(1, sizeof(struct epoch_record_t));
+    if (!record) abort();
+    record->in_use = 1;
+    record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&records, &record->next, record, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  record->depth = 0;
+  pthread_setspecific(record_key, record);
+  local = record;
+  return record;
+}
+
+void epoch_enter(void) {
+  struct epoch_record_t *record = get_record();
+  if (record->depth++ > 0) return;
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  while (true) {
+    __atomic_store_n(&record->epoch, epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&record->active, 1, __ATOMIC_SEQ_CST);
+    unsigned long current = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    if (current == epoch) break;
+    epoch = current;
+  }
+}
+
+void epoch_exit(void) {
+  struct epoch_record_t *record = local;
+  if (--record->depth > 0) return;
+  __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+}
+
+static void try_advance(void) {
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  struct epoch_record_t *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+  while (record) {
+    if (__atomic_load_n(&record->in_use, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&record->active, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&record->epoch, __ATOMIC_SEQ_CST) != epoch) {
+      //a reader is still inside an older epoch
+      return;
+    }
+    record = record->next;
+  }
+  __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+  struct retired_t *retired = (struct retired_t *)malloc(sizeof(struct retired_t));
+  if (!retired) abort();
+  retired->ptr = ptr;
+  retired->destroy = destroy;
+  pthread_mutex_lock(&limbo_mutex);
+  retired->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  retired->next = limbo;
+  //epoch_collect peeks at limbo without the mutex
+  __atomic_store_n(&limbo, retired, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&limbo_mutex);
+  epoch_collect();
+}
+
+void epoch_collect(void) {
+  //anything retired two epochs ago can't be reachable by a reader anymore
+  if (!__atomic_load_n(&limbo, __ATOMIC_RELAXED)) return;
+  pthread_mutex_lock(&limbo_mutex);
+  try_advance();
+  try_advance();
+  unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  struct retired_t *expired = NULL;
+  struct retired_t **current = &limbo;
+  while (*current) {
+    struct retired_t *retired = *current;
+    if (retired->epoch + 2 <= epoch) {
+      __atomic_store_n(current, retired->next, __ATOMIC_RELAXED);
+      retired->next = expired;
+      expired = retired;
+    } else {
+      current = &retired->next;
+    }
+  }
+  pthread_mutex_unlock(&limbo_mutex);
+  while (expired) {
+    struct retired_t *next = expired->next;
+    expired->destroy(expired->ptr);
+    free(expired);
+    expired = next;
+  }
+}
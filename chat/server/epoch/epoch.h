@@ -0,0 +1,22 @@
+#ifndef __EPOCH
+#define __EPOCH
+
+//epoch based reclamation, memory unlinked from a shared structure is only
+//freed once every thread that could still be reading it has left its
+//read-side section
+
+struct epoch_record_t {
+  int active;
+  int depth;
+  int in_use;
+  unsigned long epoch;
+  struct epoch_record_t *next;
+};
+
+void epoch_enter(void);
+void epoch_exit(void);
+
+void epoch_retire(void *ptr, void (*destroy)(void *));
+void epoch_collect(void);
+
+#endif
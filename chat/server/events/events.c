@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include "events.h"
+#include "uring.h"
+
+struct events_t *ecreate(events_backend_t backend, int capacity) {
+  struct events_t *ev = (struct events_t *)calloc(1, sizeof(struct events_t));
+  if (!ev) return NULL;
+  ev->backend = backend;
+  ev->capacity = capacity;
+  ev->ready_len = capacity;
+  ev->epollfd = -1;
+  if (backend == EVENTS_URING) {
+    ev->uring = uring_create(capacity);
+    if (ev->uring) return ev;
+    ev->backend = backend = EVENTS_EPOLL;
+  }
+  if (backend == EVENTS_EPOLL) {
+    ev->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ev->ready = (struct epoll_event *)calloc(capacity, sizeof(struct epoll_event));
+    if (ev->epollfd < 0 || !ev->ready) {
+      eclear(ev);
+      return NULL;
+    }
+    return ev;
+  }
+  ev->fds = (struct pollfd *)calloc(capacity, sizeof(struct pollfd));
+  ev->slots = (int *)malloc(capacity * sizeof(int));
+  if (!ev->fds || !ev->slots) {
+    eclear(ev);
+    return NULL;
+  }
+  for (int i = 0; i < capacity; i++) {
+    ev->slots[i] = -1;
+  }
+  ev->slots_len = capacity;
+  return ev;
+}
+
+static int grow_poll(struct events_t *ev) {
+  //the table doubles when it's full, slots keep their position
+  int capacity = ev->capacity * 2;
+  struct pollfd *fds = (struct pollfd *)realloc(ev->fds, capacity * sizeof(struct pollfd));
+  if (!fds) return 1;
+  ev->fds = fds;
+  ev->capacity = capacity;
+  return 0;
+}
+
+static int grow_slots(struct events_t *ev, int fd) {
+  int len = ev->slots_len ? ev->slots_len : 16;
+  while (len <= fd) len *= 2;
+  int *slots = (int *)realloc(ev->slots, len * sizeof(int));
+  if (!slots) return 1;
+  for (int i = ev->slots_len; i < len; i++) {
+    slots[i] = -1;
+  }
+  ev->slots = slots;
+  ev->slots_len = len;
+  return 0;
+}
+
+static int slot_of(struct events_t *ev, int fd) {
+  return fd >= 0 && fd < ev->slots_len ? ev->slots[fd] : -1;
+}
+
+int eadd(struct events_t *ev, int fd) {
+  if (!ev) return 1;
+  if (ev->backend == EVENTS_URING) {
+    int err = uring_add(ev->uring, fd);
+    if (!err) ev->count++;
+    return err;
+  }
+  if (ev->backend == EVENTS_EPOLL) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(ev->epollfd, EPOLL_CTL_ADD, fd, &event) < 0) return 2;
+    ev->count++;
+    return 0;
+  }
+  if (fd < 0 || (fd >= ev->slots_len && grow_slots(ev, fd))) return 1;
+  if (ev->slots[fd] >= 0) return 2;
+  if (ev->count == ev->capacity && grow_poll(ev)) return 1;
+  int slot = ev->count++;
+  ev->fds[slot].fd = fd;
+  ev->fds[slot].events = POLLIN | POLLHUP;
+  ev->fds[slot].revents = 0;
+  ev->slots[fd] = slot;
+  return 0;
+}
+
+int eremove(struct events_t *ev, int fd) {
+  if (!ev) return 1;
+  if (ev->backend == EVENTS_URING) {
+    int err = uring_remove(ev->uring, fd);
+    if (!err) ev->count--;
+    return err;
+  }
+  if (ev->backend == EVENTS_EPOLL) {
+    if (epoll_ctl(ev->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) return 2;
+    ev->count--;
+    return 0;
+  }
+  int slot = slot_of(ev, fd);
+  if (slot < 0) return 1;
+  //the last socket takes the removed one's slot
+  ev->fds[slot] = ev->fds[--ev->count];
+  ev->slots[ev->fds[slot].fd] = slot;
+  ev->slots[fd] = -1;
+  return 0;
+}
+
+int emodify(struct events_t *ev, int fd, int events) {
+  if (!ev) return 1;
+  if (ev->backend == EVENTS_URING) {
+    return uring_modify(ev->uring, fd, events);
+  }
+  if (ev->backend == EVENTS_EPOLL) {
+    //writability edges are already reported
+    return 0;
+  }
+  int slot = slot_of(ev, fd);
+  if (slot < 0) return 1;
+  ev->fds[slot].events = POLLHUP;
+  if (events & EVENT_IN) ev->fds[slot].events |= POLLIN;
+  if (events & EVENT_OUT) ev->fds[slot].events |= POLLOUT;
+  return 0;
+}
+
+static int translate_epoll(unsigned int events) {
+  int result = 0;
+  if (events & EPOLLIN) result |= EVENT_IN;
+  if (events & EPOLLOUT) result |= EVENT_OUT;
+  if (events & (EPOLLHUP | EPOLLRDHUP)) result |= EVENT_HUP;
+  if (events & EPOLLERR) result |= EVENT_ERR;
+  return result;
+}
+
+static int translate_poll(short revents) {
+  int result = 0;
+  if (revents & POLLIN) result |= EVENT_IN;
+  if (revents & POLLOUT) result |= EVENT_OUT;
+  if (revents & POLLHUP) result |= EVENT_HUP;
+  if (revents & (POLLERR | POLLNVAL)) result |= EVENT_ERR;
+  return result;
+}
+
+int ewait(struct events_t *ev, event_t *ready, int max, int timeout) {
+  if (ev->backend == EVENTS_URING) {
+    return uring_wait(ev->uring, ready, max, timeout);
+  }
+  if (ev->backend == EVENTS_EPOLL) {
+    if (max > ev->ready_len) max = ev->ready_len;
+    int n = epoll_wait(ev->epollfd, ev->ready, max, timeout);
+    for (int i = 0; i < n; i++) {
+      ready[i].fd = ev->ready[i].data.fd;
+      ready[i].events = translate_epoll(ev->ready[i].events);
+    }
+    return n;
+  }
+  int res = poll(ev->fds, ev->count, timeout);
+  if (res <= 0) return res;
+  int n = 0;
+  int start = ev->next < ev->count ? ev->next : 0;
+  for (int k = 0; k < ev->count && n < max && n < res; k++) {
+    int i = (start + k) % ev->count;
+    if (!ev->fds[i].revents) continue;
+    ready[n].fd = ev->fds[i].fd;
+    ready[n].events = translate_poll(ev->fds[i].revents);
+    ev->fds[i].revents = 0;
+    ev->next = i + 1;
+    n++;
+  }
+  return n;
+}
+
+int ereadv(struct events_t *ev, int fd, const struct iovec *iov, int iovcnt) {
+  if (ev->backend == EVENTS_URING) {
+    return uring_readv(ev->uring, fd, iov, iovcnt);
+  }
+  return readv(fd, iov, iovcnt);
+}
+
+void ewritev(struct events_t *ev, ewrite_t *writes, int count) {
+  if (ev->backend == EVENTS_URING) {
+    uring_writev(ev->uring, writes, count);
+    return;
+  }
+  for (int i = 0; i < count; i++) {
+    int w = 0;
+    if (writes[i].iovcnt > 0) {
+      while ((w = writev(writes[i].fd, writes[i].iov, writes[i].iovcnt)) < 0 && errno == EINTR);
+    }
+    writes[i].res = w < 0 ? -errno : w;
+  }
+}
+
+char *etake(struct events_t *ev, int fd, int *len) {
+  *len = 0;
+  if (ev->backend == EVENTS_URING) {
+    return uring_take(ev->uring, fd, len);
+  }
+  //the other backends leave the bytes in the socket
+  return NULL;
+}
+
+void egive(struct events_t *ev, int fd, char *data, int len) {
+  if (ev->backend == EVENTS_URING) {
+    uring_give(ev->uring, fd, data, len);
+    return;
+  }
+  free(data);
+}
+
+void eclear(struct events_t *ev) {
+  if (!ev) return;
+  if (ev->epollfd >= 0) close(ev->epollfd);
+  uring_clear(ev->uring);
+  free(ev->ready);
+  free(ev->fds);
+  free(ev->slots);
+  free(ev);
+}
+
+const char *ebackend_name(events_backend_t backend) {
+  switch (backend) {
+    case EVENTS_URING: return "io_uring";
+    case EVENTS_EPOLL: return "epoll";
+    case EVENTS_POLL: return "poll";
+  }
+  return "unknown";
+}
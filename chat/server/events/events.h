@@ -0,0 +1,83 @@
+#ifndef __EVENTS
+#define __EVENTS
+
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include "../server_types.h"
+
+#define EVENT_IN 1
+#define EVENT_OUT 2
+#define EVENT_HUP 4
+#define EVENT_ERR 8
+
+//sockets are watched edge-triggered where the backend allows it (poll is always
+//level-triggered), so a handler has to read until EAGAIN before waiting again
+//epoll always reports EVENT_OUT after a write hit EAGAIN, poll and io_uring
+//only do it while emodify asked for it
+//io_uring receives into its own buffers as data arrives, so the sockets it
+//watches are only read with ereadv
+typedef enum {
+  EVENTS_POLL,
+  EVENTS_EPOLL,
+  EVENTS_URING
+} events_backend_t;
+
+typedef struct {
+  int fd;
+  int events;
+} event_t;
+
+//one write of a batch, res is what writev returned or -errno
+typedef struct {
+  int fd;
+  struct iovec *iov;
+  int iovcnt;
+  int res;
+} ewrite_t;
+
+struct events_t {
+  events_backend_t backend;
+  //the number of watched sockets is not limited, capacity is only the
+  //size the tables start with
+  int capacity;
+  int count;
+  //poll backend, the watched sockets packed at the front of a table that's
+  //doubled when full and every socket's slot in it, -1 for the others
+  struct pollfd *fds;
+  int *slots;
+  int slots_len;
+  //where the next wakeup starts taking ready sockets, right after the last
+  //one taken, so the ones that didn't fit in max go first next time
+  int next;
+  //epoll backend, only the ready sockets are reported
+  int epollfd;
+  struct epoll_event *ready;
+  int ready_len;
+  //io_uring backend, falls back to epoll when the kernel doesn't support it
+  struct uring_t *uring;
+};
+
+struct events_t *ecreate(events_backend_t backend, int capacity);
+
+int eadd(struct events_t *ev, int fd);
+int eremove(struct events_t *ev, int fd);
+int emodify(struct events_t *ev, int fd, int events);
+
+int ewait(struct events_t *ev, event_t *ready, int max, int timeout);
+
+//readv for a watched socket
+int ereadv(struct events_t *ev, int fd, const struct iovec *iov, int iovcnt);
+//every write of the batch, in one io_uring_enter with io_uring and one writev
+//each otherwise, returns once all of them are done
+void ewritev(struct events_t *ev, ewrite_t *writes, int count);
+//a socket moving to another worker takes what io_uring received for it and
+//wasn't read yet along, etake stops receiving before eremove and returns it,
+//NULL when there's none, egive hands it over after eadd to be read first
+char *etake(struct events_t *ev, int fd, int *len);
+void egive(struct events_t *ev, int fd, char *data, int len);
+
+void eclear(struct events_t *ev);
+
+const char *ebackend_name(events_backend_t backend);
+
+#endif
@@ -0,0 +1,736 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 16384
+//the buffers the multishot recvs fill, shared by every socket of the worker,
+//a power of two
+#define URING_BUFS 1024
+#define URING_BUF_LEN 2048
+#define URING_GROUP 0
+
+//what a completion belongs to, in the top bits of its user_data, with the
+//fd's generation and the fd (or the index of a write) below
+#define TAG_PROBE 0ULL
+#define TAG_RECV 1ULL
+#define TAG_POLL 2ULL
+#define TAG_OUT 3ULL
+#define TAG_SEND 4ULL
+#define TAG_CANCEL 5ULL
+#define TAG_SHIFT 60
+#define GEN_MASK 0x0fffffffU
+
+struct uring_fd {
+  //bumped when the fd is removed, completions of an older generation are
+  //stale, their buffers go straight back
+  unsigned int gen;
+  bool watched;
+  //connected sockets are received from, the other fds polled
+  bool stream;
+  //the multishot recv or poll is in flight
+  bool armed;
+  //a one-shot POLLOUT is in flight and whether it's still wanted
+  bool out_armed;
+  bool want_out;
+  //in the ready list with the events not handed out yet
+  bool queued;
+  int events;
+  //received and not read yet, buffer ids linked in order, the first one read
+  //up to offset
+  int first;
+  int last;
+  int offset;
+  //bytes another worker received for the socket, read before the buffers
+  char *given;
+  int given_len;
+  int given_offset;
+  //the peer hung up or the socket failed, once the buffers are read
+  bool eof;
+  int error;
+};
+
+struct uring_t {
+  int ringfd;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_size;
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned local_tail;
+  unsigned to_submit;
+  //the provided buffer ring, the kernel takes buffers from its head and they
+  //are put back at its tail once read, held counts the ones holding bytes
+  struct io_uring_buf_ring *br;
+  size_t br_size;
+  unsigned short br_tail;
+  char *bufs;
+  int lens[URING_BUFS];
+  int next[URING_BUFS];
+  int held;
+  struct uring_fd *fds;
+  int fds_len;
+  //fds with events to hand out, in the order they became ready
+  int *ready;
+  int ready_head;
+  int ready_count;
+  int ready_len;
+  //fds whose multishot request ended, armed again on the next wait
+  int *rearm;
+  int rearm_count;
+  int rearm_len;
+  //the batch uring_writev is waiting for
+  struct msghdr *msgs;
+  int msgs_len;
+  ewrite_t *writes;
+  int writes_count;
+  int writes_done;
+  int probed;
+};
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned long long tagged(struct uring_t *ring, unsigned long long tag, int fd) {
+  return tag << TAG_SHIFT | (unsigned long long)(ring->fds[fd].gen & GEN_MASK) << 32 | (unsigned int)fd;
+}
+
+static int submit(struct uring_t *ring, unsigned min_complete, int timeout) {
+  __atomic_store_n(ring->sq_tail, ring->local_tail, __ATOMIC_RELEASE);
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void *argp = NULL;
+  size_t argsz = 0;
+  if (min_complete && timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (long long)(timeout % 1000) * 1000000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long long)(unsigned long)&ts;
+    argp = &arg;
+    argsz = sizeof(arg);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  int res = sys_uring_enter(ring->ringfd, ring->to_submit, min_complete, flags, argp, argsz);
+  //what the kernel took is behind the head, even when the wait failed
+  ring->to_submit = ring->local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (res < 0 && errno == ETIME) return 0;
+  return res;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_t *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (ring->local_tail - head == ring->sq_entries) {
+    //the submission queue is full, flush it without waiting
+    if (submit(ring, 0, 0) < 0) return NULL;
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->local_tail - head == ring->sq_entries) return NULL;
+  }
+  unsigned index = ring->local_tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = ring->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  ring->local_tail++;
+  ring->to_submit++;
+  return sqe;
+}
+
+static void recycle(struct uring_t *ring, int bid) {
+  struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_BUFS - 1)];
+  buf->addr = (unsigned long)(ring->bufs + (size_t)bid * URING_BUF_LEN);
+  buf->len = URING_BUF_LEN;
+  buf->bid = bid;
+  ring->br_tail++;
+  __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+  ring->held--;
+}
+
+static int grow(int **list, int *len, int count) {
+  if (count < *len) return 0;
+  int grown = *len ? *len * 2 : 64;
+  int *larger = (int *)realloc(*list, grown * sizeof(int));
+  if (!larger) return 1;
+  *list = larger;
+  *len = grown;
+  return 0;
+}
+
+static void mark(struct uring_t *ring, int fd, int events) {
+  struct uring_fd *state = ring->fds + fd;
+  state->events |= events;
+  if (state->queued) return;
+  int end = ring->ready_head + ring->ready_count;
+  if (ring->ready_head > 0 && end == ring->ready_len) {
+    //what was handed out already makes room at the front
+    memmove(ring->ready, ring->ready + ring->ready_head, ring->ready_count * sizeof(int));
+    ring->ready_head = 0;
+    end = ring->ready_count;
+  }
+  if (grow(&ring->ready, &ring->ready_len, end)) return;
+  ring->ready[end] = fd;
+  ring->ready_count++;
+  state->queued = true;
+}
+
+static void push_rearm(struct uring_t *ring, int fd) {
+  if (grow(&ring->rearm, &ring->rearm_len, ring->rearm_count)) return;
+  ring->rearm[ring->rearm_count++] = fd;
+}
+
+static int translate(int res) {
+  int result = 0;
+  if (res & POLLIN) result |= EVENT_IN;
+  if (res & POLLOUT) result |= EVENT_OUT;
+  if (res & (POLLHUP | POLLRDHUP)) result |= EVENT_HUP;
+  if (res & (POLLERR | POLLNVAL)) result |= EVENT_ERR;
+  return result;
+}
+
+static void receive(struct uring_t *ring, struct uring_fd *state, int fd, struct io_uring_cqe *cqe, int bid) {
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (!more) state->armed = false;
+  if (cqe->res > 0 && bid >= 0) {
+    ring->lens[bid] = cqe->res;
+    ring->next[bid] = -1;
+    if (state->last >= 0) {
+      ring->next[state->last] = bid;
+    } else {
+      state->first = bid;
+    }
+    state->last = bid;
+    mark(ring, fd, EVENT_IN);
+  } else if (bid >= 0) {
+    recycle(ring, bid);
+  }
+  if (cqe->res == 0) {
+    state->eof = true;
+    mark(ring, fd, EVENT_IN | EVENT_HUP);
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    state->error = -cqe->res;
+    mark(ring, fd, EVENT_IN | EVENT_ERR);
+  }
+  //out of buffers, the socket keeps its bytes until some are read
+  if (!more && !state->eof && !state->error && cqe->res != -ECANCELED) {
+    push_rearm(ring, fd);
+  }
+}
+
+static void complete(struct uring_t *ring, struct io_uring_cqe *cqe) {
+  unsigned long long tag = cqe->user_data >> TAG_SHIFT;
+  int fd = (int)(cqe->user_data & 0xffffffff);
+  unsigned int gen = (unsigned int)(cqe->user_data >> 32) & GEN_MASK;
+  int bid = cqe->flags & IORING_CQE_F_BUFFER ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+  if (bid >= 0) ring->held++;
+  if (tag == TAG_SEND) {
+    if (ring->writes && fd < ring->writes_count) {
+      ring->writes[fd].res = cqe->res;
+      ring->writes_done++;
+    }
+    return;
+  }
+  if (tag == TAG_PROBE) {
+    if (cqe->res > 0 && bid >= 0 && (cqe->flags & IORING_CQE_F_MORE)) ring->probed = 1;
+    if (bid >= 0) recycle(ring, bid);
+    return;
+  }
+  struct uring_fd *state = fd < ring->fds_len ? ring->fds + fd : NULL;
+  if (tag == TAG_CANCEL || !state || !state->watched || (state->gen & GEN_MASK) != gen) {
+    //stale completion of a socket that has been removed since
+    if (bid >= 0) recycle(ring, bid);
+    return;
+  }
+  if (tag == TAG_OUT) {
+    state->out_armed = false;
+    if (cqe->res > 0 && state->want_out) mark(ring, fd, translate(cqe->res));
+    return;
+  }
+  if (tag == TAG_RECV) {
+    receive(ring, state, fd, cqe, bid);
+    return;
+  }
+  //the poll of a listener or an eventfd
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    state->armed = false;
+    if (cqe->res != -ECANCELED) push_rearm(ring, fd);
+  }
+  if (cqe->res > 0) mark(ring, fd, translate(cqe->res));
+}
+
+static void reap(struct uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    complete(ring, ring->cqes + (head & *ring->cq_mask));
+    head++;
+    if (head == tail) tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void prep_recv(struct io_uring_sqe *sqe, int fd) {
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_GROUP;
+}
+
+static int arm(struct uring_t *ring, int fd) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (!sqe) return 1;
+  if (ring->fds[fd].stream) {
+    prep_recv(sqe, fd);
+    sqe->user_data = tagged(ring, TAG_RECV, fd);
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = tagged(ring, TAG_POLL, fd);
+  }
+  ring->fds[fd].armed = true;
+  return 0;
+}
+
+static int cancel(struct uring_t *ring, int fd) {
+  //every request on the fd, submitted right away since the fd is about to be
+  //closed and a request in flight would keep the socket open
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (!sqe) return 1;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = TAG_CANCEL << TAG_SHIFT;
+  return submit(ring, 0, 0) < 0;
+}
+
+static bool probe(struct uring_t *ring) {
+  //multishot recv came in 6.0, a socket pair with a byte waiting tells if
+  //the kernel has it
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) < 0) return false;
+  if (write(pair[1], "x", 1) == 1) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe) {
+      prep_recv(sqe, pair[0]);
+      sqe->user_data = TAG_PROBE << TAG_SHIFT;
+      if (submit(ring, 1, 1000) >= 0) reap(ring);
+      sqe = get_sqe(ring);
+      if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = pair[0];
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->user_data = TAG_CANCEL << TAG_SHIFT;
+        if (submit(ring, 2, 1000) >= 0) reap(ring);
+      }
+    }
+  }
+  close(pair[0]);
+  close(pair[1]);
+  return ring->probed;
+}
+
+static int setup_buffers(struct uring_t *ring) {
+  ring->br_size = URING_BUFS * sizeof(struct io_uring_buf);
+  ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->br == MAP_FAILED) {
+    ring->br = NULL;
+    return 1;
+  }
+  ring->bufs = (char *)malloc((size_t)URING_BUFS * URING_BUF_LEN);
+  if (!ring->bufs) return 1;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)ring->br;
+  reg.ring_entries = URING_BUFS;
+  reg.bgid = URING_GROUP;
+  if (sys_uring_register(ring->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return 1;
+  ring->held = URING_BUFS;
+  for (int i = 0; i < URING_BUFS; i++) {
+    recycle(ring, i);
+  }
+  return 0;
+}
+
+struct uring_t *uring_create(int capacity) {
+  struct uring_t *ring = (struct uring_t *)calloc(1, sizeof(struct uring_t));
+  if (!ring) return NULL;
+  ring->ringfd = -1;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  //the kernel keeps the completions that don't fit (IORING_FEAT_NODROP
+  //predates EXT_ARG) and hands them out on the next waits
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = capacity * 2 > URING_CQ_ENTRIES ? capacity * 2 : URING_CQ_ENTRIES;
+  ring->ringfd = sys_uring_setup(URING_ENTRIES, &p);
+  if (ring->ringfd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+    //no io_uring support (old kernel or blocked by seccomp)
+    uring_clear(ring);
+    return NULL;
+  }
+  ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_size > ring->sq_size) ring->sq_size = ring->cq_size;
+    ring->cq_size = 0;
+  }
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    ring->sq_ptr = NULL;
+    uring_clear(ring);
+    return NULL;
+  }
+  ring->cq_ptr = ring->sq_ptr;
+  if (ring->cq_size) {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED) {
+      ring->cq_ptr = NULL;
+      uring_clear(ring);
+      return NULL;
+    }
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_clear(ring);
+    return NULL;
+  }
+  char *sq = (char *)ring->sq_ptr;
+  char *cq = (char *)ring->cq_ptr;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring->sq_entries = p.sq_entries;
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring->local_tail = *ring->sq_tail;
+  //provided buffer rings came in 5.19
+  if (setup_buffers(ring) || !probe(ring)) {
+    uring_clear(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+static int reserve_fd(struct uring_t *ring, int fd) {
+  if (fd < ring->fds_len) return 0;
+  int len = ring->fds_len ? ring->fds_len : 64;
+  while (len <= fd) len *= 2;
+  struct uring_fd *fds = (struct uring_fd *)realloc(ring->fds, len * sizeof(struct uring_fd));
+  if (!fds) return 1;
+  memset(fds + ring->fds_len, 0, (len - ring->fds_len) * sizeof(struct uring_fd));
+  ring->fds = fds;
+  ring->fds_len = len;
+  return 0;
+}
+
+static bool is_stream(int fd) {
+  //connected stream sockets, not the listener
+  int value = 0;
+  socklen_t len = sizeof(value);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &len) < 0 || value != SOCK_STREAM) return false;
+  len = sizeof(value);
+  return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) == 0 && !value;
+}
+
+int uring_add(struct uring_t *ring, int fd) {
+  if (fd < 0 || reserve_fd(ring, fd)) return 1;
+  struct uring_fd *state = ring->fds + fd;
+  if (state->watched) return 2;
+  state->watched = true;
+  state->stream = is_stream(fd);
+  state->armed = false;
+  state->out_armed = false;
+  state->want_out = false;
+  state->events = 0;
+  state->first = -1;
+  state->last = -1;
+  state->offset = 0;
+  state->eof = false;
+  state->error = 0;
+  if (arm(ring, fd)) {
+    state->watched = false;
+    return 1;
+  }
+  return 0;
+}
+
+static void drop_received(struct uring_t *ring, struct uring_fd *state) {
+  while (state->first >= 0) {
+    int bid = state->first;
+    state->first = ring->next[bid];
+    recycle(ring, bid);
+  }
+  state->last = -1;
+  state->offset = 0;
+  free(state->given);
+  state->given = NULL;
+}
+
+int uring_remove(struct uring_t *ring, int fd) {
+  if (fd < 0 || fd >= ring->fds_len || !ring->fds[fd].watched) return 1;
+  struct uring_fd *state = ring->fds + fd;
+  if (state->armed || state->out_armed) cancel(ring, fd);
+  drop_received(ring, state);
+  //a ready list entry left behind finds no events
+  state->watched = false;
+  state->events = 0;
+  state->gen++;
+  return 0;
+}
+
+int uring_modify(struct uring_t *ring, int fd, int events) {
+  if (fd < 0 || fd >= ring->fds_len || !ring->fds[fd].watched) return 1;
+  struct uring_fd *state = ring->fds + fd;
+  //a POLLOUT that's no longer wanted is ignored when it completes
+  state->want_out = events & EVENT_OUT;
+  if (!state->want_out || state->out_armed) return 0;
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (!sqe) return 1;
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = tagged(ring, TAG_OUT, fd);
+  state->out_armed = true;
+  return 0;
+}
+
+int uring_wait(struct uring_t *ring, event_t *ready, int max, int timeout) {
+  //requests the kernel ended are armed again, recvs only while there are
+  //buffers to receive into, and they go with the same io_uring_enter
+  int kept = 0;
+  for (int i = 0; i < ring->rearm_count; i++) {
+    int fd = ring->rearm[i];
+    struct uring_fd *state = ring->fds + fd;
+    if (!state->watched || state->armed || state->eof || state->error) continue;
+    if ((state->stream && ring->held == URING_BUFS) || arm(ring, fd)) {
+      ring->rearm[kept++] = fd;
+    }
+  }
+  ring->rearm_count = kept;
+  //nothing is waited for while more was ready than the last wait handed out
+  //or completions are in already
+  bool idle = ring->ready_count == 0 && *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (idle && timeout != 0) {
+    if (submit(ring, 1, timeout) < 0) return -1;
+  } else if (ring->to_submit && submit(ring, 0, 0) < 0) {
+    return -1;
+  }
+  reap(ring);
+  int n = 0;
+  while (ring->ready_count > 0 && n < max) {
+    int fd = ring->ready[ring->ready_head++];
+    ring->ready_count--;
+    struct uring_fd *state = ring->fds + fd;
+    state->queued = false;
+    if (!state->watched || !state->events) continue;
+    ready[n].fd = fd;
+    ready[n].events = state->events;
+    state->events = 0;
+    n++;
+  }
+  if (ring->ready_count == 0) ring->ready_head = 0;
+  return n;
+}
+
+static int available(struct uring_t *ring, struct uring_fd *state, char **src) {
+  if (state->given) {
+    *src = state->given + state->given_offset;
+    return state->given_len - state->given_offset;
+  }
+  if (state->first < 0) return 0;
+  *src = ring->bufs + (size_t)state->first * URING_BUF_LEN + state->offset;
+  return ring->lens[state->first] - state->offset;
+}
+
+static void consume(struct uring_t *ring, struct uring_fd *state, int len) {
+  if (state->given) {
+    state->given_offset += len;
+    if (state->given_offset == state->given_len) {
+      free(state->given);
+      state->given = NULL;
+    }
+    return;
+  }
+  state->offset += len;
+  if (state->offset < ring->lens[state->first]) return;
+  //the buffer goes back to the kernel as soon as it's read
+  int bid = state->first;
+  state->first = ring->next[bid];
+  if (state->first < 0) state->last = -1;
+  state->offset = 0;
+  recycle(ring, bid);
+}
+
+int uring_readv(struct uring_t *ring, int fd, const struct iovec *iov, int iovcnt) {
+  if (fd < 0 || fd >= ring->fds_len || !ring->fds[fd].watched || !ring->fds[fd].stream) {
+    return readv(fd, iov, iovcnt);
+  }
+  struct uring_fd *state = ring->fds + fd;
+  int total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    char *dst = (char *)iov[i].iov_base;
+    int space = (int)iov[i].iov_len;
+    char *src;
+    int len;
+    while (space > 0 && (len = available(ring, state, &src)) > 0) {
+      if (len > space) len = space;
+      memcpy(dst, src, len);
+      consume(ring, state, len);
+      dst += len;
+      space -= len;
+      total += len;
+    }
+    if (space > 0) break;
+  }
+  if (total > 0) return total;
+  if (state->error) {
+    errno = state->error;
+    return -1;
+  }
+  if (state->eof) return 0;
+  errno = EAGAIN;
+  return -1;
+}
+
+void uring_writev(struct uring_t *ring, ewrite_t *writes, int count) {
+  //sends on non-blocking sockets complete within the io_uring_enter that
+  //submits them, with -EAGAIN when the socket is full, the wait is only for
+  //the kernel to post them
+  if (count > ring->msgs_len) {
+    struct msghdr *msgs = (struct msghdr *)realloc(ring->msgs, count * sizeof(struct msghdr));
+    if (!msgs) {
+      for (int i = 0; i < count; i++) {
+        int w = writes[i].iovcnt > 0 ? writev(writes[i].fd, writes[i].iov, writes[i].iovcnt) : 0;
+        writes[i].res = w < 0 ? -errno : w;
+      }
+      return;
+    }
+    ring->msgs = msgs;
+    ring->msgs_len = count;
+  }
+  ring->writes = writes;
+  ring->writes_count = count;
+  ring->writes_done = 0;
+  for (int i = 0; i < count; i++) {
+    writes[i].res = 0;
+    struct io_uring_sqe *sqe = writes[i].iovcnt > 0 ? get_sqe(ring) : NULL;
+    if (!sqe) {
+      if (writes[i].iovcnt > 0) writes[i].res = -EAGAIN;
+      ring->writes_done++;
+      continue;
+    }
+    struct msghdr *msg = ring->msgs + i;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = writes[i].iov;
+    msg->msg_iovlen = writes[i].iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = writes[i].fd;
+    sqe->addr = (unsigned long)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->user_data = TAG_SEND << TAG_SHIFT | (unsigned int)i;
+  }
+  while (ring->writes_done < count) {
+    if (submit(ring, 1, -1) < 0 && errno != EINTR) {
+      //whatever didn't complete is tried again once the socket is writable
+      for (int i = 0; i < count; i++) {
+        if (writes[i].res == 0 && writes[i].iovcnt > 0) writes[i].res = -EAGAIN;
+      }
+      break;
+    }
+    reap(ring);
+  }
+  ring->writes = NULL;
+}
+
+char *uring_take(struct uring_t *ring, int fd, int *len) {
+  *len = 0;
+  if (fd < 0 || fd >= ring->fds_len || !ring->fds[fd].watched) return NULL;
+  struct uring_fd *state = ring->fds + fd;
+  if (state->armed && state->stream) {
+    //whatever the recv received until it was cancelled is in the buffers
+    //once its last completion is in
+    if (cancel(ring, fd)) return NULL;
+    while (state->armed) {
+      if (submit(ring, 1, -1) < 0 && errno != EINTR) break;
+      reap(ring);
+    }
+  }
+  int total = state->given ? state->given_len - state->given_offset : 0;
+  for (int bid = state->first; bid >= 0; bid = ring->next[bid]) {
+    total += ring->lens[bid] - (bid == state->first ? state->offset : 0);
+  }
+  char *data = total > 0 ? (char *)malloc(total) : NULL;
+  if (data) {
+    struct iovec iov = {data, total};
+    *len = uring_readv(ring, fd, &iov, 1);
+  }
+  drop_received(ring, state);
+  return data;
+}
+
+void uring_give(struct uring_t *ring, int fd, char *data, int len) {
+  if (!data) return;
+  if (fd < 0 || fd >= ring->fds_len || !ring->fds[fd].watched || len <= 0) {
+    free(data);
+    return;
+  }
+  struct uring_fd *state = ring->fds + fd;
+  free(state->given);
+  state->given = data;
+  state->given_len = len;
+  state->given_offset = 0;
+  mark(ring, fd, EVENT_IN);
+}
+
+void uring_clear(struct uring_t *ring) {
+  if (!ring) return;
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+  if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+  //closing the ring lets go of the buffer ring's registration
+  if (ring->ringfd >= 0) close(ring->ringfd);
+  if (ring->br) munmap(ring->br, ring->br_size);
+  for (int fd = 0; fd < ring->fds_len; fd++) {
+    free(ring->fds[fd].given);
+  }
+  free(ring->bufs);
+  free(ring->fds);
+  free(ring->ready);
+  free(ring->rearm);
+  free(ring->msgs);
+  free(ring);
+}
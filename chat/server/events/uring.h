@@ -0,0 +1,27 @@
+#ifndef __URING
+#define __URING
+
+#include "events.h"
+
+//io_uring backend, driven through raw syscalls so there is no liburing dependency
+//connected sockets are read by a multishot recv into a ring of buffers the
+//kernel picks from, the bytes wait there until uring_readv copies them out,
+//other fds (the listener, the mailbox's eventfd) get a multishot poll
+//a batch of writes goes to the kernel as sendmsg requests in one io_uring_enter
+
+struct uring_t *uring_create(int capacity);
+
+int uring_add(struct uring_t *ring, int fd);
+int uring_remove(struct uring_t *ring, int fd);
+int uring_modify(struct uring_t *ring, int fd, int events);
+
+int uring_wait(struct uring_t *ring, event_t *ready, int max, int timeout);
+
+int uring_readv(struct uring_t *ring, int fd, const struct iovec *iov, int iovcnt);
+void uring_writev(struct uring_t *ring, ewrite_t *writes, int count);
+char *uring_take(struct uring_t *ring, int fd, int *len);
+void uring_give(struct uring_t *ring, int fd, char *data, int len);
+
+void uring_clear(struct uring_t *ring);
+
+#endif
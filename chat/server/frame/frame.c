@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "frame.h"
+#include "../pool/pool.h"
+#include "../metrics/metrics.h"
+#include "../ws/ws.h"
+
+static struct frame_t *falloc(int body_len) {
+  //one extra byte keeps the body NUL terminated for the text protocol
+  struct frame_t *frame = (struct frame_t *)palloc(sizeof(struct frame_t) + FRAME_HEADER_LEN + body_len + 1);
+  if (!frame) return NULL;
+  memset(frame, 0, sizeof(struct frame_t));
+  frame->refs = 1;
+  frame->deliveries = 1;
+  frame->len = FRAME_HEADER_LEN + body_len;
+  int header = htonl(body_len);
+  memcpy(frame->data, &header, FRAME_HEADER_LEN);
+  frame->data[frame->len] = '\0';
+  return frame;
+}
+
+struct frame_t *fcreate(const char *body, int len) {
+  struct frame_t *frame = falloc(len);
+  if (!frame) return NULL;
+  memcpy(frame->data + FRAME_HEADER_LEN, body, len);
+  return frame;
+}
+
+struct frame_t *fformat(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  if (len < 0) return NULL;
+  struct frame_t *frame = falloc(len);
+  if (!frame) return NULL;
+  va_start(args, format);
+  vsnprintf(frame->data + FRAME_HEADER_LEN, len + 1, format, args);
+  va_end(args);
+  return frame;
+}
+
+struct frame_t *fraw(const char *data, int len) {
+  struct frame_t *frame = (struct frame_t *)palloc(sizeof(struct frame_t) + len + 1);
+  if (!frame) return NULL;
+  memset(frame, 0, sizeof(struct frame_t));
+  frame->refs = 1;
+  frame->deliveries = 1;
+  frame->raw = true;
+  frame->len = len;
+  if (data) memcpy(frame->data, data, len);
+  frame->data[len] = '\0';
+  return frame;
+}
+
+struct frame_t *fwebsocket(int op, const char *payload, int len) {
+  char header[WS_MAX_HEADER];
+  int header_len = wheader(header, op, len);
+  struct frame_t *frame = fraw(NULL, header_len + len);
+  if (!frame) return NULL;
+  memcpy(frame->data, header, header_len);
+  if (len) memcpy(frame->data + header_len, payload, len);
+  return frame;
+}
+
+struct frame_t *fws(struct frame_t *frame) {
+  struct frame_t *ws = __atomic_load_n(&frame->ws, __ATOMIC_ACQUIRE);
+  if (ws) return ws;
+  ws = fwebsocket(WS_TEXT, fbody(frame), fbody_len(frame));
+  if (!ws) return NULL;
+  ws->chat = frame->chat;
+  struct frame_t *expected = NULL;
+  if (!__atomic_compare_exchange_n(&frame->ws, &expected, ws, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    //another worker made it first
+    frelease(ws);
+    return expected;
+  }
+  return ws;
+}
+
+int fvarint(char *buf, unsigned int value) {
+  //seven bits per byte, the high bit marks that another byte follows
+  int len = 0;
+  while (value >= 0x80) {
+    buf[len++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  buf[len++] = (char)value;
+  return len;
+}
+
+struct frame_t *fbinary(int op, unsigned int id, const char *body, int len) {
+  char header[1 + MAX_VARINT_LEN];
+  header[0] = (char)op;
+  int header_len = 1 + fvarint(header + 1, sizeof(id) + len);
+  struct frame_t *frame = fraw(NULL, header_len + sizeof(id) + len);
+  if (!frame) return NULL;
+  memcpy(frame->data, header, header_len);
+  unsigned int wire_id = htonl(id);
+  memcpy(frame->data + header_len, &wire_id, sizeof(id));
+  //without a body the caller fills the payload in
+  if (len && body) memcpy(frame->data + header_len + sizeof(id), body, len);
+  return frame;
+}
+
+struct frame_t *fbinary_named(int op, unsigned int id, const char *name, const char *body, int len) {
+  return fbinary_names(op, id, name, NULL, body, len);
+}
+
+struct frame_t *fbinary_names(int op, unsigned int id, const char *first, const char *second, const char *body, int len) {
+  int first_len = strlen(first);
+  int second_len = second ? strlen(second) : 0;
+  int payload_len = 1 + first_len + (second ? 1 + second_len : 0) + len;
+  struct frame_t *frame = fbinary(op, id, NULL, payload_len);
+  if (!frame) return NULL;
+  char *payload = frame->data + frame->len - payload_len;
+  *payload++ = (char)first_len;
+  memcpy(payload, first, first_len);
+  payload += first_len;
+  if (second) {
+    *payload++ = (char)second_len;
+    memcpy(payload, second, second_len);
+    payload += second_len;
+  }
+  if (len) memcpy(payload, body, len);
+  return frame;
+}
+
+struct frame_t *fretain(struct frame_t *frame) {
+  if (frame->received) __atomic_add_fetch(&frame->deliveries, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+  return frame;
+}
+
+struct frame_t *fhold(struct frame_t *frame) {
+  __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+  return frame;
+}
+
+static long now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+void funhold(struct frame_t *frame) {
+  if (!frame) return;
+  if (__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    frelease(frame->binary);
+    frelease(frame->ws);
+    frelease(frame->replay);
+    pfree(frame);
+  }
+}
+
+void frelease(struct frame_t *frame) {
+  if (!frame) return;
+  //every encoding is queued as the text frame, so the last delivery dropped
+  //is the last write of the message or its last copy dropped, a history
+  //replay delivers it again but it's only recorded once
+  if (frame->received && __atomic_sub_fetch(&frame->deliveries, 1, __ATOMIC_ACQ_REL) == 0 &&
+      !__atomic_exchange_n(&frame->recorded, true, __ATOMIC_ACQ_REL)) {
+    hrecord(&metrics_local()->fan_out, now_us() - frame->received);
+  }
+  funhold(frame);
+}
+
+char *fbody(struct frame_t *frame) {
+  return frame->data + FRAME_HEADER_LEN;
+}
+
+int fbody_len(const struct frame_t *frame) {
+  return frame->len - FRAME_HEADER_LEN;
+}
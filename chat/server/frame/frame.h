@@ -0,0 +1,64 @@
+#ifndef __FRAME
+#define __FRAME
+
+#include "../server_types.h"
+
+//an immutable wire frame, the length prefix and the body in one buffer
+//shared by every outbound queue it was put on and freed with the last reference
+//a text frame may carry the same message encoded for the binary protocol
+//and, once a WebSocket client is sent it, for WebSockets, queues hold the
+//text frame whatever encoding they write
+struct frame_t {
+  int refs;
+  //references that deliver the message, all but the ones a room's history
+  //holds, only counted for frames with received set
+  int deliveries;
+  int len;
+  struct frame_t *binary;
+  struct frame_t *ws;
+  //what binary clients are replayed from a room's history, REPLAY names the
+  //sender who may have left since, made by the first replay to one of them
+  struct frame_t *replay;
+  //raw frames are written as they are to clients of every protocol
+  bool raw;
+  //chat messages may be dropped for a client that can't keep up, presence
+  //and replies never are
+  bool chat;
+  //when the message it carries was read in microseconds, 0 for the others,
+  //the last delivery dropped records the fan-out latency
+  long received;
+  bool recorded;
+  //the message's sequence number in its room's history, 0 outside of one
+  unsigned int seq;
+  char data[];
+};
+
+struct frame_t *fcreate(const char *body, int len);
+struct frame_t *fformat(const char *format, ...);
+//raw frames hold bytes exactly as they go on the wire, without a length prefix
+struct frame_t *fraw(const char *data, int len);
+//a binary protocol frame, the opcode, the varint length, the user id and the body
+struct frame_t *fbinary(int op, unsigned int id, const char *body, int len);
+//the same with a room or user name, its length byte first, in front of the body
+struct frame_t *fbinary_named(int op, unsigned int id, const char *name, const char *body, int len);
+//two names, the second one may be NULL
+struct frame_t *fbinary_names(int op, unsigned int id, const char *first, const char *second, const char *body, int len);
+
+//a raw WebSocket frame from the server
+struct frame_t *fwebsocket(int op, const char *payload, int len);
+//a text frame as a WebSocket text message, made by the first worker that needs
+//it and shared by every later one
+struct frame_t *fws(struct frame_t *frame);
+
+int fvarint(char *buf, unsigned int value);
+
+struct frame_t *fretain(struct frame_t *frame);
+void frelease(struct frame_t *frame);
+//references that keep the frame around without delivering it
+struct frame_t *fhold(struct frame_t *frame);
+void funhold(struct frame_t *frame);
+
+char *fbody(struct frame_t *frame);
+int fbody_len(const struct frame_t *frame);
+
+#endif
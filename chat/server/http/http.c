@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include "http.h"
+
+#define METHOD_MAX 8
+
+bool hsniff(const char *buf, int len) {
+  //a method is an upper case token followed by a space
+  for (int i = 0; i < len; i++) {
+    if (buf[i] == ' ') return i > 0;
+    if (buf[i] < 'A' || buf[i] > 'Z' || i == METHOD_MAX) return false;
+  }
+  return true;
+}
+
+static const char *line_end(const char *line, const char *end) {
+  const char *found = memmem(line, end - line, "\r\n", 2);
+  return found ? found : end;
+}
+
+static bool has_token(const char *value, int len, const char *token) {
+  //header values like Connection are comma separated lists
+  int token_len = strlen(token);
+  for (int i = 0; i < len;) {
+    while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+    int start = i;
+    while (i < len && value[i] != ',' && value[i] != ' ' && value[i] != '\t') i++;
+    if (i - start == token_len && strncasecmp(value + start, token, token_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *hheader(const http_request_t *request, const char *name, int *len) {
+  int name_len = strlen(name);
+  const char *end = request->headers + request->headers_len;
+  for (const char *line = request->headers; line < end;) {
+    const char *next = line_end(line, end);
+    if (next - line > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0) {
+      const char *value = line + name_len + 1;
+      while (value < next && (*value == ' ' || *value == '\t')) value++;
+      const char *value_end = next;
+      while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+      *len = value_end - value;
+      return value;
+    }
+    line = next + 2;
+  }
+  return NULL;
+}
+
+http_result_t hparse(const char *buf, int len, int *scanned, http_request_t *request) {
+  //only what arrived since the last call is searched, the end may straddle it
+  int from = *scanned > 3 ? *scanned - 3 : 0;
+  const char *blank = memmem(buf + from, len - from, "\r\n\r\n", 4);
+  if (!blank) {
+    *scanned = len;
+    return len >= HTTP_MAX_HEAD ? HTTP_TOO_LARGE : HTTP_PARTIAL;
+  }
+  *scanned = 0;
+  memset(request, 0, sizeof(http_request_t));
+  request->len = blank + 4 - buf;
+  const char *end = blank + 2;
+  //the request line, METHOD /path HTTP/1.x
+  const char *line = line_end(buf, end);
+  const char *method_end = memchr(buf, ' ', line - buf);
+  if (!method_end) return HTTP_BAD;
+  int method_len = method_end - buf;
+  if (method_len == 3 && strncmp(buf, "GET", 3) == 0) {
+    request->method = HTTP_GET;
+  } else if (method_len == 4 && strncmp(buf, "HEAD", 4) == 0) {
+    request->method = HTTP_HEAD;
+  } else {
+    return HTTP_UNSUPPORTED;
+  }
+  const char *path = method_end + 1;
+  const char *path_end = memchr(path, ' ', line - path);
+  if (!path_end || *path != '/') return HTTP_BAD;
+  request->path = path;
+  request->path_len = path_end - path;
+  const char *query = memchr(path, '?', path_end - path);
+  if (query) request->path_len = query - path;
+  const char *version = path_end + 1;
+  if (line - version != (int)strlen("HTTP/1.x") || strncmp(version, "HTTP/1.", strlen("HTTP/1.")) != 0 ||
+      (version[7] != '0' && version[7] != '1')) {
+    return HTTP_BAD;
+  }
+  //every header line needs a name and a colon
+  request->headers = line + 2;
+  request->headers_len = end - request->headers;
+  int count = 0;
+  for (const char *header = request->headers; header < end; count++) {
+    const char *next = line_end(header, end);
+    const char *colon = memchr(header, ':', next - header);
+    if (!colon || colon == header || memchr(header, ' ', colon - header)) return HTTP_BAD;
+    header = next + 2;
+  }
+  if (count > HTTP_MAX_HEADERS) return HTTP_TOO_LARGE;
+  //the next request starts right after the head, so bodies aren't taken
+  int value_len;
+  const char *value = hheader(request, "Content-Length", &value_len);
+  if ((value && strtol(value, NULL, 10) != 0) || hheader(request, "Transfer-Encoding", &value_len)) {
+    return HTTP_UNSUPPORTED;
+  }
+  value = hheader(request, "Connection", &value_len);
+  if (value && has_token(value, value_len, "close")) {
+    request->keep_alive = false;
+  } else if (value && has_token(value, value_len, "keep-alive")) {
+    request->keep_alive = true;
+  } else {
+    request->keep_alive = version[7] == '1';
+  }
+  return HTTP_DONE;
+}
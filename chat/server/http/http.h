@@ -0,0 +1,51 @@
+#ifndef __HTTP
+#define __HTTP
+
+#include "../server_types.h"
+
+//requests are parsed in place in the client's read buffer as their bytes
+//arrive, a request's head has to fit in it whole
+#define HTTP_MAX_HEAD (CLIENT_BUFFER_LEN - 1)
+#define HTTP_MAX_HEADERS 32
+//requests answered per wakeup of a pipelining connection, their responses
+//go out with one writev and the rest wait until it's written
+#define HTTP_PIPELINE 16
+
+//unread bytes discarded when a connection is closed after its response
+#define HTTP_LINGER_BYTES (KB * 64)
+
+#define HTTP_GET 1
+#define HTTP_HEAD 2
+
+typedef enum {
+  //the head isn't complete yet
+  HTTP_PARTIAL,
+  HTTP_DONE,
+  HTTP_BAD,
+  HTTP_TOO_LARGE,
+  //a method other than GET and HEAD or a request with a body
+  HTTP_UNSUPPORTED
+} http_result_t;
+
+typedef struct {
+  int method;
+  const char *path;
+  int path_len;
+  //the header lines, from the first one to the blank line ending them
+  const char *headers;
+  int headers_len;
+  bool keep_alive;
+  //bytes the whole request takes
+  int len;
+} http_request_t;
+
+//whether buf starts like a request line, false once it can't be one
+bool hsniff(const char *buf, int len);
+//parses the request at the start of buf, scanned keeps how many bytes were
+//already searched for the end of the head between calls and is reset with
+//every request parsed
+http_result_t hparse(const char *buf, int len, int *scanned, http_request_t *request);
+//the value of a header, NULL when the request has none
+const char *hheader(const http_request_t *request, const char *name, int *len);
+
+#endif
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include "log.h"
+
+int log_level = LOG_INFO;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring_t *rings;
+static __thread struct log_ring_t *own;
+//records of threads that couldn't get a ring
+static unsigned long lost;
+
+static pthread_t writer;
+static bool running;
+static bool stopping;
+static unsigned long reported;
+
+static struct log_ring_t *own_ring(void) {
+  //a thread's ring is made with its first record and kept until lstop
+  if (own) return own;
+  struct log_ring_t *ring = calloc(1, sizeof(struct log_ring_t));
+  if (!ring) return NULL;
+  ring->records = malloc(LOG_RING_LEN * sizeof(struct log_record_t));
+  if (!ring->records) {
+    free(ring);
+    return NULL;
+  }
+  pthread_mutex_lock(&rings_mutex);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_mutex);
+  own = ring;
+  return ring;
+}
+
+static const char *conversion(const char *p, bool *star, int *longs) {
+  //skips the flags, width, precision and length of the spec p points into,
+  //returns where its conversion letter is
+  *star = false;
+  *longs = 0;
+  while (*p && strchr("-+ #0123456789.*", *p)) {
+    if (*p == '*') *star = true;
+    p++;
+  }
+  while (*p == 'l' || *p == 'z') {
+    (*longs)++;
+    p++;
+  }
+  return p;
+}
+
+#define PUT(type, value) do { \
+  if (len + (int)sizeof(type) > cap) return len; \
+  type v = (value); \
+  memcpy(args + len, &v, sizeof(type)); \
+  len += sizeof(type); \
+} while (0)
+
+static int pack(char *args, int cap, const char *format, va_list ap) {
+  //copies the arguments in the order the format takes them, strings are cut
+  //short rather than leaving no room for what comes after them
+  int len = 0;
+  for (const char *p = format; *p; p++) {
+    if (*p != '%') continue;
+    if (*++p == '%') continue;
+    bool star;
+    int longs;
+    p = conversion(p, &star, &longs);
+    int precision = -1;
+    if (star) {
+      precision = va_arg(ap, int);
+      PUT(int, precision);
+    }
+    switch (*p) {
+      case 'd': case 'i': case 'u': case 'x': case 'c':
+        if (longs) {
+          PUT(long, va_arg(ap, long));
+        } else {
+          PUT(int, va_arg(ap, int));
+        }
+        break;
+      case 's': {
+        const char *str = va_arg(ap, const char *);
+        if (!str) str = "(null)";
+        int n = precision >= 0 ? (int)strnlen(str, precision) : (int)strlen(str);
+        int room = cap - len - 1 - 16;
+        if (n > room) n = room > 0 ? room : 0;
+        if (len + n + 1 > cap) return len;
+        memcpy(args + len, str, n);
+        args[len + n] = '\0';
+        len += n + 1;
+        break;
+      }
+      case '\0':
+        return len;
+    }
+  }
+  return len;
+}
+
+#define TAKE(type, dst) do { \
+  if (args + sizeof(type) > end) goto cut; \
+  memcpy(&(dst), args, sizeof(type)); \
+  args += sizeof(type); \
+} while (0)
+
+static void format(FILE *out, struct log_record_t *record) {
+  const char *args = record->args;
+  const char *end = record->args + record->len;
+  const char *p = record->format;
+  while (*p) {
+    if (*p != '%') {
+      const char *literal = p;
+      while (*p && *p != '%') p++;
+      fwrite(literal, 1, p - literal, out);
+      continue;
+    }
+    const char *spec = p++;
+    if (*p == '%') {
+      fputc('%', out);
+      p++;
+      continue;
+    }
+    bool star;
+    int longs;
+    p = conversion(p, &star, &longs);
+    if (!*p) break;
+    char conv = *p++;
+    //the spec alone, with its arguments it formats one value
+    char one[16];
+    if (p - spec >= (int)sizeof(one)) goto cut;
+    memcpy(one, spec, p - spec);
+    one[p - spec] = '\0';
+    int precision = 0;
+    if (star) TAKE(int, precision);
+    switch (conv) {
+      case 'd': case 'i': case 'u': case 'x': case 'c':
+        if (longs) {
+          long value;
+          TAKE(long, value);
+          star ? fprintf(out, one, precision, value) : fprintf(out, one, value);
+        } else {
+          int value;
+          TAKE(int, value);
+          star ? fprintf(out, one, precision, value) : fprintf(out, one, value);
+        }
+        break;
+      case 's': {
+        if (args >= end) goto cut;
+        const char *str = args;
+        args += strlen(str) + 1;
+        star ? fprintf(out, one, precision, str) : fprintf(out, one, str);
+        break;
+      }
+      case 'm':
+        fputs(strerror(record->err), out);
+        break;
+    }
+  }
+  fputc('\n', out);
+  return;
+cut:
+  //the record ran out of room
+  fputs("...\n", out);
+}
+
+void llog(log_level_t level, const char *format, ...) {
+  int err = errno;
+  struct log_ring_t *ring = own_ring();
+  if (!ring) {
+    __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+    errno = err;
+    return;
+  }
+  unsigned long tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_LEN) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    errno = err;
+    return;
+  }
+  struct log_record_t *record = ring->records + (tail & (LOG_RING_LEN - 1));
+  record->format = format;
+  record->level = level;
+  record->err = err;
+  va_list args;
+  va_start(args, format);
+  record->len = pack(record->args, sizeof(record->args), format, args);
+  va_end(args);
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  errno = err;
+}
+
+static int drain(void) {
+  //formats everything the rings hold right now, returns how many records
+  int count = 0;
+  pthread_mutex_lock(&rings_mutex);
+  struct log_ring_t *ring = rings;
+  pthread_mutex_unlock(&rings_mutex);
+  for (; ring; ring = ring->next) {
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct log_record_t *record = ring->records + (head & (LOG_RING_LEN - 1));
+      format(record->level == LOG_ERROR ? stderr : stdout, record);
+      count++;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+  unsigned long dropped = ldropped();
+  if (dropped != reported) {
+    fprintf(stdout, "%lu log records dropped\n", dropped - reported);
+    reported = dropped;
+  }
+  if (count > 0) {
+    fflush(stdout);
+    fflush(stderr);
+  }
+  return count;
+}
+
+static void *write_records(void *arg) {
+  while (true) {
+    if (drain() > 0) continue;
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) break;
+    usleep(LOG_IDLE_US);
+  }
+  return 0;
+}
+
+void lstart(log_level_t level) {
+  lset_level(level);
+  if (pthread_create(&writer, NULL, write_records, NULL) == 0) {
+    running = true;
+  }
+}
+
+void lstop(void) {
+  if (running) {
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    running = false;
+  }
+  drain();
+  //every thread that logged is gone or about to be
+  pthread_mutex_lock(&rings_mutex);
+  while (rings) {
+    struct log_ring_t *next = rings->next;
+    free(rings->records);
+    free(rings);
+    rings = next;
+  }
+  pthread_mutex_unlock(&rings_mutex);
+  own = NULL;
+}
+
+void lset_level(log_level_t level) {
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+const char *llevel_name(log_level_t level) {
+  return level_names[level];
+}
+
+int llevel_parse(const char *name) {
+  for (int level = LOG_ERROR; level <= LOG_DEBUG; level++) {
+    if (strcmp(name, level_names[level]) == 0) return level;
+  }
+  return -1;
+}
+
+unsigned long ldropped(void) {
+  unsigned long dropped = __atomic_load_n(&lost, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&rings_mutex);
+  for (struct log_ring_t *ring = rings; ring; ring = ring->next) {
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&rings_mutex);
+  return dropped;
+}
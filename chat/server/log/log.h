@@ -0,0 +1,62 @@
+#ifndef __LOG
+#define __LOG
+
+#include "../server_types.h"
+#include <pthread.h>
+
+//logging never waits on output: a record is the format and its raw arguments
+//written into a ring of the calling thread, a background thread formats them
+//and writes them out, a full ring drops the record and counts it
+//formats take %d %i %u %x %c %s %.*s with the l and z modifiers and %m for
+//errno at the time of the call, strings are copied into the record
+typedef enum {
+  LOG_ERROR,
+  LOG_WARN,
+  LOG_INFO,
+  LOG_DEBUG
+} log_level_t;
+
+#define LOG_RING_LEN 1024
+#define LOG_RECORD_LEN 256
+//how long the writer sleeps once every ring is empty
+#define LOG_IDLE_US 5000
+
+struct log_record_t {
+  const char *format;
+  int level;
+  int err;
+  int len;
+  char args[LOG_RECORD_LEN - sizeof(char *) - 3 * sizeof(int)];
+};
+
+//one producer, the thread it belongs to, and one consumer, the writer
+struct log_ring_t {
+  struct log_record_t *records;
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+  unsigned long dropped;
+  struct log_ring_t *next;
+};
+
+extern int log_level;
+
+//arguments aren't even evaluated for a level that's off
+#define LOG(level, ...) do { \
+  if ((int)(level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)) llog((level), __VA_ARGS__); \
+} while (0)
+
+void llog(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void lstart(log_level_t level);
+//writes what's left and stops the writer
+void lstop(void);
+
+void lset_level(log_level_t level);
+const char *llevel_name(log_level_t level);
+//returns -1 for an unknown name
+int llevel_parse(const char *name);
+
+//records lost to full rings so far
+unsigned long ldropped(void);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "mailbox.h"
+
+struct mailbox_t *mcreate(int capacity) {
+  struct mailbox_t *box = (struct mailbox_t *)aligned_alloc(64, sizeof(struct mailbox_t));
+  if (!box) return NULL;
+  unsigned long len = 1;
+  while (len < (unsigned long)capacity) len <<= 1;
+  box->cells = (struct mailbox_cell_t *)calloc(len, sizeof(struct mailbox_cell_t));
+  box->mask = len - 1;
+  box->head = 0;
+  box->tail = 0;
+  box->signalled = false;
+  box->overflowing = false;
+  pthread_mutex_init(&box->overflow_mutex, NULL);
+  box->overflow = box->taken = NULL;
+  box->overflow_len = box->overflow_cap = 0;
+  box->taken_len = box->taken_cap = box->taken_pos = 0;
+  box->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (!box->cells || box->fd < 0) {
+    mclear(box);
+    return NULL;
+  }
+  //a cell is free for the producer whose position matches its sequence
+  for (unsigned long i = 0; i < len; i++) {
+    box->cells[i].seq = i;
+  }
+  return box;
+}
+
+static int ring_post(struct mailbox_t *box, command_t command) {
+  unsigned long pos = __atomic_load_n(&box->tail, __ATOMIC_RELAXED);
+  struct mailbox_cell_t *cell;
+  while (true) {
+    cell = box->cells + (pos & box->mask);
+    unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)(seq - pos);
+    if (diff == 0) {
+      //claim the cell, a failed exchange reloads pos
+      if (__atomic_compare_exchange_n(&box->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    } else if (diff < 0) {
+      //the worker hasn't taken the command a lap ago yet
+      return 1;
+    } else {
+      pos = __atomic_load_n(&box->tail, __ATOMIC_RELAXED);
+    }
+  }
+  cell->command = command;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int mpost(struct mailbox_t *box, command_t command) {
+  //once a command overflowed, later ones can't overtake it through the ring
+  if (!__atomic_load_n(&box->overflowing, __ATOMIC_ACQUIRE) && ring_post(box, command) == 0) {
+    mwake(box);
+    return 0;
+  }
+  int res = 1;
+  pthread_mutex_lock(&box->overflow_mutex);
+  if (box->overflow_len == box->overflow_cap) {
+    int cap = box->overflow_cap ? box->overflow_cap * 2 : 1024;
+    command_t *overflow = (command_t *)realloc(box->overflow, cap * sizeof(command_t));
+    if (overflow) {
+      box->overflow = overflow;
+      box->overflow_cap = cap;
+    }
+  }
+  if (box->overflow_len < box->overflow_cap) {
+    box->overflow[box->overflow_len++] = command;
+    __atomic_store_n(&box->overflowing, true, __ATOMIC_RELEASE);
+  } else {
+    res = -1;
+  }
+  pthread_mutex_unlock(&box->overflow_mutex);
+  mwake(box);
+  return res;
+}
+
+void mwake(struct mailbox_t *box) {
+  //only the first post after the worker woke up pays for the syscall
+  if (!__atomic_exchange_n(&box->signalled, true, __ATOMIC_SEQ_CST)) {
+    uint64_t one = 1;
+    write(box->fd, &one, sizeof(one));
+  }
+}
+
+void mwoken(struct mailbox_t *box) {
+  uint64_t count;
+  read(box->fd, &count, sizeof(count));
+  __atomic_store_n(&box->signalled, false, __ATOMIC_SEQ_CST);
+}
+
+static int ring_take(struct mailbox_t *box, command_t *command) {
+  struct mailbox_cell_t *cell = box->cells + (box->head & box->mask);
+  unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+  if ((long)(seq - (box->head + 1)) < 0) {
+    return 0;
+  }
+  *command = cell->command;
+  //hand the cell to the producer one lap ahead
+  __atomic_store_n(&cell->seq, box->head + box->mask + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&box->head, box->head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int mtake(struct mailbox_t *box, command_t *command) {
+  //what's in the ring was posted before the overflow or at the same time,
+  //the overflow is only taken once the ring is empty and its commands only
+  //handled after whatever reached the ring before they were taken
+  while (true) {
+    if (ring_take(box, command)) return 1;
+    if (box->taken_pos < box->taken_len) {
+      *command = box->taken[box->taken_pos++];
+      return 1;
+    }
+    if (!__atomic_load_n(&box->overflowing, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&box->overflow_mutex);
+    command_t *taken = box->taken;
+    int taken_cap = box->taken_cap;
+    box->taken = box->overflow;
+    box->taken_cap = box->overflow_cap;
+    box->taken_len = box->overflow_len;
+    box->taken_pos = 0;
+    box->overflow = taken;
+    box->overflow_cap = taken_cap;
+    box->overflow_len = 0;
+    if (box->taken_len == 0) {
+      //posts go through the ring again
+      __atomic_store_n(&box->overflowing, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&box->overflow_mutex);
+  }
+}
+
+void mclear(struct mailbox_t *box) {
+  if (!box) return;
+  if (box->fd >= 0) close(box->fd);
+  pthread_mutex_destroy(&box->overflow_mutex);
+  free(box->overflow);
+  free(box->taken);
+  free(box->cells);
+  free(box);
+}
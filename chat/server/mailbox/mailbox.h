@@ -0,0 +1,59 @@
+#ifndef __MAILBOX
+#define __MAILBOX
+
+#include "../server_types.h"
+#include <pthread.h>
+
+//a bounded lock-free queue of commands for one worker, any thread may post
+//and only the worker takes them out, the eventfd wakes it up
+//commands posted to a full ring go to an overflow list instead, in order,
+//and so does every later one until the worker took them all, nothing posted
+//is ever dropped
+typedef struct {
+  int type;
+  long val;
+  void *ptr;
+  void *arg;
+} command_t;
+
+struct mailbox_cell_t {
+  unsigned long seq;
+  command_t command;
+};
+
+struct mailbox_t {
+  struct mailbox_cell_t *cells;
+  unsigned long mask;
+  //the consumer and the producers stay on separate cache lines
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+  bool signalled;
+  int fd;
+  bool overflowing __attribute__((aligned(64)));
+  pthread_mutex_t overflow_mutex;
+  command_t *overflow;
+  int overflow_len;
+  int overflow_cap;
+  //the overflow the worker took, handled once the ring is empty
+  command_t *taken;
+  int taken_len;
+  int taken_cap;
+  int taken_pos;
+};
+
+//capacity is rounded up to a power of two
+struct mailbox_t *mcreate(int capacity);
+
+//returns 1 when the ring was full and the command overflowed, -1 when not
+//even the overflow list could grow
+int mpost(struct mailbox_t *box, command_t command);
+//returns 0 when the mailbox is empty, the worker has to call mwoken first
+int mtake(struct mailbox_t *box, command_t *command);
+//consumes the wakeup, commands posted from now on signal again
+void mwoken(struct mailbox_t *box);
+//wakes the worker up without a command
+void mwake(struct mailbox_t *box);
+
+void mclear(struct mailbox_t *box);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "metrics.h"
+
+static struct metrics_t *blocks;
+static struct metrics_t spare = {.worker = -1};
+static __thread struct metrics_t *own;
+
+struct metrics_t *metrics_local(void) {
+  if (own) return own;
+  struct metrics_t *block = aligned_alloc(64, sizeof(struct metrics_t));
+  if (!block) {
+    //counts still add up, only with contention
+    own = &spare;
+    return own;
+  }
+  memset(block, 0, sizeof(struct metrics_t));
+  block->worker = -1;
+  //blocks are only ever pushed in front, readers walk from any head they saw
+  block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&blocks, &block->next, block, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  own = block;
+  return block;
+}
+
+struct metrics_t *metrics_list(void) {
+  return __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+}
+
+static void add_block(stats_t *total, histogram_t *fan_out, struct metrics_t *block) {
+  //stats_t is all counters, read one by one so a torn copy can't happen
+  unsigned long *dst = (unsigned long *)total;
+  unsigned long *src = (unsigned long *)&block->stats;
+  for (size_t i = 0; i < sizeof(stats_t) / sizeof(unsigned long); i++) {
+    unsigned long value = __atomic_load_n(src + i, __ATOMIC_RELAXED);
+    if (i == offsetof(stats_t, max_queue_depth) / sizeof(unsigned long) ||
+        i == offsetof(stats_t, max_flush_delay) / sizeof(unsigned long)) {
+      if (value > dst[i]) dst[i] = value;
+    } else {
+      dst[i] += value;
+    }
+  }
+  if (fan_out) hmerge(fan_out, &block->fan_out);
+}
+
+void metrics_sum(stats_t *total, histogram_t *fan_out) {
+  memset(total, 0, sizeof(stats_t));
+  if (fan_out) memset(fan_out, 0, sizeof(histogram_t));
+  add_block(total, fan_out, &spare);
+  for (struct metrics_t *block = metrics_list(); block; block = block->next) {
+    add_block(total, fan_out, block);
+  }
+}
+
+void metrics_clear(void) {
+  //only once every thread that counted is gone
+  struct metrics_t *block = __atomic_exchange_n(&blocks, NULL, __ATOMIC_ACQ_REL);
+  while (block) {
+    struct metrics_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  own = NULL;
+}
+
+static int bucket_of(unsigned long value) {
+  if (value >= 1UL << HIST_MAX_BITS) value = (1UL << HIST_MAX_BITS) - 1;
+  if (value < 1UL << HIST_SUB_BITS) return value;
+  int shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + ((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+unsigned long hbucket_max(int bucket) {
+  if (bucket < 1 << HIST_SUB_BITS) return bucket;
+  int shift = (bucket >> HIST_SUB_BITS) - 1;
+  unsigned long lower = (unsigned long)((1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift;
+  return lower + (1UL << shift) - 1;
+}
+
+void hrecord(histogram_t *hist, unsigned long value) {
+  //only the owning thread records, atomics keep readers from tearing
+  __atomic_add_fetch(&hist->counts[bucket_of(value)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->sum, value, __ATOMIC_RELAXED);
+}
+
+void hmerge(histogram_t *dst, const histogram_t *src) {
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+  }
+  dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+  dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+}
+
+unsigned long hpercentile(const histogram_t *hist, double q) {
+  //bucket counts are the truth, count may be a little ahead of them
+  unsigned long total = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) total += hist->counts[i];
+  if (total == 0) return 0;
+  unsigned long rank = (unsigned long)(q * total);
+  if (rank >= total) rank = total - 1;
+  unsigned long seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen > rank) return hbucket_max(i);
+  }
+  return hbucket_max(HIST_BUCKETS - 1);
+}
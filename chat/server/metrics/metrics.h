@@ -0,0 +1,45 @@
+#ifndef __METRICS
+#define __METRICS
+
+#include "../server_types.h"
+
+//every thread counts into its own block, so the hot path never writes a
+//cache line another thread writes, blocks are only added up when read
+//histograms are log-linear like HDR ones: values below 2^HIST_SUB_BITS get a
+//bucket each, every power of two above is split into 2^HIST_SUB_BITS buckets
+#define HIST_SUB_BITS 3
+//values are clamped to 2^HIST_MAX_BITS - 1, about 18 minutes in microseconds
+#define HIST_MAX_BITS 30
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct {
+  unsigned long counts[HIST_BUCKETS];
+  unsigned long count;
+  unsigned long sum;
+} histogram_t;
+
+struct metrics_t {
+  stats_t stats;
+  //microseconds from a message being read to the last write of it
+  histogram_t fan_out;
+  //the worker the thread runs, -1 for the others
+  int worker;
+  struct metrics_t *next;
+} __attribute__((aligned(64)));
+
+//the calling thread's block, made on first use
+struct metrics_t *metrics_local(void);
+//every block so far, newer ones first
+struct metrics_t *metrics_list(void);
+//adds up every block, the max_ fields take the largest
+void metrics_sum(stats_t *total, histogram_t *fan_out);
+void metrics_clear(void);
+
+void hrecord(histogram_t *hist, unsigned long value);
+void hmerge(histogram_t *dst, const histogram_t *src);
+//the highest value the bucket counts
+unsigned long hbucket_max(int bucket);
+//the value below which a q fraction of the recorded ones are
+unsigned long hpercentile(const histogram_t *hist, double q);
+
+#endif
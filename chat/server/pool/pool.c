@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+//the class sits in front of the block, padded so blocks stay 16 byte aligned
+#define POOL_HEADER 16
+#define POOL_MALLOC POOL_CLASSES
+
+static struct pool_shared_t shared[POOL_CLASSES] = {
+  [0 ... POOL_CLASSES - 1] = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0}
+};
+
+static __thread struct {
+  struct pool_block_t *free;
+  int count;
+} cache[POOL_CLASSES];
+
+static int class_of(int size) {
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    if (size <= 1 << (POOL_MIN_SHIFT + c)) return c;
+  }
+  return POOL_MALLOC;
+}
+
+static void refill(int c) {
+  //takes a batch from the shared list or carves a new slab
+  struct pool_shared_t *pool = shared + c;
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->free && cache[c].count < POOL_BATCH) {
+    struct pool_block_t *block = pool->free;
+    pool->free = block->next;
+    pool->count--;
+    block->next = cache[c].free;
+    cache[c].free = block;
+    cache[c].count++;
+  }
+  if (cache[c].count == 0) {
+    int block_len = (1 << (POOL_MIN_SHIFT + c)) + POOL_HEADER;
+    char *slab = (char *)malloc((size_t)block_len * POOL_BATCH);
+    if (slab) {
+      for (int i = 0; i < POOL_BATCH; i++) {
+        struct pool_block_t *block = (struct pool_block_t *)(slab + i * block_len);
+        block->next = cache[c].free;
+        cache[c].free = block;
+      }
+      cache[c].count = POOL_BATCH;
+      pool->carved += POOL_BATCH;
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static void spill(int c) {
+  struct pool_shared_t *pool = shared + c;
+  pthread_mutex_lock(&pool->mutex);
+  for (int i = 0; i < POOL_BATCH; i++) {
+    struct pool_block_t *block = cache[c].free;
+    cache[c].free = block->next;
+    cache[c].count--;
+    block->next = pool->free;
+    pool->free = block;
+    pool->count++;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+void *palloc(int size) {
+  int c = class_of(size);
+  char *block;
+  if (c == POOL_MALLOC) {
+    block = (char *)malloc((size_t)size + POOL_HEADER);
+  } else {
+    if (cache[c].count == 0) refill(c);
+    block = (char *)cache[c].free;
+    if (block) {
+      cache[c].free = cache[c].free->next;
+      cache[c].count--;
+    }
+  }
+  if (!block) return NULL;
+  *(int *)block = c;
+  return block + POOL_HEADER;
+}
+
+void *pcalloc(int size) {
+  void *ptr = palloc(size);
+  if (ptr) memset(ptr, 0, size);
+  return ptr;
+}
+
+void pfree(void *ptr) {
+  if (!ptr) return;
+  char *block = (char *)ptr - POOL_HEADER;
+  int c = *(int *)block;
+  if (c == POOL_MALLOC) {
+    free(block);
+    return;
+  }
+  //blocks freed by another thread than the one that took them just change caches
+  struct pool_block_t *free_block = (struct pool_block_t *)block;
+  free_block->next = cache[c].free;
+  cache[c].free = free_block;
+  if (++cache[c].count > POOL_CACHE_LEN) spill(c);
+}
+
+int pblock_len(int size) {
+  int c = class_of(size);
+  return (c == POOL_MALLOC ? size : 1 << (POOL_MIN_SHIFT + c)) + POOL_HEADER;
+}
+
+unsigned long pcarved(void) {
+  unsigned long bytes = 0;
+  for (int c = 0; c < POOL_CLASSES; c++) {
+    bytes += __atomic_load_n(&shared[c].carved, __ATOMIC_RELAXED) * ((1 << (POOL_MIN_SHIFT + c)) + POOL_HEADER);
+  }
+  return bytes;
+}
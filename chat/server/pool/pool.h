@@ -0,0 +1,40 @@
+#ifndef __POOL
+#define __POOL
+
+#include "../server_types.h"
+#include <pthread.h>
+
+//size classed pools for connections, their buffers and frames, every class
+//is a power of two from 64 bytes to 16 KB, blocks are carved out of slabs
+//and never go back to malloc
+//every thread keeps its own free lists so allocating and freeing don't take
+//a lock, a list that grows past POOL_CACHE_LEN spills a batch into the shared
+//one and an empty list refills from it before a new slab is carved
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASSES 9
+#define POOL_CACHE_LEN 256
+#define POOL_BATCH 32
+
+struct pool_block_t {
+  struct pool_block_t *next;
+};
+
+struct pool_shared_t {
+  pthread_mutex_t mutex;
+  struct pool_block_t *free;
+  int count;
+  //blocks carved so far, for the stats
+  unsigned long carved;
+};
+
+//sizes above the largest class go straight to malloc
+void *palloc(int size);
+void *pcalloc(int size);
+void pfree(void *ptr);
+
+//what a palloc of size really takes, its class and the header in front
+int pblock_len(int size);
+//bytes carved into blocks of every class
+unsigned long pcarved(void);
+
+#endif
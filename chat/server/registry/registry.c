@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include "registry.h"
+
+struct registry_t *rcreate() {
+  struct registry_t *reg = (struct registry_t *)calloc(1, sizeof(struct registry_t));
+  if (!reg) return NULL;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    pthread_mutex_init(&reg->shards[i].mutex, NULL);
+    pthread_mutex_init(&reg->names[i].mutex, NULL);
+  }
+  return reg;
+}
+
+static struct registry_shard_t *shard_of(struct registry_t *reg, int fd) {
+  return reg->shards + fd % REGISTRY_SHARDS;
+}
+
+static int reserve(struct registry_shard_t *shard, int slot) {
+  if (slot >= shard->by_fd_len) {
+    int len = shard->by_fd_len ? shard->by_fd_len : 16;
+    while (len <= slot) len *= 2;
+    client_t **by_fd = (client_t **)realloc(shard->by_fd, len * sizeof(client_t *));
+    if (!by_fd) return 1;
+    memset(by_fd + shard->by_fd_len, 0, (len - shard->by_fd_len) * sizeof(client_t *));
+    shard->by_fd = by_fd;
+    shard->by_fd_len = len;
+  }
+  if (shard->count == shard->capacity) {
+    int capacity = shard->capacity ? shard->capacity * 2 : 16;
+    client_t **members = (client_t **)realloc(shard->members, capacity * sizeof(client_t *));
+    if (!members) return 1;
+    shard->members = members;
+    shard->capacity = capacity;
+  }
+  return 0;
+}
+
+int radd(struct registry_t *reg, client_t *client) {
+  if (!reg || client->socket < 0 || (unsigned int)client->socket > REGISTRY_FD_MASK) return 1;
+  struct registry_shard_t *shard = shard_of(reg, client->socket);
+  int slot = client->socket / REGISTRY_SHARDS;
+  pthread_mutex_lock(&shard->mutex);
+  if (reserve(shard, slot) || shard->by_fd[slot]) {
+    pthread_mutex_unlock(&shard->mutex);
+    return 2;
+  }
+  //the id carries the socket so it resolves with the same O(1) lookup,
+  //the generation keeps ids of reused sockets apart
+  unsigned long generation = __atomic_add_fetch(&reg->generation, 1, __ATOMIC_RELAXED);
+  client->id = (generation << REGISTRY_FD_BITS) | (unsigned long)client->socket;
+  client->registry_index = shard->count;
+  shard->by_fd[slot] = client;
+  shard->members[shard->count++] = client;
+  pthread_mutex_unlock(&shard->mutex);
+  return 0;
+}
+
+static unsigned int name_hash(const char *name, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return h;
+}
+
+static bool same_name(client_t *client, const char *name, int len) {
+  return len < (int)sizeof(client->name) && strncmp(client->name, name, len) == 0 && client->name[len] == '\0';
+}
+
+static struct registry_names_t *names_of(struct registry_t *reg, unsigned int hash) {
+  return reg->names + hash % REGISTRY_SHARDS;
+}
+
+static client_t **bucket_of(struct registry_names_t *names, unsigned int hash) {
+  return names->buckets + hash / REGISTRY_SHARDS % names->bucket_count;
+}
+
+static int grow_names(struct registry_names_t *names) {
+  if (names->count < names->bucket_count) return 0;
+  int old_count = names->bucket_count;
+  client_t **old = names->buckets;
+  int bucket_count = old_count ? old_count * 2 : REGISTRY_NAME_BUCKETS;
+  client_t **buckets = (client_t **)calloc(bucket_count, sizeof(client_t *));
+  if (!buckets) return 1;
+  names->buckets = buckets;
+  names->bucket_count = bucket_count;
+  for (int i = 0; i < old_count; i++) {
+    client_t *client = old[i];
+    while (client) {
+      client_t *next = client->name_next;
+      client_t **bucket = bucket_of(names, name_hash(client->name, strlen(client->name)));
+      client->name_next = *bucket;
+      *bucket = client;
+      client = next;
+    }
+  }
+  free(old);
+  return 0;
+}
+
+int rclaim(struct registry_t *reg, client_t *client) {
+  int len = strlen(client->name);
+  unsigned int hash = name_hash(client->name, len);
+  struct registry_names_t *names = names_of(reg, hash);
+  pthread_mutex_lock(&names->mutex);
+  if (grow_names(names)) {
+    pthread_mutex_unlock(&names->mutex);
+    return 2;
+  }
+  client_t **bucket = bucket_of(names, hash);
+  for (client_t *other = *bucket; other; other = other->name_next) {
+    if (same_name(other, client->name, len)) {
+      pthread_mutex_unlock(&names->mutex);
+      return 1;
+    }
+  }
+  client->name_next = *bucket;
+  *bucket = client;
+  names->count++;
+  pthread_mutex_unlock(&names->mutex);
+  return 0;
+}
+
+static void unclaim(struct registry_t *reg, client_t *client) {
+  unsigned int hash = name_hash(client->name, strlen(client->name));
+  struct registry_names_t *names = names_of(reg, hash);
+  pthread_mutex_lock(&names->mutex);
+  if (names->bucket_count > 0) {
+    client_t **link = bucket_of(names, hash);
+    while (*link && *link != client) {
+      link = &(*link)->name_next;
+    }
+    if (*link) {
+      *link = client->name_next;
+      names->count--;
+    }
+  }
+  pthread_mutex_unlock(&names->mutex);
+}
+
+client_t *rget_name(struct registry_t *reg, const char *name, int len) {
+  unsigned int hash = name_hash(name, len);
+  struct registry_names_t *names = names_of(reg, hash);
+  client_t *client = NULL;
+  pthread_mutex_lock(&names->mutex);
+  if (names->bucket_count > 0) {
+    client = *bucket_of(names, hash);
+    while (client && !same_name(client, name, len)) {
+      client = client->name_next;
+    }
+  }
+  pthread_mutex_unlock(&names->mutex);
+  return client;
+}
+
+client_t *rremove(struct registry_t *reg, client_t *client) {
+  if (!reg) return NULL;
+  unclaim(reg, client);
+  struct registry_shard_t *shard = shard_of(reg, client->socket);
+  int slot = client->socket / REGISTRY_SHARDS;
+  pthread_mutex_lock(&shard->mutex);
+  if (slot >= shard->by_fd_len || shard->by_fd[slot] != client) {
+    pthread_mutex_unlock(&shard->mutex);
+    return NULL;
+  }
+  shard->by_fd[slot] = NULL;
+  //the last member takes the removed one's place
+  client_t *last = shard->members[--shard->count];
+  shard->members[client->registry_index] = last;
+  last->registry_index = client->registry_index;
+  pthread_mutex_unlock(&shard->mutex);
+  return client;
+}
+
+client_t *rget(struct registry_t *reg, int fd) {
+  if (!reg || fd < 0) return NULL;
+  struct registry_shard_t *shard = shard_of(reg, fd);
+  int slot = fd / REGISTRY_SHARDS;
+  client_t *client = NULL;
+  pthread_mutex_lock(&shard->mutex);
+  if (slot < shard->by_fd_len) {
+    client = shard->by_fd[slot];
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  return client;
+}
+
+client_t *rget_id(struct registry_t *reg, unsigned long id) {
+  client_t *client = rget(reg, id & REGISTRY_FD_MASK);
+  if (client && client->id != id) return NULL;
+  return client;
+}
+
+int rsize(struct registry_t *reg) {
+  if (!reg) return -1;
+  int size = 0;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    size += __atomic_load_n(&reg->shards[i].count, __ATOMIC_RELAXED);
+  }
+  return size;
+}
+
+void rforeach(struct registry_t *reg, void (*callback)(client_t *, void *), void *arg) {
+  //one shard is locked at a time, members can't be removed while they're visited
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    struct registry_shard_t *shard = reg->shards + i;
+    pthread_mutex_lock(&shard->mutex);
+    for (int j = 0; j < shard->count; j++) {
+      callback(shard->members[j], arg);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+void rclear(struct registry_t *reg) {
+  if (!reg) return;
+  for (int i = 0; i < REGISTRY_SHARDS; i++) {
+    free(reg->shards[i].by_fd);
+    free(reg->shards[i].members);
+    free(reg->names[i].buckets);
+    pthread_mutex_destroy(&reg->shards[i].mutex);
+    pthread_mutex_destroy(&reg->names[i].mutex);
+  }
+  free(reg);
+}
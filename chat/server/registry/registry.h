@@ -0,0 +1,59 @@
+#ifndef __REGISTRY
+#define __REGISTRY
+
+#include "../server_types.h"
+#include <pthread.h>
+
+#define REGISTRY_SHARDS 16
+#define REGISTRY_FD_BITS 20
+#define REGISTRY_FD_MASK ((1U << REGISTRY_FD_BITS) - 1)
+#define REGISTRY_NAME_BUCKETS 64
+
+//logged in clients, sharded by socket so lookups only take one shard lock
+//every shard keeps a dense member array next to the fd index for iteration
+struct registry_shard_t {
+  pthread_mutex_t mutex;
+  client_t **by_fd;
+  int by_fd_len;
+  client_t **members;
+  int count;
+  int capacity;
+};
+
+//the names taken by logged in clients, sharded by a hash of the name and
+//chained through the clients, the buckets double once they're all in use
+struct registry_names_t {
+  pthread_mutex_t mutex;
+  client_t **buckets;
+  int bucket_count;
+  int count;
+};
+
+struct registry_t {
+  struct registry_shard_t shards[REGISTRY_SHARDS];
+  struct registry_names_t names[REGISTRY_SHARDS];
+  unsigned long generation;
+};
+
+struct registry_t *rcreate();
+
+int radd(struct registry_t *reg, client_t *client);
+client_t *rremove(struct registry_t *reg, client_t *client);
+
+client_t *rget(struct registry_t *reg, int fd);
+//the id is the socket under a generation wide enough to never wrap around, an
+//id kept across any number of reconnects on the same socket finds nobody
+client_t *rget_id(struct registry_t *reg, unsigned long id);
+
+//claims the client's name, returns 1 when another client has it, rremove
+//gives it back
+int rclaim(struct registry_t *reg, client_t *client);
+client_t *rget_name(struct registry_t *reg, const char *name, int len);
+
+int rsize(struct registry_t *reg);
+
+void rforeach(struct registry_t *reg, void (*callback)(client_t *, void *), void *arg);
+
+void rclear(struct registry_t *reg);
+
+#endif
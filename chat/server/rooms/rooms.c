@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include "rooms.h"
+#include "../roster/roster.h"
+#include "../frame/frame.h"
+#include "../metrics/metrics.h"
+
+struct rooms_t *rooms_create(int workers, int history_len) {
+  struct rooms_t *rooms = (struct rooms_t *)calloc(1, sizeof(struct rooms_t));
+  if (!rooms) return NULL;
+  pthread_mutex_init(&rooms->mutex, NULL);
+  rooms->workers = workers;
+  rooms->history_len = history_len;
+  return rooms;
+}
+
+static unsigned int hash(const char *name, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return h % ROOM_BUCKETS;
+}
+
+static struct room_t *room_create(struct rooms_t *rooms, const char *name, int len) {
+  struct room_t *room = (struct room_t *)calloc(1, sizeof(struct room_t));
+  if (!room) return NULL;
+  room->local = (struct room_local_t *)calloc(rooms->workers, sizeof(struct room_local_t));
+  room->roster = roster_create();
+  if (!room->local || !room->roster) {
+    free(room->local);
+    roster_clear(room->roster);
+    free(room);
+    return NULL;
+  }
+  memcpy(room->name, name, len);
+  pthread_mutex_init(&room->mutex, NULL);
+  room->history_len = rooms->history_len;
+  return room;
+}
+
+static unsigned long kept_len(frame_t *frame) {
+  //a message is kept in the encodings made for it up front, the REPLAY and
+  //WebSocket ones are only made once a client needs them
+  return frame->len + (frame->binary ? frame->binary->len : 0);
+}
+
+static void room_free(struct room_t *room, int workers) {
+  for (int w = 0; w < workers; w++) {
+    free(room->local[w].members);
+  }
+  free(room->local);
+  roster_clear(room->roster);
+  for (int h = 0; room->history && h < room->history_len; h++) {
+    if (!room->history[h]) continue;
+    __atomic_sub_fetch(&metrics_local()->stats.history_bytes, kept_len(room->history[h]), __ATOMIC_RELAXED);
+    funhold(room->history[h]);
+  }
+  free(room->history);
+  pthread_mutex_destroy(&room->mutex);
+  free(room);
+}
+
+static void unlink_room(struct rooms_t *rooms, struct room_t *room) {
+  struct room_t **link = rooms->buckets + hash(room->name, strlen(room->name));
+  while (*link != room) {
+    link = &(*link)->next;
+  }
+  *link = room->next;
+  rooms->count--;
+}
+
+static void add_idle(struct rooms_t *rooms, struct room_t *room) {
+  room->idle = true;
+  room->older = rooms->newest_idle;
+  room->newer = NULL;
+  if (rooms->newest_idle) {
+    rooms->newest_idle->newer = room;
+  } else {
+    rooms->oldest_idle = room;
+  }
+  rooms->newest_idle = room;
+}
+
+static void remove_idle(struct rooms_t *rooms, struct room_t *room) {
+  if (room->older) {
+    room->older->newer = room->newer;
+  } else {
+    rooms->oldest_idle = room->newer;
+  }
+  if (room->newer) {
+    room->newer->older = room->older;
+  } else {
+    rooms->newest_idle = room->older;
+  }
+  room->idle = false;
+}
+
+struct room_t *rooms_find(struct rooms_t *rooms, const char *name, int len, bool create) {
+  if (len <= 0 || len >= ROOM_NAME_LEN) return NULL;
+  unsigned int bucket = hash(name, len);
+  pthread_mutex_lock(&rooms->mutex);
+  struct room_t *room = rooms->buckets[bucket];
+  while (room && (strncmp(room->name, name, len) != 0 || room->name[len] != '\0')) {
+    room = room->next;
+  }
+  if (room && room->idle) {
+    remove_idle(rooms, room);
+  }
+  if (!room && create && rooms->count == MAX_ROOMS && rooms->oldest_idle) {
+    //nobody references an idle room, its history goes to make space
+    struct room_t *oldest = rooms->oldest_idle;
+    remove_idle(rooms, oldest);
+    unlink_room(rooms, oldest);
+    room_free(oldest, rooms->workers);
+  }
+  if (!room && create && rooms->count < MAX_ROOMS) {
+    room = room_create(rooms, name, len);
+    if (room) {
+      room->next = rooms->buckets[bucket];
+      rooms->buckets[bucket] = room;
+      rooms->count++;
+    }
+  }
+  if (room) __atomic_add_fetch(&room->refs, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&rooms->mutex);
+  return room;
+}
+
+void room_retain(struct room_t *room, int count) {
+  __atomic_add_fetch(&room->refs, count, __ATOMIC_RELAXED);
+}
+
+void rooms_release(struct rooms_t *rooms, struct room_t *room) {
+  //only the last reference takes the mutex, rooms_find takes its reference
+  //under it so nobody finds a room while it's freed
+  int refs = __atomic_load_n(&room->refs, __ATOMIC_RELAXED);
+  while (refs > 1) {
+    if (__atomic_compare_exchange_n(&room->refs, &refs, refs - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+  pthread_mutex_lock(&rooms->mutex);
+  //nobody can record a message without a reference, the history is settled
+  if (__atomic_sub_fetch(&room->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    if (room->seq == 0) {
+      unlink_room(rooms, room);
+      room_free(room, rooms->workers);
+    } else {
+      add_idle(rooms, room);
+    }
+  }
+  pthread_mutex_unlock(&rooms->mutex);
+}
+
+int room_attach(struct room_t *room, int worker, client_t *client, int membership) {
+  struct room_local_t *local = room->local + worker;
+  if (local->count == local->capacity) {
+    int capacity = local->capacity ? local->capacity * 2 : 16;
+    client_t **members = (client_t **)realloc(local->members, capacity * sizeof(client_t *));
+    if (!members) return 1;
+    local->members = members;
+    local->capacity = capacity;
+  }
+  client->rooms[membership].slot = local->count;
+  local->members[local->count++] = client;
+  return 0;
+}
+
+void room_detach(struct room_t *room, int worker, client_t *client, int membership) {
+  int slot = client->rooms[membership].slot;
+  if (slot < 0) return;
+  struct room_local_t *local = room->local + worker;
+  client_t *last = local->members[--local->count];
+  local->members[slot] = last;
+  //the moved client's membership of this room points at the new slot
+  for (int i = 0; i < last->room_count; i++) {
+    if (last->rooms[i].room == room) {
+      last->rooms[i].slot = slot;
+      break;
+    }
+  }
+  client->rooms[membership].slot = -1;
+}
+
+frame_t *rooms_record(struct room_t *room, frame_t *frame) {
+  //keeping a message is storing a reference, nothing is allocated for it
+  if (room->history_len == 0) return NULL;
+  if (!room->history) {
+    room->history = (frame_t **)calloc(room->history_len, sizeof(frame_t *));
+    if (!room->history) return NULL;
+  }
+  frame->seq = ++room->seq;
+  frame_t **slot = room->history + frame->seq % room->history_len;
+  frame_t *old = *slot;
+  *slot = fhold(frame);
+  unsigned long *bytes = &metrics_local()->stats.history_bytes;
+  __atomic_add_fetch(bytes, kept_len(frame), __ATOMIC_RELAXED);
+  if (old) __atomic_sub_fetch(bytes, kept_len(old), __ATOMIC_RELAXED);
+  return old;
+}
+
+int rooms_history(struct room_t *room, unsigned int since, frame_t **frames, unsigned int *last) {
+  int count = 0;
+  pthread_mutex_lock(&room->mutex);
+  *last = room->seq;
+  //since comes from the client, one past the newest message asks for none
+  //and the ring never gives more than it keeps
+  if (since > room->seq) since = room->seq;
+  unsigned int newer = room->seq - since;
+  if (newer > (unsigned int)room->history_len) newer = room->history_len;
+  for (unsigned int seq = room->seq - newer + 1; room->history && count < (int)newer; seq++) {
+    frames[count++] = fhold(room->history[seq % room->history_len]);
+  }
+  pthread_mutex_unlock(&room->mutex);
+  return count;
+}
+
+void rooms_clear(struct rooms_t *rooms) {
+  if (!rooms) return;
+  for (int i = 0; i < ROOM_BUCKETS; i++) {
+    struct room_t *room = rooms->buckets[i];
+    while (room) {
+      struct room_t *next = room->next;
+      room_free(room, rooms->workers);
+      room = next;
+    }
+  }
+  pthread_mutex_destroy(&rooms->mutex);
+  free(rooms);
+}
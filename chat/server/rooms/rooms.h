@@ -0,0 +1,82 @@
+#ifndef __ROOMS
+#define __ROOMS
+
+#include "../server_types.h"
+#include <pthread.h>
+
+#define ROOM_BUCKETS 256
+
+//a room's members owned by one worker, only that worker touches them so a
+//message walks exactly the clients subscribed to its room
+struct room_local_t {
+  client_t **members;
+  int count;
+  int capacity;
+  //the newest message any of them was sent from the history, live copies
+  //up to it are checked against each member's
+  unsigned int replayed;
+};
+
+struct room_t {
+  char name[ROOM_NAME_LEN];
+  //every member across the workers, for the list sent on JOIN
+  roster_t *roster;
+  //one member list per worker
+  struct room_local_t *local;
+  //orders the room's broadcasts on every worker's mailbox, and guards the
+  //latest chat messages, references to the frames that were broadcast in a
+  //ring indexed by sequence number that's allocated with the first one
+  pthread_mutex_t mutex;
+  frame_t **history;
+  int history_len;
+  unsigned int seq;
+  //memberships, broadcasts on their way to the workers and lookups, the room
+  //is freed once none are left unless it has a history to keep, then it's
+  //idle until it's found again or freed for a new room
+  int refs;
+  bool idle;
+  struct room_t *older;
+  struct room_t *newer;
+  struct room_t *next;
+};
+
+//rooms are created on the first JOIN and live while they're referenced, an
+//idle room keeps its history for whoever joins it next as long as there's no
+//new room that needs its place, the one idle for the longest goes first
+struct rooms_t {
+  pthread_mutex_t mutex;
+  struct room_t *buckets[ROOM_BUCKETS];
+  struct room_t *oldest_idle;
+  struct room_t *newest_idle;
+  int count;
+  int workers;
+  int history_len;
+};
+
+//every room keeps its last history_len chat messages, 0 keeps none
+struct rooms_t *rooms_create(int workers, int history_len);
+
+//returns NULL when the room doesn't exist and create is false or there are
+//already MAX_ROOMS that aren't idle, the room found comes with a reference
+struct room_t *rooms_find(struct rooms_t *rooms, const char *name, int len, bool create);
+//only for callers that hold a reference already
+void room_retain(struct room_t *room, int count);
+void rooms_release(struct rooms_t *rooms, struct room_t *room);
+
+//the owning worker adds the client's membership to its member list
+int room_attach(struct room_t *room, int worker, client_t *client, int membership);
+void room_detach(struct room_t *room, int worker, client_t *client, int membership);
+
+//numbers the message and keeps it as the room's newest, returns the one it
+//pushed out of the ring for the caller to funhold, if any, the caller holds
+//the room's mutex so the numbers follow the order of the broadcasts
+//the kept messages count toward the history_bytes stat
+frame_t *rooms_record(struct room_t *room, frame_t *frame);
+//holds the messages newer than since, oldest first and at most history_len of
+//them, for the caller to funhold, returns how many and the sequence number of
+//the newest message in last
+int rooms_history(struct room_t *room, unsigned int since, frame_t **frames, unsigned int *last);
+
+void rooms_clear(struct rooms_t *rooms);
+
+#endif
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include "roster.h"
+#include "../epoch/epoch.h"
+#include "../frame/frame.h"
+
+static struct roster_snapshot_t *snapshot(int count) {
+  //the frames follow the members in the same block
+  struct roster_snapshot_t *snap = (struct roster_snapshot_t *)malloc(sizeof(struct roster_snapshot_t) +
+    count * (sizeof(client_t *) + sizeof(frame_t *)));
+  if (!snap) return NULL;
+  snap->count = count;
+  snap->joined = (frame_t **)(snap->members + count);
+  return snap;
+}
+
+static void unhold(void *frame) {
+  funhold((frame_t *)frame);
+}
+
+struct roster_t *roster_create() {
+  struct roster_t *roster = (struct roster_t *)malloc(sizeof(struct roster_t));
+  if (!roster) return NULL;
+  roster->current = snapshot(0);
+  if (!roster->current) {
+    free(roster);
+    return NULL;
+  }
+  pthread_mutex_init(&roster->writer_mutex, NULL);
+  return roster;
+}
+
+static void publish(struct roster_t *roster, struct roster_snapshot_t *snap) {
+  struct roster_snapshot_t *old = roster->current;
+  __atomic_store_n(&roster->current, snap, __ATOMIC_RELEASE);
+  epoch_retire(old, free);
+}
+
+int roster_add(struct roster_t *roster, client_t *client, frame_t *joined) {
+  pthread_mutex_lock(&roster->writer_mutex);
+  struct roster_snapshot_t *old = roster->current;
+  struct roster_snapshot_t *snap = snapshot(old->count + 1);
+  if (!snap) {
+    pthread_mutex_unlock(&roster->writer_mutex);
+    return 1;
+  }
+  memcpy(snap->members, old->members, old->count * sizeof(client_t *));
+  memcpy(snap->joined, old->joined, old->count * sizeof(frame_t *));
+  snap->members[old->count] = client;
+  snap->joined[old->count] = fhold(joined);
+  publish(roster, snap);
+  pthread_mutex_unlock(&roster->writer_mutex);
+  return 0;
+}
+
+int roster_remove(struct roster_t *roster, client_t *client) {
+  pthread_mutex_lock(&roster->writer_mutex);
+  struct roster_snapshot_t *old = roster->current;
+  int index = 0;
+  while (index < old->count && old->members[index] != client) {
+    index++;
+  }
+  if (index == old->count) {
+    pthread_mutex_unlock(&roster->writer_mutex);
+    return 1;
+  }
+  struct roster_snapshot_t *snap = snapshot(old->count - 1);
+  if (!snap) {
+    pthread_mutex_unlock(&roster->writer_mutex);
+    return 2;
+  }
+  memcpy(snap->members, old->members, index * sizeof(client_t *));
+  memcpy(snap->members + index, old->members + index + 1, (old->count - index - 1) * sizeof(client_t *));
+  memcpy(snap->joined, old->joined, index * sizeof(frame_t *));
+  memcpy(snap->joined + index, old->joined + index + 1, (old->count - index - 1) * sizeof(frame_t *));
+  //readers of the old snapshot may still be sending it
+  epoch_retire(old->joined[index], unhold);
+  publish(roster, snap);
+  pthread_mutex_unlock(&roster->writer_mutex);
+  return 0;
+}
+
+struct roster_snapshot_t *roster_acquire(struct roster_t *roster) {
+  epoch_enter();
+  return __atomic_load_n(&roster->current, __ATOMIC_ACQUIRE);
+}
+
+void roster_release(void) {
+  epoch_exit();
+}
+
+void roster_clear(struct roster_t *roster) {
+  if (!roster) return;
+  for (int i = 0; i < roster->current->count; i++) {
+    funhold(roster->current->joined[i]);
+  }
+  free(roster->current);
+  pthread_mutex_destroy(&roster->writer_mutex);
+  free(roster);
+}
@@ -0,0 +1,35 @@
+#ifndef __ROSTER
+#define __ROSTER
+
+#include "../server_types.h"
+#include <pthread.h>
+
+//an immutable snapshot of the logged in clients, replaced as a whole by
+//writers and traversed by readers without any lock
+//joined has every member's JOIN frame in the same order, a client joining
+//is sent them all at once
+struct roster_snapshot_t {
+  int count;
+  frame_t **joined;
+  client_t *members[];
+};
+
+struct roster_t {
+  struct roster_snapshot_t *current;
+  pthread_mutex_t writer_mutex;
+};
+
+struct roster_t *roster_create();
+
+//the roster holds on to joined until the client is removed
+int roster_add(struct roster_t *roster, client_t *client, frame_t *joined);
+int roster_remove(struct roster_t *roster, client_t *client);
+
+//readers have to stay between roster_acquire and roster_release while they
+//use the snapshot or any client in it
+struct roster_snapshot_t *roster_acquire(struct roster_t *roster);
+void roster_release(void);
+
+void roster_clear(struct roster_t *roster);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,24 +7,66 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <netdb.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <ctype.h>
+#include <stdint.h>
 
 #include "server_types.h"
-#include "list/list.h"
+#include "registry/registry.h"
+#include "roster/roster.h"
+#include "epoch/epoch.h"
+#include "events/events.h"
+#include "frame/frame.h"
+#include "mailbox/mailbox.h"
+#include "rooms/rooms.h"
+#include "pool/pool.h"
+#include "log/log.h"
+#include "metrics/metrics.h"
+#include "assets/assets.h"
+#include "http/http.h"
+#include "ws/ws.h"
 
 pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 struct {
   //server variables to be shared between threads
-  int socket;
-  pthread_t listening_thread;
-  list_t *list;
+  int port;
+  int backlog;
+  unsigned long memory_limit;
+  //what memory_used counted last, sampled every balancing tick so the
+  //checks on the hot paths are a single load
+  unsigned long memory;
+  //outbound bytes a client may have queued and what happens past them
+  int queue_budget;
+  slow_policy_t slow_policy;
+  //0 writes every frame right away
+  int flush_window;
+  int flush_bytes;
+  //chat messages a room keeps for the clients that join it
+  int history_len;
+  //seconds a connection may go without a complete request before it logs in
+  int request_timeout;
+  registry_t *registry;
+  rooms_t *rooms;
+  room_t *lobby;
+  struct assets_t *assets;
   int cores;
   worker_t *workers;
+  pthread_t balancing_thread;
+  events_backend_t backend;
 } server_data;
 
+//counters go to the calling thread's own block and are added up when read
+#define STAT_ADD(field, n) __atomic_add_fetch(&metrics_local()->stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n) __atomic_sub_fetch(&metrics_local()->stats.field, (n), __ATOMIC_RELAXED)
+
 bool starts_with(char *str1, char *str2) {
-  return strncmp(str1, str2, strlen(str2) - 1) == 0;
+  return strncmp(str1, str2, strlen(str2)) == 0;
 }
 
 void mem_dump(char *ptr, int length, int size) {
@@ -37,490 +80,2253 @@ void mem_dump(char *ptr, int length, int size) {
   printf("}\n");
 }
 
-worker_t *get_optimal_worker(void) {
-  worker_t *worker = server_data.workers;
-  for (int i = 1; i < server_data.cores; i++) {
-    if (server_data.workers[i].saved_fds < worker->saved_fds) {
-      worker = server_data.workers + i;
+void close_client(client_t *client);
+void disconnect_client(worker_t *worker, client_t *client);
+void handle_client(worker_t *worker, client_t *client, int events);
+int login_client(client_t *client, char *request);
+
+int post(worker_t *worker, int type, long val, void *ptr, void *arg) {
+  //a full mailbox overflows instead of failing, so nothing waits for a worker
+  //that may be posting to this one itself, returns 1 only when the command
+  //couldn't be kept at all
+  command_t command = {type, val, ptr, arg};
+  int res = mpost(worker->mailbox, command);
+  if (res != 0) STAT_ADD(mailbox_overflows, 1);
+  if (res < 0) LOG(LOG_ERROR, "Mailbox error: %m");
+  return res < 0;
+}
+
+int grow_clients(client_t ***clients, int *cap, int len) {
+  if (len < *cap) return 0;
+  int new_cap = *cap ? *cap * 2 : 64;
+  client_t **grown = realloc(*clients, new_cap * sizeof(client_t *));
+  if (!grown) return 1;
+  *clients = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+int attach_client(worker_t *worker, client_t *client) {
+  if (grow_clients(&worker->clients, &worker->clients_cap, worker->clients_len)) return 1;
+  client->worker_slot = worker->clients_len;
+  worker->clients[worker->clients_len++] = client;
+  return 0;
+}
+
+void detach_client(worker_t *worker, client_t *client) {
+  int slot = client->worker_slot;
+  if (slot < 0) return;
+  client_t *last = worker->clients[--worker->clients_len];
+  worker->clients[slot] = last;
+  last->worker_slot = slot;
+  client->worker_slot = -1;
+}
+
+long now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+int wait_request(worker_t *worker, client_t *client) {
+  //the connection has until the timeout to send a complete request, it's
+  //moved to the worker's client list once it logs in
+  long deadline = now_us() + server_data.request_timeout * 1000000L;
+  if (client->worker_slot >= 0) {
+    worker->waiting[client->worker_slot].deadline = deadline;
+    return 0;
+  }
+  if (worker->waiting_len == worker->waiting_cap) {
+    int cap = worker->waiting_cap ? worker->waiting_cap * 2 : 64;
+    waiting_t *grown = realloc(worker->waiting, cap * sizeof(waiting_t));
+    if (!grown) return 1;
+    worker->waiting = grown;
+    worker->waiting_cap = cap;
+  }
+  client->worker_slot = worker->waiting_len;
+  worker->waiting[worker->waiting_len].client = client;
+  worker->waiting[worker->waiting_len++].deadline = deadline;
+  return 0;
+}
+
+void unwait(worker_t *worker, client_t *client) {
+  int slot = client->worker_slot;
+  if (slot < 0) return;
+  worker->waiting[slot] = worker->waiting[--worker->waiting_len];
+  worker->waiting[slot].client->worker_slot = slot;
+  client->worker_slot = -1;
+}
+
+unsigned long charge_client(client_t *client, unsigned long cost) {
+  //only the owning worker charges a client, the load halves every second
+  //so it follows the recent traffic
+  time_t now = time(NULL);
+  if (now != client->load_time) {
+    long age = now - client->load_time;
+    client->load = age >= 32 ? 0 : client->load >> age;
+    client->load_time = now;
+  }
+  client->load += cost;
+  return client->load;
+}
+
+void charge(worker_t *worker, client_t *client, unsigned long events, unsigned long bytes) {
+  __atomic_add_fetch(&worker->load_events, events, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&worker->load_bytes, bytes, __ATOMIC_RELAXED);
+  charge_client(client, events + bytes / LOAD_BYTES_PER_EVENT);
+}
+
+unsigned long count_memory(stats_t *stats) {
+  //a client costs its pool block, queued frames are shared by everyone
+  //and buffers are only held by clients in the middle of something
+  //the rooms' histories are bounded but count all the same
+  return stats->clients * pblock_len(sizeof(client_t)) + stats->bytes_queued + stats->buffers + stats->history_bytes;
+}
+
+unsigned long memory_used(void) {
+  return __atomic_load_n(&server_data.memory, __ATOMIC_RELAXED);
+}
+
+void sample_memory(void) {
+  //adding up every thread's counters is too slow for every admission and
+  //every queued frame, they use the last sample
+  stats_t stats;
+  metrics_sum(&stats, NULL);
+  __atomic_store_n(&server_data.memory, count_memory(&stats), __ATOMIC_RELAXED);
+}
+
+frame_t *wire(client_t *client, frame_t *frame) {
+  //what a queued frame is written as, in the encoding the client speaks
+  if (frame->raw) return frame;
+  if (client->protocol == PROTOCOL_BINARY && frame->binary) return frame->binary;
+  if (client->protocol == PROTOCOL_WS) return __atomic_load_n(&frame->ws, __ATOMIC_ACQUIRE);
+  return frame;
+}
+
+void enqueue(client_t *client, frame_t *frame) {
+  //the ring has a free slot, the caller holds mutex
+  int len = wire(client, frame)->len;
+  client->queue[(client->queue_head + client->queue_count) % CLIENT_QUEUE_LEN] = fretain(frame);
+  client->queue_count++;
+  client->queue_bytes += len;
+  STAT_ADD(bytes_queued, len);
+  stats_t *stats = &metrics_local()->stats;
+  if ((unsigned long)client->queue_bytes > stats->max_queue_depth) {
+    __atomic_store_n(&stats->max_queue_depth, client->queue_bytes, __ATOMIC_RELAXED);
+  }
+}
+
+void queue_missed(client_t *client) {
+  //a client that fell behind hears how many chat messages it missed once it
+  //caught up, binary clients get the count in place of a user id
+  frame_t *frame = fformat("MISSED %d", client->missed);
+  if (frame) frame->binary = fbinary(OP_MISSED, client->missed, NULL, 0);
+  if (frame && frame->binary && (client->protocol != PROTOCOL_WS || fws(frame))) {
+    enqueue(client, frame);
+    client->missed = 0;
+  }
+  if (frame) frelease(frame);
+}
+
+int gather(client_t *client, struct iovec *iov) {
+  //the front of the queue as one write of up to IOV_PER_WRITE frames
+  int iovcnt = 0;
+  for (int i = 0; i < client->queue_count && iovcnt < IOV_PER_WRITE; i++) {
+    frame_t *frame = wire(client, client->queue[(client->queue_head + i) % CLIENT_QUEUE_LEN]);
+    int offset = i == 0 ? client->queue_offset : 0;
+    iov[iovcnt].iov_base = frame->data + offset;
+    iov[iovcnt].iov_len = frame->len - offset;
+    iovcnt++;
+  }
+  return iovcnt;
+}
+
+void written(client_t *client, int w) {
+  //lets go of the frames a write of w bytes finished
+  STAT_ADD(writev_calls, 1);
+  STAT_ADD(bytes_written, w);
+  STAT_SUB(bytes_queued, w);
+  client->queue_bytes -= w;
+  w += client->queue_offset;
+  while (client->queue_count > 0) {
+    frame_t *frame = client->queue[client->queue_head];
+    int len = wire(client, frame)->len;
+    if (w < len) break;
+    w -= len;
+    frelease(frame);
+    client->queue_head = (client->queue_head + 1) % CLIENT_QUEUE_LEN;
+    client->queue_count--;
+    STAT_ADD(frames_written, 1);
+  }
+  client->queue_offset = w;
+  if (client->queue_count == 0 && client->missed > 0) {
+    queue_missed(client);
+  }
+}
+
+int flush_client(client_t *client) {
+  //writes as much of the queue as the socket takes, returns 1 if some is left
+  while (client->queue_count > 0) {
+    struct iovec iov[IOV_PER_WRITE];
+    int iovcnt = gather(client, iov);
+    int w = writev(client->socket, iov, iovcnt);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+      return -1;
     }
+    written(client, w);
   }
-  if (worker->saved_fds == CLIENTS_PER_THREAD) {
-    //limit reached
-    return NULL;
+  if (client->queue) {
+    //an idle client holds no ring
+    pfree(client->queue);
+    client->queue = NULL;
+    STAT_SUB(buffers, pblock_len(CLIENT_QUEUE_LEN * sizeof(frame_t *)));
   }
-  return worker;
+  return 0;
 }
 
-void close_client(client_t *client);
+void clear_queue(client_t *client) {
+  STAT_SUB(bytes_queued, client->queue_bytes);
+  while (client->queue_count > 0) {
+    frelease(client->queue[client->queue_head]);
+    client->queue_head = (client->queue_head + 1) % CLIENT_QUEUE_LEN;
+    client->queue_count--;
+  }
+  client->queue_bytes = 0;
+  client->queue_offset = 0;
+  if (client->queue) {
+    pfree(client->queue);
+    client->queue = NULL;
+    STAT_SUB(buffers, pblock_len(CLIENT_QUEUE_LEN * sizeof(frame_t *)));
+  }
+}
 
-int add_client(client_t *client) {
-  pthread_mutex_lock(&server_data.list->mutex);
-  int err = lpushf(server_data.list, client);
-  pthread_mutex_unlock(&server_data.list->mutex);
-  return err;
+void watch_writable(client_t *client) {
+  //epoll reports writability on its own, poll and io_uring are told to watch
+  //for POLLOUT, sockets are only ever written by their own worker so it can
+  //be done right here
+  if (client->want_out || server_data.backend == EVENTS_EPOLL || client->worker == NULL) {
+    return;
+  }
+  client->want_out = true;
+  emodify(client->worker->events, client->socket, EVENT_IN | EVENT_OUT);
+}
+
+void defer_flush(client_t *client) {
+  //the owner writes the queue once the window is over
+  worker_t *worker = client->worker;
+  if (client->dirty_slot >= 0 || grow_clients(&worker->dirty, &worker->dirty_cap, worker->dirty_len)) {
+    return;
+  }
+  client->dirty_slot = worker->dirty_len;
+  worker->dirty[worker->dirty_len++] = client;
+  client->flush_at = now_us() + server_data.flush_window * 1000L;
 }
 
-void remove_client(client_t *client) {
-  pthread_mutex_lock(&server_data.list->mutex);
-  unsigned int index = lgetindex(server_data.list, client);
-  lremove(server_data.list, index);
-  pthread_mutex_unlock(&server_data.list->mutex);
+void undirty(worker_t *worker, client_t *client) {
+  int slot = client->dirty_slot;
+  if (slot < 0) return;
+  client_t *last = worker->dirty[--worker->dirty_len];
+  worker->dirty[slot] = last;
+  last->dirty_slot = slot;
+  client->dirty_slot = -1;
+}
+
+bool over_budget(client_t *client, int len) {
+  if (client->state == CLIENT_HTTP) {
+    //responses are cached assets and pages, written before the next request
+    return false;
+  }
+  if (client->queue_count == CLIENT_QUEUE_LEN || client->queue_bytes + len > server_data.queue_budget) {
+    return true;
+  }
+  //past the global ceiling only clients that keep up get more
+  return client->queue_count > 0 && memory_used() > server_data.memory_limit;
+}
+
+int shed_frames(client_t *client, frame_t *frame) {
+  //the client went over its budget, the policy decides what gives
+  //returns 0 once the frame fits, 1 when it was dropped itself and -1 when
+  //the client has to go
+  if (server_data.slow_policy == SLOW_CLOSE) {
+    return -1;
+  }
+  int len = wire(client, frame)->len;
+  if (server_data.slow_policy == SLOW_DROP || !frame->chat) {
+    //the oldest chat frames go first, presence frames and the one being
+    //written stay where they are
+    int count = client->queue_count;
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+      frame_t *queued = client->queue[(client->queue_head + i) % CLIENT_QUEUE_LEN];
+      bool writing = i == 0 && client->queue_offset > 0;
+      if (queued->chat && !writing && over_budget(client, len)) {
+        int queued_len = wire(client, queued)->len;
+        client->queue_count--;
+        client->queue_bytes -= queued_len;
+        STAT_SUB(bytes_queued, queued_len);
+        STAT_ADD(dropped_frames, 1);
+        if (server_data.slow_policy == SLOW_SUMMARY) client->missed++;
+        frelease(queued);
+        continue;
+      }
+      client->queue[(client->queue_head + kept++) % CLIENT_QUEUE_LEN] = queued;
+    }
+    if (!over_budget(client, len)) {
+      return 0;
+    }
+  }
+  if (!frame->chat) {
+    //only presence is left and it doesn't fit either
+    return -1;
+  }
+  STAT_ADD(dropped_frames, 1);
+  if (server_data.slow_policy == SLOW_SUMMARY) client->missed++;
+  return 1;
+}
+
+int send_frames(client_t *client, frame_t **frames, int count) {
+  //only queues references to the frames, the socket is written right away if
+  //nothing was pending and once it becomes writable otherwise, only the
+  //owning worker calls it
+  //with a flush window the frames are written together once it's over or
+  //enough of them are queued
+  pthread_mutex_lock(&client->mutex);
+  if (client->closing) {
+    pthread_mutex_unlock(&client->mutex);
+    return -1;
+  }
+  bool was_empty = client->queue_count == 0;
+  for (int i = 0; i < count; i++) {
+    frame_t *frame = frames[i];
+    //a message is encoded once per protocol, not once per recipient
+    if (client->protocol == PROTOCOL_WS && !frame->raw && !fws(frame)) {
+      continue;
+    }
+    if (frame->chat && client->missed > 0) {
+      //a summed up client only gets chat again once it caught up
+      client->missed++;
+      STAT_ADD(dropped_frames, 1);
+      continue;
+    }
+    int len = wire(client, frame)->len;
+    if (i > 0 && client->queue_count > 0 && over_budget(client, len)) {
+      //a long batch like a roster writes what it queued so far before
+      //anything is shed
+      flush_client(client);
+    }
+    int shed = over_budget(client, len) ? shed_frames(client, frame) : 0;
+    if (shed < 0) {
+      //the client doesn't read fast enough, the owning worker cleans it up on hangup
+      client->closing = true;
+      pthread_mutex_unlock(&client->mutex);
+      STAT_ADD(evicted_clients, 1);
+      LOG(LOG_WARN, "%s can't keep up, dropping the connection", client->name);
+      shutdown(client->socket, SHUT_RDWR);
+      return -1;
+    }
+    if (shed > 0) {
+      continue;
+    }
+    if (client->queue == NULL) {
+      client->queue = (frame_t **)palloc(CLIENT_QUEUE_LEN * sizeof(frame_t *));
+      if (client->queue == NULL) {
+        pthread_mutex_unlock(&client->mutex);
+        return -1;
+      }
+      STAT_ADD(buffers, pblock_len(CLIENT_QUEUE_LEN * sizeof(frame_t *)));
+    }
+    enqueue(client, frame);
+  }
+  int res = 0;
+  bool flush = was_empty && client->queue_count > 0;
+  if (server_data.flush_window > 0) {
+    flush = client->queue_bytes >= server_data.flush_bytes || client->queue_count >= CLIENT_QUEUE_LEN / 2;
+    if (!flush && was_empty && client->queue_count > 0) {
+      defer_flush(client);
+    }
+  } else if (server_data.backend == EVENTS_URING && client->state == CLIENT_CHAT && client->queue_count > 0) {
+    //io_uring writes what the worker queued while handling its events once
+    //it's done, every client in one io_uring_enter, unless a burst fills the
+    //queue first
+    flush = client->queue_bytes >= server_data.flush_bytes || client->queue_count >= CLIENT_QUEUE_LEN / 2;
+    if (!flush) {
+      defer_flush(client);
+      flush = client->dirty_slot < 0;
+    }
+  }
+  if (flush) {
+    res = flush_client(client);
+    if (res == 1) {
+      watch_writable(client);
+    }
+  }
+  pthread_mutex_unlock(&client->mutex);
+  return res < 0 ? -1 : 0;
+}
+
+int send_frame(client_t *client, frame_t *frame) {
+  return send_frames(client, &frame, 1);
 }
 
 int send_msg(client_t *client, const char *msg) {
-  int datalen = strlen(msg);
-  int data = htonl(datalen);
-  int w = write(client->socket, &data, sizeof(data));
-  if (w <= 0) {
-    return w;
+  frame_t *frame = fcreate(msg, strlen(msg));
+  if (!frame) return -1;
+  int res = send_frame(client, frame);
+  frelease(frame);
+  return res;
+}
+
+void broadcast_frame(room_t *room, frame_t *frame, client_t *exclude) {
+  //the frame is serialized once and every worker gets a reference to deliver
+  //to its own members of the room, so the fan-out of a message runs on all cores
+  //every worker's command keeps the room around until it's delivered
+  //the room's mutex keeps its broadcasts in the same order on every worker
+  //and a member's migration out of the way while they're posted
+  int skip = exclude ? exclude->socket : VACANT_FD;
+  room_retain(room, server_data.cores);
+  pthread_mutex_lock(&room->mutex);
+  //chat messages are numbered in the order they're posted in, a worker never
+  //gets one before an older one it could mistake for already replayed
+  frame_t *old = frame->chat ? rooms_record(room, frame) : NULL;
+  for (int i = 0; i < server_data.cores; i++) {
+    if (post(server_data.workers + i, COMMAND_BROADCAST, skip, fretain(frame), room) != 0) {
+      frelease(frame);
+      rooms_release(server_data.rooms, room);
+    }
+  }
+  pthread_mutex_unlock(&room->mutex);
+  if (old) funhold(old);
+  frelease(frame);
+}
+
+void hold_frame(client_t *client, frame_t *frame, room_t *room) {
+  //the caller holds a reference to the room, the held frame takes its own
+  pending_t *pending = client->pending;
+  if (!pending || pending->len == pending->cap) {
+    int cap = pending ? pending->cap * 2 : 16;
+    pending = realloc(pending, sizeof(pending_t) + cap * sizeof(pending->held[0]));
+    if (!pending) return;
+    if (!client->pending) pending->len = 0;
+    pending->cap = cap;
+    client->pending = pending;
+  }
+  pending->held[pending->len].frame = fretain(frame);
+  pending->held[pending->len++].room = room;
+  if (room) room_retain(room, 1);
+}
+
+void drop_pending(client_t *client) {
+  for (int i = 0; client->pending && i < client->pending->len; i++) {
+    frelease(client->pending->held[i].frame);
+    if (client->pending->held[i].room) rooms_release(server_data.rooms, client->pending->held[i].room);
+  }
+  free(client->pending);
+  client->pending = NULL;
+}
+
+int find_room(client_t *client, room_t *room) {
+  for (int i = 0; i < client->room_count; i++) {
+    if (client->rooms[i].room == room) {
+      return i;
+    }
   }
-  return write(client->socket, msg, strlen(msg));
+  return -1;
 }
 
-char *read_msg(client_t *client, int *err) {
-  int bufferlen;
-  int r = read(client->socket, &bufferlen, sizeof(bufferlen));
-  if (r <= 0) {
-    if (err) *err = r;
+bool replayed(client_t *client, int membership, frame_t *frame) {
+  //a message recorded before the client joined may reach it live after its
+  //history was sent, the history had it already
+  return frame->seq && client->rooms[membership].seen >= frame->seq;
+}
+
+void deliver_frame(worker_t *worker, room_t *room, frame_t *frame, int skip) {
+  struct room_local_t *local = room->local + worker->index;
+  bool check = frame->seq && frame->seq <= local->replayed;
+  for (int i = 0; i < local->count; i++) {
+    client_t *member = local->members[i];
+    if (member->socket != skip && (!check || !replayed(member, find_room(member, room), frame))) {
+      send_frame(member, frame);
+    }
+  }
+  //clients still on their way here get it once the old worker lets go, their
+  //rooms may still change until then so it's held whatever the room and
+  //filtered once they settle
+  for (int i = 0; i < worker->incoming_len; i++) {
+    client_t *client = worker->incoming[i];
+    if (client->socket != skip) {
+      hold_frame(client, frame, room);
+    }
+  }
+  frelease(frame);
+  rooms_release(server_data.rooms, room);
+}
+
+int hold_buffer(client_t *client) {
+  if (client->read_buf) return 0;
+  client->read_buf = (char *)palloc(CLIENT_BUFFER_LEN);
+  if (!client->read_buf) return 1;
+  STAT_ADD(buffers, pblock_len(CLIENT_BUFFER_LEN));
+  return 0;
+}
+
+void drop_buffer(client_t *client) {
+  //only once nothing partial is left in it
+  if (!client->read_buf || client->read_len > 0) return;
+  pfree(client->read_buf);
+  client->read_buf = NULL;
+  STAT_SUB(buffers, pblock_len(CLIENT_BUFFER_LEN));
+}
+
+void destroy_client(void *arg) {
+  client_t *client = (client_t *)arg;
+  clear_queue(client);
+  drop_pending(client);
+  client->read_len = 0;
+  drop_buffer(client);
+  free(client->unread);
+  pthread_mutex_destroy(&client->mutex);
+  pfree(client);
+  STAT_SUB(clients, 1);
+}
+
+bool can_admit(void) {
+  return memory_used() + pblock_len(sizeof(client_t)) <= server_data.memory_limit;
+}
+
+void retire_client(client_t *client) {
+  //readers may still hold the client, nothing is written to it from now on
+  //and the memory goes once they are all done
+  pthread_mutex_lock(&client->mutex);
+  client->closing = true;
+  pthread_mutex_unlock(&client->mutex);
+  close(client->socket);
+  epoch_retire(client, destroy_client);
+}
+
+const char *op_names[OPCODES] = {
+  [OP_MSG] = "MSG",
+  [OP_NEW] = "NEW",
+  [OP_OUT] = "OUT",
+  [OP_LOGOUT] = "LOGOUT",
+  [OP_JOIN] = "JOIN",
+  [OP_PART] = "PART",
+  [OP_SAY] = "SAY",
+  [OP_DM] = "DM",
+  [OP_HISTORY] = "HISTORY"
+};
+
+frame_t *user_frame(int op, room_t *room, client_t *user, const char *text, int len) {
+  //one SAY, JOIN or PART in both protocols, text clients get the name and
+  //binary clients the id they learned from NEW or JOIN
+  //the lobby keeps MSG, NEW and OUT, other rooms put their name first
+  bool chat = op == OP_SAY;
+  if (!chat) {
+    text = op == OP_JOIN ? user->name : NULL;
+    len = text ? strlen(text) : 0;
+  }
+  frame_t *frame;
+  if (room == server_data.lobby) {
+    op = op == OP_SAY ? OP_MSG : op == OP_JOIN ? OP_NEW : OP_OUT;
+    if (op == OP_MSG) {
+      frame = fformat("MSG %s: %.*s", user->name, len, text);
+    } else {
+      frame = fformat("%s %s", op_names[op], user->name);
+    }
+    if (frame) frame->binary = fbinary(op, user->id, text, len);
+  } else {
+    if (op == OP_SAY) {
+      frame = fformat("SAY %s %s: %.*s", room->name, user->name, len, text);
+    } else {
+      frame = fformat("%s %s %s", op_names[op], room->name, user->name);
+    }
+    if (frame) frame->binary = fbinary_named(op, user->id, room->name, text, len);
+  }
+  if (frame && !frame->binary) {
+    frelease(frame);
     return NULL;
   }
-  bufferlen = ntohl(bufferlen);
-  char *newbuf = calloc(bufferlen + 1, sizeof(char));
-  int bytes_read = 0;
-  while (bufferlen > 0) {
-    char *buffer = calloc(bufferlen, sizeof(char));
-    int r = read(client->socket, buffer, bufferlen);
-    if (r <= 0) {
-      if (err) *err = r;
-      free(buffer);
-      free(newbuf);
-      return NULL;
-    }
-    strncat(newbuf, buffer, bufferlen);
-    bufferlen -= r;
-    bytes_read += r;
-    free(buffer);
-  }
-  if (err) *err = bytes_read;
-  return newbuf;
-}
-
-void broadcast_msg(const char *msg, client_t *exclude) {
-  pthread_mutex_lock(&server_data.list->mutex);
-  struct node_t *current = server_data.list->head;
-  while (current) {
-    if (exclude != NULL && current->data == exclude) {
-      current = current->next;
-      continue;
+  if (frame) frame->chat = frame->binary->chat = chat;
+  return frame;
+}
+
+frame_t *replay_frame(room_t *room, frame_t *frame) {
+  //binary clients may not know the sender's id anymore by the time a kept
+  //message is replayed, they get a REPLAY that names the sender instead, made
+  //by the first replay to one of them and shared by every later one
+  frame_t *replay = __atomic_load_n(&frame->replay, __ATOMIC_ACQUIRE);
+  if (replay) return replay;
+  //the text frame has the name, names have no spaces and end with a colon,
+  //the binary one has the id right after its opcode and varint length
+  char *name = strchr(fbody(frame), ' ') + 1;
+  if (room != server_data.lobby) name = strchr(name, ' ') + 1;
+  char *text = strchr(name, ' ') + 1;
+  char sender[sizeof(((client_t *)NULL)->name)];
+  int name_len = text - name - 2;
+  memcpy(sender, name, name_len);
+  sender[name_len] = '\0';
+  char *header = frame->binary->data + 1;
+  while (*header++ & 0x80);
+  unsigned int id;
+  memcpy(&id, header, sizeof(id));
+  replay = fbinary_names(OP_REPLAY, ntohl(id), room->name, sender, text, fbody(frame) + fbody_len(frame) - text);
+  if (!replay) return NULL;
+  replay->chat = true;
+  frame_t *expected = NULL;
+  if (!__atomic_compare_exchange_n(&frame->replay, &expected, replay, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    //another worker made it first
+    frelease(replay);
+    return expected;
+  }
+  return replay;
+}
+
+void send_roster(client_t *client, room_t *room) {
+  //the members' JOIN frames are kept with the roster and queued in one go
+  struct roster_snapshot_t *roster = roster_acquire(room->roster);
+  send_frames(client, roster->joined, roster->count);
+  roster_release();
+}
+
+void send_history(client_t *client, int membership, unsigned int since) {
+  //the room's messages newer than since, followed by HISTORY room last so the
+  //client knows where live messages pick up, the frames are the ones every
+  //member was sent and go out with a single write
+  room_t *room = client->rooms[membership].room;
+  frame_t *frames[MAX_HISTORY + 1];
+  unsigned int last;
+  int count = rooms_history(room, since, frames, &last);
+  for (int i = 0; client->protocol == PROTOCOL_BINARY && i < count; i++) {
+    frame_t *replay = replay_frame(room, frames[i]);
+    if (replay) {
+      fhold(replay);
+      funhold(frames[i]);
+      frames[i] = replay;
     }
-    send_msg(current->data, msg);
-    current = current->next;
   }
-  pthread_mutex_unlock(&server_data.list->mutex);
+  membership_t *joined = client->rooms + membership;
+  if (last > joined->seen) joined->seen = last;
+  struct room_local_t *local = room->local + client->worker->index;
+  if (last > local->replayed) local->replayed = last;
+  //the newest ones that leave the client room for live messages
+  long budget = server_data.queue_budget / 2 - client->queue_bytes;
+  int first = count;
+  while (first > 0) {
+    frame_t *frame = frames[first - 1];
+    frame_t *encoded = client->protocol == PROTOCOL_WS ? fws(frame) : wire(client, frame);
+    if (encoded == NULL || (budget -= encoded->len) < 0) break;
+    first--;
+  }
+  frame_t *marker = fformat("HISTORY %s %u", room->name, last);
+  if (marker) marker->binary = fbinary_named(OP_HISTORY, last, room->name, NULL, 0);
+  if (marker && marker->binary) {
+    frames[count++] = marker;
+  }
+  send_frames(client, frames + first, count - first);
+  for (int i = 0; i < count; i++) {
+    if (frames[i] != marker) funhold(frames[i]);
+  }
+  if (marker) frelease(marker);
+}
+
+int join_room(client_t *client, room_t *room) {
+  //the client learns about the members from the roster and the members
+  //about the client from its JOIN, which the roster keeps for later joiners
+  frame_t *frame = user_frame(OP_JOIN, room, client, NULL, 0);
+  if (!frame) return -1;
+  int membership = client->room_count++;
+  client->rooms[membership].room = room;
+  client->rooms[membership].slot = -1;
+  client->rooms[membership].seen = 0;
+  if (room_attach(room, client->worker->index, client, membership) != 0 ||
+      roster_add(room->roster, client, frame) != 0) {
+    room_detach(room, client->worker->index, client, membership);
+    client->room_count--;
+    frelease(frame);
+    return -1;
+  }
+  //the membership keeps the room
+  room_retain(room, 1);
+  send_roster(client, room);
+  if (server_data.history_len > 0) {
+    send_history(client, membership, 0);
+  }
+  broadcast_frame(room, frame, client);
+  return 0;
+}
+
+frame_t *leave_room(client_t *client, int membership) {
+  //returns the PART the rest of the room was sent
+  room_t *room = client->rooms[membership].room;
+  room_detach(room, client->worker->index, client, membership);
+  roster_remove(room->roster, client);
+  client->rooms[membership] = client->rooms[--client->room_count];
+  frame_t *frame = user_frame(OP_PART, room, client, NULL, 0);
+  if (frame) broadcast_frame(room, fretain(frame), NULL);
+  rooms_release(server_data.rooms, room);
+  return frame;
 }
 
 void logout(client_t *client) {
-  int mem = strlen("OUT ") + strlen(client->name) + 1;
-  char *buffer = calloc(mem, sizeof(char));
-  snprintf(buffer, mem, "OUT %s", client->name);
-  printf("%s logged out\n", client->name);
-  remove_client(client);
-  close_client(client);
-  broadcast_msg(buffer, NULL);
-  free(buffer);
-}
-
-void handle_message(char *message, client_t *client) {
-  if (starts_with(message, "MSG")) {
-    //broadcast the message to all subscribers
-    char *message_offset = message + strlen("MSG ");
-    printf("%s sent a message: '%s'\n", client->name, message_offset);
-    int mem = strlen(message) + strlen(client->name) + 3;
-    char *buffer = calloc(mem, sizeof(char));
-    snprintf(buffer, mem, "MSG %s: %s", client->name, message_offset);
-    broadcast_msg(buffer, NULL);
-    free(buffer);
-  }
-}
-
-void *listen_client(void *arg) {
-  client_t *client = (client_t *)arg;
-  while (true) {
-    int bytes;
-    char *message = read_msg(client, &bytes);
-    if (bytes == -1) {
-      perror("Message read error");
-      close_client(client);
-      break;
+  LOG(LOG_INFO, "%s logged out", client->name);
+  while (client->room_count > 0) {
+    frame_t *frame = leave_room(client, client->room_count - 1);
+    if (frame) frelease(frame);
+  }
+  rremove(server_data.registry, client);
+  retire_client(client);
+}
+
+bool valid_room(const char *name, int len) {
+  if (len <= 0 || len >= ROOM_NAME_LEN) return false;
+  for (int i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') return false;
+  }
+  return true;
+}
+
+room_t *joined_room(client_t *client, const char *name, int len) {
+  for (int i = 0; i < client->room_count; i++) {
+    room_t *room = client->rooms[i].room;
+    if (strncmp(room->name, name, len) == 0 && room->name[len] == '\0') {
+      return room;
     }
-    if (bytes == 0) {
-      printf("%s disconnected from the chat\n", client->name);
-      logout(client);
-      break;
+  }
+  return NULL;
+}
+
+void say(client_t *client, room_t *room, char *text, int len) {
+  //broadcast the message to the room's subscribers
+  LOG(LOG_DEBUG, "%s sent a message to %s: '%.*s'", client->name, room->name, len, text);
+  frame_t *frame = user_frame(OP_SAY, room, client, text, len);
+  if (frame) {
+    frame->received = now_us();
+    broadcast_frame(room, frame, NULL);
+  }
+}
+
+//handlers return a negative value when the client has to be disconnected
+typedef int (*message_handler_t)(client_t *client, char *body, int len);
+
+int handle_msg(client_t *client, char *body, int len) {
+  //MSG is a SAY to the lobby
+  if (find_room(client, server_data.lobby) >= 0) {
+    say(client, server_data.lobby, body, len);
+  }
+  return 0;
+}
+
+int handle_say(client_t *client, char *body, int len) {
+  //text clients end the room name with a space, binary ones put its length first
+  int name_len;
+  char *text;
+  if (client->protocol == PROTOCOL_BINARY) {
+    name_len = len > 0 ? (unsigned char)body[0] : 0;
+    if (name_len >= len) return 0;
+    body++;
+    len--;
+    text = body + name_len;
+  } else {
+    name_len = strcspn(body, " ");
+    text = body[name_len] ? body + name_len + 1 : body + name_len;
+  }
+  room_t *room = joined_room(client, body, name_len);
+  if (room) {
+    say(client, room, text, len - (text - body));
+  }
+  return 0;
+}
+
+int handle_join(client_t *client, char *body, int len) {
+  //the body is the room name, a room is created by its first JOIN
+  if (!valid_room(body, len) || joined_room(client, body, len) || client->room_count == ROOMS_PER_CLIENT) {
+    return 0;
+  }
+  room_t *room = rooms_find(server_data.rooms, body, len, true);
+  if (room == NULL || join_room(client, room) != 0) {
+    LOG(LOG_WARN, "%s couldn't join %.*s", client->name, len, body);
+  } else {
+    LOG(LOG_INFO, "%s joined %s", client->name, room->name);
+  }
+  //an empty room whose first JOIN failed goes again
+  if (room) rooms_release(server_data.rooms, room);
+  return 0;
+}
+
+int handle_part(client_t *client, char *body, int len) {
+  room_t *room = joined_room(client, body, len);
+  if (room == NULL) {
+    return 0;
+  }
+  //the client isn't a member anymore, it gets its own PART directly, the
+  //room may be gone once it's left
+  LOG(LOG_INFO, "%s left %.*s", client->name, len, body);
+  frame_t *frame = leave_room(client, find_room(client, room));
+  if (frame) {
+    send_frame(client, frame);
+    frelease(frame);
+  }
+  return 0;
+}
+
+void send_direct(unsigned long id, frame_t *frame) {
+  //only the owner writes the socket, so the frame goes through its mailbox,
+  //once a migration was posted it goes to the new worker which holds it
+  //back like a broadcast until the old one lets go
+  epoch_enter();
+  client_t *client = rget_id(server_data.registry, id);
+  if (client == NULL) {
+    frelease(frame);
+    epoch_exit();
+    return;
+  }
+  //posted under mutex, so it's either in front of the RELEASE or behind the
+  //ADOPT of a migration
+  pthread_mutex_lock(&client->mutex);
+  worker_t *worker = client->migrating ? client->adopter : client->worker;
+  if (post(worker, COMMAND_DIRECT, id, frame, NULL) != 0) {
+    frelease(frame);
+  }
+  pthread_mutex_unlock(&client->mutex);
+  epoch_exit();
+}
+
+void deliver_direct(worker_t *worker, unsigned long id, frame_t *frame) {
+  epoch_enter();
+  client_t *client = rget_id(server_data.registry, id);
+  if (client && client->migrating && client->adopter == worker) {
+    hold_frame(client, frame, NULL);
+  } else if (client && client->worker == worker) {
+    send_frame(client, frame);
+  }
+  epoch_exit();
+  frelease(frame);
+}
+
+int handle_dm(client_t *client, char *body, int len) {
+  //text clients end the user name with a space, binary ones put its length first
+  int name_len;
+  char *text;
+  if (client->protocol == PROTOCOL_BINARY) {
+    name_len = len > 0 ? (unsigned char)body[0] : 0;
+    if (name_len >= len) return 0;
+    body++;
+    len--;
+    text = body + name_len;
+  } else {
+    name_len = strcspn(body, " ");
+    text = body[name_len] ? body + name_len + 1 : body + name_len;
+  }
+  len -= text - body;
+  epoch_enter();
+  client_t *target = rget_name(server_data.registry, body, name_len);
+  if (target) {
+    LOG(LOG_DEBUG, "%s sent a message to %s: '%.*s'", client->name, target->name, len, text);
+    frame_t *frame = fformat("DM %s: %.*s", client->name, len, text);
+    if (frame) frame->binary = fbinary_named(OP_DM, client->id, client->name, text, len);
+    if (frame && frame->binary) {
+      frame->chat = frame->binary->chat = true;
+      frame->received = now_us();
     }
-    if (starts_with(message, "MSG")) {
-      //broadcast the message to all subscribers
-      char *message_offset = message + strlen("MSG ");
-      printf("%s sent a message: '%s'\n", client->name, message_offset);
-      int mem = strlen(message) + strlen(client->name) + 3;
-      char *buffer = calloc(mem, sizeof(char));
-      snprintf(buffer, mem, "MSG %s: %s", client->name, message_offset);
-      broadcast_msg(buffer, NULL);
-      free(buffer);
-    }
-    if (starts_with(message, "LOGOUT")) {
-      logout(client);
-      free(message);
-      break;
+    if (frame && frame->binary && target->worker == client->worker && !target->migrating) {
+      //this thread owns the target too, nothing else can be writing it
+      send_frame(target, frame);
+      frelease(frame);
+    } else if (frame && frame->binary) {
+      send_direct(target->id, frame);
+    } else if (frame) {
+      frelease(frame);
     }
-    free(message);
   }
+  epoch_exit();
   return 0;
 }
 
+int handle_history(client_t *client, char *body, int len) {
+  //HISTORY room since asks again for a joined room's messages after since,
+  //binary clients send the room's length first and since as 32 bits
+  int name_len;
+  unsigned int since = 0;
+  if (client->protocol == PROTOCOL_BINARY) {
+    name_len = len > 0 ? (unsigned char)body[0] : 0;
+    if (name_len >= len) return 0;
+    body++;
+    len--;
+    if (len - name_len >= (int)sizeof(since)) {
+      memcpy(&since, body + name_len, sizeof(since));
+      since = ntohl(since);
+    }
+  } else {
+    name_len = strcspn(body, " ");
+    if (body[name_len]) since = strtoul(body + name_len + 1, NULL, 10);
+  }
+  room_t *room = joined_room(client, body, name_len);
+  if (room) {
+    send_history(client, find_room(client, room), since);
+  }
+  return 0;
+}
+
+int handle_logout(client_t *client, char *body, int len) {
+  return -1;
+}
+
+//NEW and OUT only go from the server to the clients
+message_handler_t handlers[OPCODES] = {
+  [OP_MSG] = handle_msg,
+  [OP_LOGOUT] = handle_logout,
+  [OP_JOIN] = handle_join,
+  [OP_PART] = handle_part,
+  [OP_SAY] = handle_say,
+  [OP_DM] = handle_dm,
+  [OP_HISTORY] = handle_history
+};
+
+int text_opcode(char *message, char **body) {
+  //the command is the first word, the rest of the frame is its body
+  int len = strcspn(message, " ");
+  *body = message[len] ? message + len + 1 : message + len;
+  for (int op = 0; op < OPCODES; op++) {
+    if (op_names[op] && (int)strlen(op_names[op]) == len && strncmp(message, op_names[op], len) == 0) {
+      return op;
+    }
+  }
+  return 0;
+}
+
+int handle_control(client_t *client, int op, char *payload, int len) {
+  //pings are answered right away, a close is echoed with its status code
+  //and ends the connection
+  if (op == WS_PONG) {
+    return 0;
+  }
+  frame_t *frame = fwebsocket(op == WS_PING ? WS_PONG : WS_CLOSE, payload, op == WS_CLOSE && len > 2 ? 2 : len);
+  if (frame) {
+    send_frame(client, frame);
+    frelease(frame);
+  }
+  return op == WS_CLOSE ? -1 : 0;
+}
+
+int handle_message(client_t *client, int op, char *message, int len) {
+  if (client->protocol == PROTOCOL_WS) {
+    //a WebSocket message is a text protocol command once unmasked
+    wunmask(message, len, client->frame_mask);
+    if (op != WS_TEXT && op != WS_BINARY) {
+      return handle_control(client, op, message, len);
+    }
+    if (client->state != CLIENT_CHAT) {
+      //the first message of an upgraded connection is its LOGIN
+      if (len <= (int)strlen("LOGIN") || strncmp(message, "LOGIN ", strlen("LOGIN ")) != 0) {
+        return -1;
+      }
+      LOG(LOG_DEBUG, "Received request: %s", message);
+      return login_client(client, message) == 0 ? 0 : -1;
+    }
+  }
+  STAT_ADD(messages_in, 1);
+  if (client->protocol == PROTOCOL_TEXT || client->protocol == PROTOCOL_WS) {
+    char *body;
+    op = text_opcode(message, &body);
+    len -= body - message;
+    message = body;
+  }
+  if (op <= 0 || op >= OPCODES || handlers[op] == NULL) {
+    //unknown commands are ignored like the text protocol always did
+    return 0;
+  }
+  return handlers[op](client, message, len);
+}
+
+void wake_worker(worker_t *worker) {
+  mwake(worker->mailbox);
+}
+
 void server_cleanup(void) {
-  pthread_cancel(server_data.listening_thread);
-  close(server_data.socket);
-  pthread_mutex_lock(&server_data.list->mutex);
-  lclear(server_data.list);
-  pthread_mutex_unlock(&server_data.list->mutex);
+  //the balancer runs with any number of workers, it samples the memory in use
+  pthread_cancel(server_data.balancing_thread);
+  pthread_join(server_data.balancing_thread, NULL);
   pthread_mutex_lock(&workers_mutex);
   for (int i = 0; i < server_data.cores; i++) {
-    pthread_mutex_destroy(&server_data.workers[i].mutex);
-    pthread_mutex_destroy(&server_data.workers[i].pipe_mutex);
     pthread_cancel(server_data.workers[i].thread);
+    //wake the worker up so it reaches a cancellation point
+    wake_worker(server_data.workers + i);
+    pthread_join(server_data.workers[i].thread, NULL);
+  }
+  //a worker posts to the others' mailboxes up to when it stops
+  for (int i = 0; i < server_data.cores; i++) {
+    eclear(server_data.workers[i].events);
+    mclear(server_data.workers[i].mailbox);
+    free(server_data.workers[i].clients);
+    free(server_data.workers[i].incoming);
+    free(server_data.workers[i].dirty);
+    free(server_data.workers[i].waiting);
+    free(server_data.workers[i].scratch);
+    free(server_data.workers[i].batch_iov);
+    close(server_data.workers[i].listenfd);
   }
   free(server_data.workers);
   pthread_mutex_unlock(&workers_mutex);
+  //only once no worker can still release a room or look a client up
+  rclear(server_data.registry);
+  rooms_clear(server_data.rooms);
   pthread_mutex_destroy(&global_mutex);
   pthread_mutex_destroy(&workers_mutex);
 }
 
-void terminate_server(void) {
-  server_cleanup();
-  exit(0);
-}
-
 void close_client(client_t *client) {
-  close(client->socket);
-  free(client);
+  //only for clients that were never published to the roster, whatever a
+  //flush window held back (like TAKEN) still gets a chance to go out
+  //another worker may have found it in the registry just before, so it's
+  //retired like a logged in client
+  rremove(server_data.registry, client);
+  flush_client(client);
+  retire_client(client);
 }
 
 client_t *getclientbysocket(int fd) {
-  pthread_mutex_lock(&server_data.list->mutex);
-  struct node_t *current = server_data.list->head;
-  client_t *client = NULL;
-  while (current) {
-    if (current->data->socket == fd) {
-      client = current->data;
-      break;
+  return rget(server_data.registry, fd);
+}
+
+client_t *pick_client(worker_t *worker) {
+  //the busiest client that still fits the budget, moving a bigger one would
+  //only overload the other worker
+  client_t *pick = NULL;
+  unsigned long pick_load = 0;
+  for (int i = 0; i < worker->clients_len; i++) {
+    client_t *client = worker->clients[i];
+    //the load is about twice the cost per second
+    unsigned long load = charge_client(client, 0) / 2;
+    if (client->migrating || load > worker->migrate_budget || load <= pick_load) {
+      continue;
     }
-    current = current->next;
+    pick = client;
+    pick_load = load;
   }
-  pthread_mutex_unlock(&server_data.list->mutex);
-  return client;
+  return pick;
 }
 
-void deletefd(worker_t *worker, int fd) {
-  pthread_mutex_lock(&worker->mutex);
-  int index = -1;
-  for (int i = 0; i < worker->nfds; i++) {
-    if (worker->fds[i].fd == fd) {
-      index = i;
-      break;
+void migrate_client(worker_t *worker, worker_t *dest) {
+  client_t *client = pick_client(worker);
+  if (client == NULL || dest == worker) {
+    return;
+  }
+  //with the mutexes of the client's rooms held, RELEASE lands behind every
+  //broadcast to them this worker has been sent so far and ADOPT in front of
+  //every later one for the other worker, so the client gets each broadcast
+  //exactly once from one of them, the worker doesn't touch the client's
+  //rooms again before it handles the RELEASE
+  //the mutexes are taken in address order so two migrations can't deadlock
+  room_t *rooms[ROOMS_PER_CLIENT];
+  int count = client->room_count;
+  for (int i = 0; i < count; i++) {
+    room_t *room = client->rooms[i].room;
+    int j = i;
+    for (; j > 0 && (uintptr_t)rooms[j - 1] > (uintptr_t)room; j--) {
+      rooms[j] = rooms[j - 1];
     }
+    rooms[j] = room;
   }
-  if (index != -1) {
-    int data[3];
-    data[PIPE_DATATYPE] = PIPE_REMOVE;
-    data[PIPE_INDEX] = index;
-    data[PIPE_VAL] = fd;
-    write(worker->pipeptr[PIPE_WRITE], &data, sizeof(data));
+  for (int i = 0; i < count; i++) {
+    pthread_mutex_lock(&rooms[i]->mutex);
+  }
+  pthread_mutex_lock(&client->mutex);
+  client->migrating = true;
+  client->adopter = dest;
+  client->released = false;
+  post(worker, COMMAND_RELEASE, dest->index, client, NULL);
+  post(dest, COMMAND_ADOPT, 0, client, NULL);
+  pthread_mutex_unlock(&client->mutex);
+  for (int i = count - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&rooms[i]->mutex);
   }
-  pthread_mutex_unlock(&worker->mutex);
 }
 
-void addfd(worker_t *worker, int fd) {
-  pthread_mutex_lock(&worker->mutex);
-  int index = -1;
-  for (int i = 0; i < worker->nfds; i++) {
-    if (worker->fds[i].fd == VACANT_FD) {
-      index = i;
-      break;
+void release_client(worker_t *worker, client_t *client, worker_t *dest) {
+  //nobody watches the socket until the other worker adopts it, the parser
+  //state, the queue and what io_uring received travel with the client
+  client->unread = etake(worker->events, client->socket, &client->unread_len);
+  if (eremove(worker->events, client->socket) == 0) {
+    worker->saved_fds--;
+  }
+  detach_client(worker, client);
+  undirty(worker, client);
+  for (int i = 0; i < client->room_count; i++) {
+    room_detach(client->rooms[i].room, worker->index, client, i);
+  }
+  pthread_mutex_lock(&client->mutex);
+  client->worker = dest;
+  client->want_out = false;
+  pthread_mutex_unlock(&client->mutex);
+  __atomic_store_n(&client->released, true, __ATOMIC_RELEASE);
+  STAT_ADD(migrations, 1);
+  wake_worker(dest);
+}
+
+void adopt_client(worker_t *worker, client_t *client) {
+  if (grow_clients(&worker->incoming, &worker->incoming_cap, worker->incoming_len)) {
+    LOG(LOG_ERROR, "Migration error: %m");
+    return;
+  }
+  worker->incoming[worker->incoming_len++] = client;
+}
+
+void settle_client(worker_t *worker, client_t *client) {
+  client->migrating = false;
+  bool attached = eadd(worker->events, client->socket) == 0;
+  if (attached) {
+    worker->saved_fds++;
+    egive(worker->events, client->socket, client->unread, client->unread_len);
+    client->unread = NULL;
+    attached = attach_client(worker, client) == 0;
+  }
+  for (int i = 0; attached && i < client->room_count; i++) {
+    room_t *room = client->rooms[i].room;
+    attached = room_attach(room, worker->index, client, i) == 0;
+    //live copies of what it was replayed are still checked here
+    if (client->rooms[i].seen > room->local[worker->index].replayed) {
+      room->local[worker->index].replayed = client->rooms[i].seen;
     }
   }
-  if (index != -1) {
-    pthread_mutex_lock(&worker->pipe_mutex);
-    int data[3];
-    data[PIPE_DATATYPE] = PIPE_ADD;
-    data[PIPE_INDEX] = index;
-    data[PIPE_VAL] = fd;
-    write(worker->pipeptr[PIPE_WRITE], &data, sizeof(data));
-    pthread_mutex_unlock(&worker->pipe_mutex);
+  if (!attached) {
+    LOG(LOG_ERROR, "Migration error: %m");
+    disconnect_client(worker, client);
+    return;
   }
-  pthread_mutex_unlock(&worker->mutex);
+  for (int i = 0; client->pending && i < client->pending->len; i++) {
+    frame_t *frame = client->pending->held[i].frame;
+    room_t *room = client->pending->held[i].room;
+    int membership = room ? find_room(client, room) : -1;
+    if (!room || (membership >= 0 && !replayed(client, membership, frame))) {
+      send_frame(client, frame);
+    }
+  }
+  drop_pending(client);
+  //whatever became ready in transit has no edge left to report it
+  handle_client(worker, client, EVENT_IN | EVENT_OUT);
 }
 
-void *watch_sockets(void *arg) {
-  worker_t *worker = (worker_t *)arg;
-  while (true) {
-    pthread_mutex_lock(&worker->mutex);
-    struct pollfd *fds = worker->fds;
-    int nfds = worker->nfds;
-    pthread_mutex_unlock(&worker->mutex);
-    int res = poll(fds, nfds, -1);
-    if (res < 0) {
-      perror("Poll error");
+void settle_incoming(worker_t *worker) {
+  for (int i = 0; i < worker->incoming_len;) {
+    client_t *client = worker->incoming[i];
+    if (!__atomic_load_n(&client->released, __ATOMIC_ACQUIRE)) {
+      i++;
       continue;
     }
-    pthread_mutex_lock(&worker->mutex);
-    for (int i = 0; i < nfds; i++) {
-      struct pollfd pfd = fds[i];
-      if (pfd.revents & POLLHUP) {
-        //socket disconnected
-        pfd.revents = 0;
-        client_t *client = getclientbysocket(pfd.fd);
-        printf("%s disconnected from the chat\n", client->name);
-        logout(client);
-        deletefd(worker, pfd.fd);
+    worker->incoming[i] = worker->incoming[--worker->incoming_len];
+    settle_client(worker, client);
+  }
+}
+
+void read_mailbox(worker_t *worker) {
+  //the eventfd is edge-triggered too, so every pending command is handled now
+  mwoken(worker->mailbox);
+  command_t command;
+  while (mtake(worker->mailbox, &command)) {
+    if (command.type == COMMAND_BROADCAST) {
+      deliver_frame(worker, (room_t *)command.arg, (frame_t *)command.ptr, command.val);
+    } else if (command.type == COMMAND_MIGRATE) {
+      migrate_client(worker, server_data.workers + command.val);
+    } else if (command.type == COMMAND_RELEASE) {
+      release_client(worker, (client_t *)command.ptr, server_data.workers + command.val);
+    } else if (command.type == COMMAND_ADOPT) {
+      adopt_client(worker, (client_t *)command.ptr);
+    } else if (command.type == COMMAND_DIRECT) {
+      deliver_direct(worker, command.val, (frame_t *)command.ptr);
+    }
+  }
+  if (worker->incoming_len > 0) {
+    settle_incoming(worker);
+  }
+}
+
+void wrote_pending(worker_t *worker, client_t *client, int queued, int res) {
+  //what was written is charged, the rest waits for the socket to be writable
+  charge(worker, client, 0, queued - client->queue_bytes);
+  if (res == 1) {
+    watch_writable(client);
+  } else if (client->want_out) {
+    client->want_out = false;
+    emodify(worker->events, client->socket, EVENT_IN);
+  }
+}
+
+int write_pending(worker_t *worker, client_t *client) {
+  //returns 0 once everything queued is written
+  pthread_mutex_lock(&client->mutex);
+  int queued = client->queue_bytes;
+  int res = flush_client(client);
+  wrote_pending(worker, client, queued, res);
+  pthread_mutex_unlock(&client->mutex);
+  return res;
+}
+
+void write_batch(worker_t *worker, client_t **clients, int count) {
+  //one write for each queue, all of them handed to the backend at once, a
+  //queue that took the whole write and has more goes on with flush_client
+  ewrite_t writes[WRITES_PER_BATCH];
+  int queued[WRITES_PER_BATCH];
+  for (int i = 0; i < count; i++) {
+    client_t *client = clients[i];
+    pthread_mutex_lock(&client->mutex);
+    queued[i] = client->queue_bytes;
+    writes[i].fd = client->socket;
+    writes[i].iov = worker->batch_iov + i * IOV_PER_WRITE;
+    writes[i].iovcnt = gather(client, writes[i].iov);
+    pthread_mutex_unlock(&client->mutex);
+  }
+  ewritev(worker->events, writes, count);
+  for (int i = 0; i < count; i++) {
+    client_t *client = clients[i];
+    int w = writes[i].res;
+    int res = 1;
+    pthread_mutex_lock(&client->mutex);
+    if (w < 0 && w != -EAGAIN && w != -EWOULDBLOCK) {
+      res = -1;
+    } else if (w >= 0) {
+      int len = 0;
+      for (int j = 0; j < writes[i].iovcnt; j++) {
+        len += writes[i].iov[j].iov_len;
+      }
+      written(client, w);
+      //a short write means the socket is full
+      res = w == len ? flush_client(client) : 1;
+    }
+    wrote_pending(worker, client, queued[i], res);
+    pthread_mutex_unlock(&client->mutex);
+  }
+}
+
+int flush_due(worker_t *worker) {
+  //writes the queues whose flush window is over, returns the ms until the
+  //next one ends or -1 when nothing waits
+  long now = now_us();
+  long next = -1;
+  client_t *due[WRITES_PER_BATCH];
+  int count = 0;
+  for (int i = 0; i < worker->dirty_len;) {
+    client_t *client = worker->dirty[i];
+    if (client->flush_at > now) {
+      if (next < 0 || client->flush_at - now < next) {
+        next = client->flush_at - now;
+      }
+      i++;
+      continue;
+    }
+    undirty(worker, client);
+    if (server_data.flush_window > 0) {
+      //io_uring's writes at the end of a wakeup aren't held back
+      unsigned long delay = now - client->flush_at + server_data.flush_window * 1000L;
+      STAT_ADD(delayed_flushes, 1);
+      STAT_ADD(flush_delay, delay);
+      stats_t *stats = &metrics_local()->stats;
+      if (delay > stats->max_flush_delay) {
+        __atomic_store_n(&stats->max_flush_delay, delay, __ATOMIC_RELAXED);
+      }
+    }
+    due[count++] = client;
+    if (count == WRITES_PER_BATCH) {
+      write_batch(worker, due, count);
+      count = 0;
+    }
+  }
+  if (count > 0) {
+    write_batch(worker, due, count);
+  }
+  return next < 0 ? -1 : (next + 999) / 1000;
+}
+
+int drop_expired(worker_t *worker) {
+  //closes the connections that sent no complete request in time, slow
+  //senders included, sweeping at most once a second, returns the ms until
+  //the next sweep
+  long now = now_us();
+  if (now >= worker->sweep_at) {
+    for (int i = 0; i < worker->waiting_len;) {
+      if (worker->waiting[i].deadline > now) {
+        i++;
         continue;
       }
-      if (pfd.revents & POLLIN) {
-        //there is data to read
-        pfd.revents = 0;
-        if (pfd.fd == worker->pipeptr[PIPE_READ]) {
-          //a worker pipe was used to wake up poll()
-          pthread_mutex_lock(&worker->pipe_mutex);
-          int data[3];
-          read(worker->pipeptr[PIPE_READ], &data, sizeof(data));
-          if (data[PIPE_DATATYPE] == PIPE_ADD) {
-            fds[data[PIPE_INDEX]].fd = data[PIPE_VAL];
-            worker->saved_fds++;
-          } else if (data[PIPE_DATATYPE] == PIPE_REMOVE) {
-            fds[data[PIPE_INDEX]].fd = VACANT_FD;
-            worker->saved_fds--;
-          }
-          pthread_mutex_unlock(&worker->pipe_mutex);
-          continue;
-        }
-        client_t *client = getclientbysocket(pfd.fd);
-        int bytes;
-        char *message = read_msg(client, &bytes);
-        if (bytes == -1) {
-          perror("Message read error");
-          close_client(client);
-          break;
-        }
-        if (bytes == 0) {
-          printf("%s disconnected from the chat\n", client->name);
-          logout(client);
-          deletefd(worker, pfd.fd);
-        }
-        handle_message(message, client);
-        free(message);
+      //a busy worker may not have read what it sent yet, which is handled
+      //first, a complete request or LOGIN gets it off the hook
+      client_t *client = worker->waiting[i].client;
+      handle_client(worker, client, EVENT_IN);
+      if (i < worker->waiting_len && worker->waiting[i].client == client && worker->waiting[i].deadline <= now) {
+        //the last one takes the slot
+        LOG(LOG_DEBUG, "Timed out a connection waiting for a request");
+        STAT_ADD(timeouts, 1);
+        disconnect_client(worker, client);
       }
     }
-    pthread_mutex_unlock(&worker->mutex);
+    worker->sweep_at = now + 1000000L;
   }
-  return 0;
+  return (worker->sweep_at - now + 999) / 1000;
 }
 
-FILE *openfile(const char *name, const char *mode) {
-  char *rpath = realpath(name, NULL);
-  if (rpath == NULL) {
-    return NULL;
+int parse_header(client_t *client, char *buf, int available) {
+  //returns the header length, 0 while it's incomplete and -1 for a bad frame
+  if (client->protocol == PROTOCOL_TEXT) {
+    if (available < FRAME_HEADER_LEN) return 0;
+    int len;
+    memcpy(&len, buf, FRAME_HEADER_LEN);
+    len = ntohl(len);
+    if (len < 0 || len > MAX_FRAME_LEN) return -1;
+    client->frame_len = len;
+    client->frame_op = 0;
+    return FRAME_HEADER_LEN;
+  }
+  if (client->protocol == PROTOCOL_WS) {
+    int op, len;
+    unsigned int mask;
+    int header = wparse(buf, available, &op, &len, &mask);
+    if (header <= 0) return header;
+    client->frame_len = len;
+    client->frame_op = op;
+    client->frame_mask = mask;
+    return header;
+  }
+  unsigned long len = 0;
+  for (int i = 1; i < available && i <= MAX_VARINT_LEN; i++) {
+    len |= (unsigned long)(buf[i] & 0x7f) << (7 * (i - 1));
+    if (buf[i] & 0x80) continue;
+    int op = (unsigned char)buf[0];
+    if (op >= OPCODES || len > MAX_FRAME_LEN) return -1;
+    client->frame_len = len;
+    client->frame_op = op;
+    return i + 1;
+  }
+  return available > MAX_VARINT_LEN ? -1 : 0;
+}
+
+void ring_copy(client_t *client, char *dst, int len) {
+  //copies the first len unparsed bytes, which may wrap around the ring's end
+  int first = CLIENT_BUFFER_LEN - client->read_head;
+  if (first > len) first = len;
+  memcpy(dst, client->read_buf + client->read_head, first);
+  memcpy(dst + first, client->read_buf, len - first);
+}
+
+void ring_consume(client_t *client, int len) {
+  client->read_head = (client->read_head + len) & (CLIENT_BUFFER_LEN - 1);
+  client->read_len -= len;
+}
+
+int ring_read(client_t *client) {
+  //one readv fills the free part of the ring, up to two segments when it
+  //wraps, a byte stays free to NUL terminate a body in place
+  int tail = (client->read_head + client->read_len) & (CLIENT_BUFFER_LEN - 1);
+  int space = CLIENT_BUFFER_LEN - 1 - client->read_len;
+  int first = CLIENT_BUFFER_LEN - tail;
+  if (first > space) first = space;
+  struct iovec iov[2] = {
+    {client->read_buf + tail, first},
+    {client->read_buf, space - first}
+  };
+  return ereadv(client->worker->events, client->socket, iov, space > first ? 2 : 1);
+}
+
+int parse_frames(worker_t *worker, client_t *client) {
+  //returns -1 for a protocol error and 1 when the client asked to leave
+  int res = 0;
+  while (res == 0) {
+    if (client->parse_state == PARSE_HEADER) {
+      //headers are a few bytes, copying them is cheaper than wrapping the parser
+      char buf[WS_MAX_HEADER];
+      int available = client->read_len < (int)sizeof(buf) ? client->read_len : (int)sizeof(buf);
+      ring_copy(client, buf, available);
+      int header = parse_header(client, buf, available);
+      if (header < 0) return -1;
+      if (header == 0) break;
+      client->parse_state = PARSE_BODY;
+      ring_consume(client, header);
+      continue;
+    }
+    if (client->read_len < client->frame_len) break;
+    //the body is handled where it was read, NUL terminated for the text
+    //commands, the byte after it may belong to the next frame
+    char *message = client->read_buf + client->read_head;
+    if (client->read_head + client->frame_len >= CLIENT_BUFFER_LEN) {
+      //there's no room for the terminator before the end of the ring
+      message = worker->scratch;
+      ring_copy(client, message, client->frame_len);
+      STAT_ADD(wrapped_frames, 1);
+    }
+    char next = message[client->frame_len];
+    message[client->frame_len] = '\0';
+    client->parse_state = PARSE_HEADER;
+    if (handle_message(client, client->frame_op, message, client->frame_len) < 0) {
+      res = 1;
+    }
+    message[client->frame_len] = next;
+    ring_consume(client, client->frame_len);
+  }
+  //an empty ring starts over so short frames rarely wrap
+  if (client->read_len == 0) client->read_head = 0;
+  return res;
+}
+
+int read_frames(worker_t *worker, client_t *client) {
+  //reads until the socket is drained, returns 0 when the client hung up
+  if (hold_buffer(client)) {
+    return -1;
   }
-  FILE *file = fopen(rpath, mode);
-  free(rpath);
-  return file;
-}
-
-void handle_get(char *request, client_t *client) {
-  char response_buf[BUFFER_LEN];
-  if (starts_with(request, "/ HTTP")) {
-    FILE *html = openfile("webassets/index.html", "r");
-    if (!html) {
-      perror("read file error");
-      close_client(client);
-      terminate_server();
-    }
-    write(client->socket, HTTP_200, strlen(HTTP_200));
-    while (fread(response_buf, 1, BUFFER_LEN, html) > 0) {
-      write(client->socket, response_buf, strlen(response_buf));
-      memset(response_buf, 0, BUFFER_LEN);
-    }
-    fclose(html);
-  } else if (starts_with(request, "/download HTTP")) {
-    FILE *file = openfile("downloads/client.c", "r");
-    if (!file) {
-      perror("read file error");
-      close_client(client);
-      terminate_server();
-    }
-    write(client->socket, HTTP_200, strlen(HTTP_200));
-    while (fread(response_buf, 1, BUFFER_LEN, file) > 0) {
-      write(client->socket, response_buf, strlen(response_buf));
-      memset(response_buf, 0, BUFFER_LEN);
-    }
-    fclose(file);
+  while (true) {
+    int r = ring_read(client);
+    STAT_ADD(read_calls, 1);
+    if (r == 0) {
+      return 0;
+    }
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        drop_buffer(client);
+        return 1;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    client->read_len += r;
+    STAT_ADD(bytes_read, r);
+    charge(worker, client, 0, r);
+    int res = parse_frames(worker, client);
+    if (res < 0) {
+      errno = EPROTO;
+      return -1;
+    }
+    if (res > 0) {
+      return 0;
+    }
+  }
+}
+
+void disconnect_client(worker_t *worker, client_t *client) {
+  //the socket has to leave the worker before it's closed and the slot reused,
+  //frames held back for a batch, like a WebSocket close echo, go out first
+  if (client->dirty_slot >= 0) {
+    write_pending(worker, client);
+  }
+  if (eremove(worker->events, client->socket) == 0) {
+    worker->saved_fds--;
+  }
+  if (client->state == CLIENT_CHAT) {
+    detach_client(worker, client);
+  } else {
+    unwait(worker, client);
+  }
+  undirty(worker, client);
+  if (client->state == CLIENT_CHAT) {
+    logout(client);
   } else {
+    close_client(client);
+  }
+}
+
+void write_counter(FILE *out, const char *name, const char *type, const char *help, unsigned long value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type, name, value);
+}
+
+frame_t *metrics_page(void) {
+  //the Prometheus text format, blocks of the threads are only added up here
+  static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static struct {
+    long at;
+    unsigned long in;
+    unsigned long out;
+  } last;
+  stats_t stats;
+  histogram_t fan_out;
+  metrics_sum(&stats, &fan_out);
+  char *page = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&page, &len);
+  if (!out) return NULL;
+  fprintf(out, "# HELP chat_clients Logged in clients.\n# TYPE chat_clients gauge\n");
+  for (int i = 0; i < server_data.cores; i++) {
+    fprintf(out, "chat_clients{worker=\"%d\"} %d\n", i,
+      __atomic_load_n(&server_data.workers[i].clients_len, __ATOMIC_RELAXED));
+  }
+  //per worker series come from the block of the worker's own thread
+  const char *per_worker[][3] = {
+    {"chat_wakeups_total", "Returns from waiting on the sockets.", "wakeups"},
+    {"chat_messages_in_total", "Frames read from clients.", "messages_in"},
+    {"chat_frames_out_total", "Frames written to clients.", "frames_written"}
+  };
+  for (int m = 0; m < 3; m++) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", per_worker[m][0], per_worker[m][1], per_worker[m][0]);
+    for (struct metrics_t *block = metrics_list(); block; block = block->next) {
+      if (block->worker < 0) continue;
+      unsigned long *field = m == 0 ? &block->stats.wakeups : m == 1 ? &block->stats.messages_in : &block->stats.frames_written;
+      unsigned long value = __atomic_load_n(field, __ATOMIC_RELAXED);
+      fprintf(out, "%s{worker=\"%d\"} %lu\n", per_worker[m][0], block->worker, value);
+    }
+  }
+  pthread_mutex_lock(&mutex);
+  long now = now_us();
+  double seconds = (now - last.at) / 1e6;
+  fprintf(out, "# HELP chat_messages_in_per_second Frames read from clients per second since the last scrape.\n");
+  fprintf(out, "# TYPE chat_messages_in_per_second gauge\nchat_messages_in_per_second %.1f\n",
+    last.at ? (stats.messages_in - last.in) / seconds : 0.0);
+  fprintf(out, "# HELP chat_frames_out_per_second Frames written to clients per second since the last scrape.\n");
+  fprintf(out, "# TYPE chat_frames_out_per_second gauge\nchat_frames_out_per_second %.1f\n",
+    last.at ? (stats.frames_written - last.out) / seconds : 0.0);
+  last.at = now;
+  last.in = stats.messages_in;
+  last.out = stats.frames_written;
+  pthread_mutex_unlock(&mutex);
+  write_counter(out, "chat_read_calls_total", "counter", "read calls on client sockets.", stats.read_calls);
+  write_counter(out, "chat_read_bytes_total", "counter", "Bytes read from clients.", stats.bytes_read);
+  write_counter(out, "chat_write_calls_total", "counter", "writev calls on client sockets.", stats.writev_calls);
+  write_counter(out, "chat_written_bytes_total", "counter", "Bytes written to clients.", stats.bytes_written);
+  fprintf(out, "# HELP chat_bytes_per_read Average bytes per read call.\n# TYPE chat_bytes_per_read gauge\n");
+  fprintf(out, "chat_bytes_per_read %.1f\n", stats.read_calls ? (double)stats.bytes_read / stats.read_calls : 0.0);
+  fprintf(out, "# HELP chat_bytes_per_write Average bytes per writev call.\n# TYPE chat_bytes_per_write gauge\n");
+  fprintf(out, "chat_bytes_per_write %.1f\n", stats.writev_calls ? (double)stats.bytes_written / stats.writev_calls : 0.0);
+  write_counter(out, "chat_queued_bytes", "gauge", "Bytes waiting in outbound queues.", stats.bytes_queued);
+  write_counter(out, "chat_max_queue_bytes", "gauge", "The most bytes one client had queued.", stats.max_queue_depth);
+  write_counter(out, "chat_history_bytes", "gauge", "Bytes of messages the rooms' histories hold.", stats.history_bytes);
+  write_counter(out, "chat_dropped_frames_total", "counter", "Chat frames slow clients never got.", stats.dropped_frames);
+  write_counter(out, "chat_evicted_clients_total", "counter", "Clients dropped for falling behind.", stats.evicted_clients);
+  write_counter(out, "chat_request_timeouts_total", "counter", "Connections closed for not sending a request in time.", stats.timeouts);
+  write_counter(out, "chat_migrations_total", "counter", "Clients moved between workers.", stats.migrations);
+  write_counter(out, "chat_mailbox_overflows_total", "counter", "Commands that overflowed a full mailbox.", stats.mailbox_overflows);
+  write_counter(out, "chat_log_records_dropped_total", "counter", "Log records lost to full rings.", ldropped());
+  //the fine buckets are summed into powers of two from 16 us to 32 s
+  const char *name = "chat_fanout_latency_seconds";
+  fprintf(out, "# HELP %s From reading a message to its last write.\n# TYPE %s histogram\n", name, name);
+  unsigned long seen = 0;
+  int bucket = 0;
+  for (int shift = 4; shift <= 25; shift++) {
+    while (bucket < HIST_BUCKETS && hbucket_max(bucket) < 1UL << shift) {
+      seen += fan_out.counts[bucket++];
+    }
+    fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", name, (double)(1UL << shift) / 1e6, seen);
+  }
+  while (bucket < HIST_BUCKETS) seen += fan_out.counts[bucket++];
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %g\n%s_count %lu\n", name, seen, name, fan_out.sum / 1e6, name, seen);
+  fprintf(out, "# HELP chat_fanout_latency_quantile_seconds Fan-out latency percentiles.\n");
+  fprintf(out, "# TYPE chat_fanout_latency_quantile_seconds gauge\n");
+  const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  for (int i = 0; i < 4; i++) {
+    fprintf(out, "chat_fanout_latency_quantile_seconds{quantile=\"%g\"} %g\n", quantiles[i],
+      hpercentile(&fan_out, quantiles[i]) / 1e6);
+  }
+  fclose(out);
+  frame_t *frame = fraw(page, len);
+  free(page);
+  return frame;
+}
+
+void send_raw(client_t *client, const char *data, int len) {
+  frame_t *frame = fraw(data, len);
+  if (frame) {
+    send_frame(client, frame);
+    frelease(frame);
+  }
+}
+
+void send_status(client_t *client, const char *status, const char *body, bool head) {
+  //a plain text response with the status as its body unless one is given
+  if (!body) body = status;
+  char res[256];
+  int res_len = snprintf(res, sizeof(res), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\n"
+    "Content-Length: %d\r\nConnection: %s\r\n\r\n%s", status, (int)strlen(body),
+    client->keep_alive ? "keep-alive" : "close", head ? "" : body);
+  send_raw(client, res, res_len);
+}
+
+void upgrade_client(client_t *client, http_request_t *request) {
+  //the connection becomes a WebSocket that speaks the text protocol
+  int len;
+  const char *key = hheader(request, "Sec-WebSocket-Key", &len);
+  int version_len;
+  const char *version = hheader(request, "Sec-WebSocket-Version", &version_len);
+  if (request->path_len != (int)strlen(WS_PATH) || strncmp(request->path, WS_PATH, request->path_len) != 0) {
+    send_status(client, "404 Not Found", NOT_FOUND, false);
+    return;
+  }
+  if (!key || !version || version_len != 2 || strncmp(version, "13", 2) != 0) {
+    client->keep_alive = false;
+    send_status(client, "400 Bad Request", NULL, false);
+    return;
+  }
+  char accept[WS_ACCEPT_LEN];
+  waccept(key, len, accept);
+  char res[256];
+  int res_len = snprintf(res, sizeof(res), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+    "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+  send_raw(client, res, res_len);
+  //everything after the response is WebSocket frames, both ways
+  client->protocol = PROTOCOL_WS;
+  client->state = CLIENT_WEBSOCKET;
+  client->keep_alive = false;
+}
+
+void answer_request(client_t *client, http_request_t *request) {
+  //the response is queued like chat frames, the worker reads the next request
+  //of a kept alive connection once all of it has been written
+  client->keep_alive = request->keep_alive;
+  bool head = request->method == HTTP_HEAD;
+  const char *path = request->path;
+  int path_len = request->path_len;
+  int upgrade_len;
+  const char *upgrade = hheader(request, "Upgrade", &upgrade_len);
+  if (!head && upgrade && upgrade_len == (int)strlen("websocket") && strncasecmp(upgrade, "websocket", upgrade_len) == 0) {
+    upgrade_client(client, request);
+    return;
+  }
+  if (path_len == (int)strlen("/metrics") && strncmp(path, "/metrics", path_len) == 0) {
+    frame_t *page = metrics_page();
+    if (page) {
+      char res[256];
+      int res_len = snprintf(res, sizeof(res), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\nConnection: %s\r\n\r\n", page->len, client->keep_alive ? "keep-alive" : "close");
+      send_raw(client, res, res_len);
+      if (!head) send_frame(client, page);
+      frelease(page);
+      return;
+    }
+  }
+  //cached assets go out as the frames they were loaded into
+  struct asset_t *asset = afind(server_data.assets, path, path_len);
+  epoch_enter();
+  struct asset_version_t *loaded = asset ? aversion(asset) : NULL;
+  if (loaded) {
+    int len;
+    const char *match = hheader(request, "If-None-Match", &len);
+    if (match && memmem(match, len, loaded->etag, strlen(loaded->etag))) {
+      send_frame(client, loaded->not_modified[client->keep_alive]);
+    } else {
+      send_frame(client, loaded->ok[client->keep_alive]);
+      if (!head) send_frame(client, loaded->body);
+    }
+  }
+  epoch_exit();
+  if (!loaded) {
     //unknown path
-    char res[] = HTTP_404 "Page not found";
-    write(client->socket, res, sizeof(res));
+    send_status(client, "404 Not Found", NOT_FOUND, head);
   }
-  close_client(client);
 }
 
-void *handle_new_connection(void *arg) {
-  client_t *client = (client_t *)arg;
-  char read_buf[BUFFER_LEN];
-  memset(read_buf, 0, BUFFER_LEN);
-  int bytes_received = read(client->socket, read_buf, BUFFER_LEN - 1);
-  //this server doesn't support long requests, only checking if it's an HTTP request
-  if (bytes_received < 0) {
-    perror("Request read error");
-    close_client(client);
+int handle_requests(client_t *client) {
+  //answers the complete requests buffered, a pipelining client gets up to
+  //HTTP_PIPELINE responses in one write and the rest once it's out
+  char *buf = client->read_buf;
+  int used = 0;
+  for (int i = 0; i < HTTP_PIPELINE; i++) {
+    http_request_t request;
+    http_result_t res = hparse(buf + used, client->read_len - used, &client->http_scanned, &request);
+    if (res == HTTP_PARTIAL) {
+      break;
+    }
+    client->state = CLIENT_HTTP;
+    if (res != HTTP_DONE) {
+      //the connection can't be read any further
+      const char *statuses[] = {
+        [HTTP_BAD] = "400 Bad Request",
+        [HTTP_TOO_LARGE] = "431 Request Header Fields Too Large",
+        [HTTP_UNSUPPORTED] = "501 Not Implemented"
+      };
+      LOG(LOG_DEBUG, "Refused request: %s", statuses[res]);
+      client->keep_alive = false;
+      send_status(client, statuses[res], NULL, false);
+      used = client->read_len;
+      break;
+    }
+    LOG(LOG_DEBUG, "Received request: %.*s", request.len, buf + used);
+    answer_request(client, &request);
+    used += request.len;
+    if (client->state == CLIENT_WEBSOCKET) {
+      //the frames that follow are parsed from the ring's start
+      client->read_head = 0;
+      client->parse_state = PARSE_HEADER;
+      break;
+    }
+    if (!client->keep_alive) {
+      //nothing after a request to close is answered
+      used = client->read_len;
+      break;
+    }
+  }
+  client->read_len -= used;
+  memmove(buf, buf + used, client->read_len);
+  if (used > 0) {
+    //the next request is timed from the last one answered
+    wait_request(client->worker, client);
+  }
+  return 1;
+}
+
+int login_client(client_t *client, char *request) {
+  char *login = request + strlen("LOGIN");
+  while (*login == ' ') login++;
+  int len = strcspn(login, " \r\n");
+  if (len == 0) {
+    return -1;
+  }
+  if (len > (int)sizeof(client->name) - 1) {
+    len = sizeof(client->name) - 1;
+  }
+  memcpy(client->name, login, len);
+  client->name[len] = '\0';
+  //newer clients ask for the binary protocol after their name, older servers
+  //ignore it and answer a plain LOGGED
+  char *version = login + strcspn(login, " \r\n");
+  while (*version == ' ') version++;
+  if (client->protocol != PROTOCOL_WS) {
+    client->protocol = strncmp(version, "v2", 2) == 0 ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+  }
+  //the name index makes names unique, LOGGED is never sent for a taken one
+  if (rclaim(server_data.registry, client) != 0) {
+    LOG(LOG_WARN, "%s is already taken", client->name);
+    send_msg(client, "TAKEN");
+    return -1;
+  }
+  unwait(client->worker, client);
+  client->state = CLIENT_CHAT;
+  if (attach_client(client->worker, client) != 0) {
+    return -1;
+  }
+  //LOGGED itself is always a text frame, everything after it uses the protocol
+  send_msg(client, client->protocol == PROTOCOL_BINARY ? "LOGGED v2" : "LOGGED");
+  LOG(LOG_INFO, "Logged %s to the chat", client->name);
+  return join_room(client, server_data.lobby);
+}
+
+bool is_prefix(const char *buf, int len, const char *str) {
+  int n = strlen(str);
+  return strncmp(buf, str, len < n ? len : n) == 0;
+}
+
+int handle_handshake(client_t *client) {
+  //sniffs whether a new connection is a chat login or an HTTP request
+  //returns 0 when the client hung up or has to be dropped
+  if (hold_buffer(client)) {
     return 0;
   }
-  printf("Received request: %s\n", read_buf);
-  if (starts_with(read_buf, "GET /")) {
-    handle_get(read_buf + strlen("GET "), client);
+  int space = CLIENT_BUFFER_LEN - 1 - client->read_len;
+  struct iovec iov = {client->read_buf + client->read_len, space};
+  int r = space > 0 ? ereadv(client->worker->events, client->socket, &iov, 1) : 0;
+  if (r == 0 && space > 0) {
     return 0;
   }
-  if (starts_with(read_buf, "LOGIN")) {
-    worker_t *worker = get_optimal_worker();
-    if (worker == NULL) {
-      //all workers are busy
-      send_msg(client, "BUSY");
-      close_client(client);
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      LOG(LOG_ERROR, "Request read error: %m");
       return 0;
     }
-    char *login = strtok(read_buf, " ");
-    login = strtok(NULL, " ");
-    strncpy(client->name, login, 20);
-    add_client(client);
-    addfd(worker, client->socket);
-    //signal that there is a new socket to watch
-
-    //old way
-    //pthread_create(&client->thread, NULL, listen_client, client);
-
-    send_msg(client, "LOGGED");
-    pthread_mutex_lock(&server_data.list->mutex);
-    struct node_t *current = server_data.list->tail;
-    while (current) {
-      int mem = strlen("NEW ") + strlen(current->data->name) + 1;
-      char *buf = calloc(mem, sizeof(char));
-      snprintf(buf, mem, "NEW %s", current->data->name);
-      send_msg(client, buf);
-      free(buf);
-      current = current->prev;
-    }
-    pthread_mutex_unlock(&server_data.list->mutex);
-    printf("Logged %s to the chat\n", login);
-    int mem = strlen("NEW ") + strlen(client->name) + 1;
-    char *buffer = calloc(mem, sizeof(char));
-    snprintf(buffer, mem, "NEW %s", client->name);
-    broadcast_msg(buffer, client);
-    free(buffer);
+    if (client->read_len == 0) {
+      //an idle kept alive connection holds no buffer
+      drop_buffer(client);
+      return 1;
+    }
+    //pipelined requests may be read already
+    r = 0;
+  }
+  client->read_len += r;
+  char *request = client->read_buf;
+  request[client->read_len] = '\0';
+  if (client->keep_alive) {
+    //a kept alive connection only ever sends more requests
+    return handle_requests(client);
+  }
+  if (is_prefix(request, client->read_len, "LOGIN")) {
+    if (client->read_len < (int)strlen("LOGIN")) {
+      //wait until there's enough to tell it from a request
+      return 1;
+    }
+    //the client sends its login unframed in one write and waits for LOGGED,
+    //whatever follows belongs to the frames sent after it
+    LOG(LOG_DEBUG, "Received request: %s", request);
+    client->read_head = 0;
+    client->read_len = 0;
+    client->parse_state = PARSE_HEADER;
+    return login_client(client, request) == 0;
+  }
+  if (hsniff(request, client->read_len)) {
+    return handle_requests(client);
   }
   return 0;
 }
 
-void *accept_connections(void *args) {
+void accept_clients(worker_t *worker) {
+  //the listener is edge-triggered, every pending connection is taken now
   while (true) {
     SA client_info;
-    socklen_t info_len;
-    int newconnectionfd = accept(server_data.socket, (SA *)&client_info, &info_len);
+    socklen_t info_len = sizeof(client_info);
+    int newconnectionfd = accept4(worker->listenfd, (SA *)&client_info, &info_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (newconnectionfd < 0) {
-      perror("Accept error");
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        //EMFILE included, the pending connections are retried on the next one
+        LOG(LOG_ERROR, "Accept error: %m");
+      }
+      return;
+    }
+    if (!can_admit()) {
+      //memory limit reached
+      frame_t *frame = fcreate("BUSY", strlen("BUSY"));
+      if (frame) {
+        write(newconnectionfd, frame->data, frame->len);
+        frelease(frame);
+      }
+      close(newconnectionfd);
       continue;
     }
-    client_t *newclient = calloc(1, sizeof(client_t));
+    client_t *newclient = (client_t *)pcalloc(sizeof(client_t));
+    if (newclient == NULL) {
+      close(newconnectionfd);
+      continue;
+    }
+    STAT_ADD(clients, 1);
     newclient->socket = newconnectionfd;
-    newclient->address = client_info;
-    newclient->address_len = info_len;
-    pthread_t thread;
-    pthread_create(&thread, NULL, handle_new_connection, newclient);
+    pthread_mutex_init(&newclient->mutex, NULL);
+    newclient->worker = worker;
+    newclient->worker_slot = -1;
+    newclient->dirty_slot = -1;
+    newclient->state = CLIENT_HANDSHAKE;
+    if (radd(server_data.registry, newclient) != 0) {
+      close(newconnectionfd);
+      destroy_client(newclient);
+      continue;
+    }
+    if (eadd(worker->events, newconnectionfd) != 0) {
+      close_client(newclient);
+      continue;
+    }
+    worker->saved_fds++;
+    if (wait_request(worker, newclient) != 0) {
+      disconnect_client(worker, newclient);
+      continue;
+    }
     char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_info, client_ip, INET_ADDRSTRLEN);
-    printf("%s connedted\n", client_ip);
+    inet_ntop(AF_INET, &((SA_IN *)&client_info)->sin_addr, client_ip, INET_ADDRSTRLEN);
+    LOG(LOG_INFO, "%s connected", client_ip);
   }
-  return 0;
 }
 
-int main(int argc, char **argv) {
-  int port = PORT;
-  if (argc == 2) {
-    port = atoi(argv[1]);
-    if (port < 1) {
-      printf("usage: %s <PORT>\n%s is not a valid port", argv[0], argv[1]);
-      exit(0);
+void linger_close(client_t *client) {
+  //closing with unread bytes resets the connection, which can throw away the
+  //response before the client reads it, so what already arrived is discarded
+  shutdown(client->socket, SHUT_WR);
+  char discard[KB];
+  struct iovec iov = {discard, sizeof(discard)};
+  for (int total = 0; total < HTTP_LINGER_BYTES;) {
+    int r = ereadv(client->worker->events, client->socket, &iov, 1);
+    if (r <= 0) break;
+    total += r;
+  }
+}
+
+void handle_client(worker_t *worker, client_t *client, int events) {
+  charge(worker, client, 1, 0);
+  if (client->state == CLIENT_HANDSHAKE && handle_handshake(client) == 0) {
+    disconnect_client(worker, client);
+    return;
+  }
+  while (client->state == CLIENT_HTTP) {
+    //once the whole response is out the connection goes away, unless it's
+    //kept alive and the next request is read
+    int res = write_pending(worker, client);
+    if (res == 1) {
+      return;
+    }
+    if (res < 0 || !client->keep_alive) {
+      if (res == 0) linger_close(client);
+      disconnect_client(worker, client);
+      return;
+    }
+    client->state = CLIENT_HANDSHAKE;
+    if (handle_handshake(client) == 0) {
+      disconnect_client(worker, client);
+      return;
+    }
+  }
+  if (client->state == CLIENT_HANDSHAKE) {
+    return;
+  }
+  if (client->state == CLIENT_WEBSOCKET && client->read_len > 0 && parse_frames(worker, client) != 0) {
+    //frames sent right behind the upgrade request were read with it
+    disconnect_client(worker, client);
+    return;
+  }
+  if (events & EVENT_OUT) {
+    //the socket can take more of the queued frames
+    write_pending(worker, client);
+  }
+  if ((client->state == CLIENT_CHAT || client->state == CLIENT_WEBSOCKET) && (events & (EVENT_IN | EVENT_HUP | EVENT_ERR))) {
+    //there is data to read or the socket was hung up
+    int res = read_frames(worker, client);
+    if (res == -1) {
+      LOG(LOG_ERROR, "Message read error: %m");
+    }
+    if (res <= 0) {
+      LOG(LOG_INFO, "%s disconnected from the chat", client->name);
+      disconnect_client(worker, client);
     }
   }
+}
 
-  server_data.cores = sysconf(_SC_NPROCESSORS_ONLN);
-  printf("Cores detected: %d\n", server_data.cores);
+void *watch_sockets(void *arg) {
+  worker_t *worker = (worker_t *)arg;
+  event_t ready[EVENTS_PER_WAKEUP];
+  int timeout = -1;
+  metrics_local()->worker = worker->index;
+  //server_cleanup cancels the worker, only while it waits so it never stops
+  //holding a room or the registry locked
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  while (true) {
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    //io_uring_enter isn't a cancellation point, epoll_wait and poll are
+    pthread_testcancel();
+    int res = ewait(worker->events, ready, EVENTS_PER_WAKEUP, timeout);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    STAT_ADD(wakeups, 1);
+    if (res < 0) {
+      if (errno != EINTR) {
+        LOG(LOG_ERROR, "Poll error: %m");
+      }
+      continue;
+    }
+    for (int i = 0; i < res; i++) {
+      event_t event = ready[i];
+      if (event.fd == worker->mailbox->fd) {
+        //another thread posted commands for this worker
+        read_mailbox(worker);
+        continue;
+      }
+      if (event.fd == worker->listenfd) {
+        accept_clients(worker);
+        continue;
+      }
+      client_t *client = getclientbysocket(event.fd);
+      //a client migrated earlier in this batch belongs to another worker now
+      //and one being migrated is handled by its new worker once it settles
+      if (client != NULL && client->worker == worker && !client->migrating) {
+        handle_client(worker, client, event.events);
+      }
+    }
+    //dropping an expired client may queue frames, flushed right after
+    timeout = worker->waiting_len > 0 ? drop_expired(worker) : -1;
+    if (worker->dirty_len > 0) {
+      int flush = flush_due(worker);
+      if (timeout < 0 || (flush >= 0 && flush < timeout)) timeout = flush;
+    }
+    //free clients and snapshots no reader can see anymore
+    epoch_collect();
+  }
+  return 0;
+}
 
-  if (server_data.cores > 1) {
-    //if there's more than one core
-    //the server will use one core to listen for new connections only
-    server_data.cores -= 1;
+void *balance_workers(void *arg) {
+  //moves hot clients from the busiest worker to the idlest one, a client at a
+  //time so a single talker doesn't bounce between them
+  //with a single worker it only samples the memory in use
+  while (true) {
+    sleep(BALANCE_INTERVAL);
+    sample_memory();
+    if (server_data.cores < 2) {
+      continue;
+    }
+    worker_t *busiest = NULL, *idlest = NULL;
+    unsigned long most = 0, least = 0;
+    for (int i = 0; i < server_data.cores; i++) {
+      worker_t *worker = server_data.workers + i;
+      unsigned long events = __atomic_load_n(&worker->load_events, __ATOMIC_RELAXED);
+      unsigned long bytes = __atomic_load_n(&worker->load_bytes, __ATOMIC_RELAXED);
+      worker->rate_events = (events - worker->seen_events) / BALANCE_INTERVAL;
+      worker->rate_bytes = (bytes - worker->seen_bytes) / BALANCE_INTERVAL;
+      worker->seen_events = events;
+      worker->seen_bytes = bytes;
+      unsigned long load = worker->rate_events + worker->rate_bytes / LOAD_BYTES_PER_EVENT;
+      if (busiest == NULL || load > most) {
+        busiest = worker;
+        most = load;
+      }
+      if (idlest == NULL || load < least) {
+        idlest = worker;
+        least = load;
+      }
+    }
+    if (most < BALANCE_MIN_LOAD || most < least * BALANCE_RATIO) {
+      continue;
+    }
+    busiest->migrate_budget = (most - least) / 2;
+    post(busiest, COMMAND_MIGRATE, idlest->index, NULL, NULL);
   }
+  return 0;
+}
 
-  printf("Max users possible: %d\n", CLIENTS_PER_THREAD * server_data.cores);
-  server_data.socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_data.socket < 0) {
+int open_listener(int port, int backlog) {
+  //every worker gets its own listening socket, the kernel spreads the
+  //incoming connections over them
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
     perror("Socket error");
-    exit(0);
+    return -1;
   }
-
   int val = 1;
-  int err = setsockopt(server_data.socket, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-  if (err < 0) {
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
     perror("Coudln't make the server socket reusable");
-    exit(0);
+    close(fd);
+    return -1;
   }
-
   SA_IN address;
   memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
   address.sin_port = htons(port);
   address.sin_addr.s_addr = htonl(INADDR_ANY);
-
-  err = bind(server_data.socket, (SA *)&address, sizeof(address));
-  if (err < 0) {
+  if (bind(fd, (SA *)&address, sizeof(address)) < 0) {
     perror("Binding error");
-    exit(0);
+    close(fd);
+    return -1;
   }
-
-  err = listen(server_data.socket, MAX_CONNECTIONS);
-  if (err < 0) {
+  if (listen(fd, backlog) < 0) {
     perror("Listen error");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void print_stats(void) {
+  stats_t stats;
+  histogram_t fan_out;
+  metrics_sum(&stats, &fan_out);
+  printf("writev calls: %lu (%.1f frames per call)\n", stats.writev_calls,
+    stats.writev_calls ? (double)stats.frames_written / stats.writev_calls : 0.0);
+  printf("bytes written: %lu (%.1f per call)\n", stats.bytes_written,
+    stats.writev_calls ? (double)stats.bytes_written / stats.writev_calls : 0.0);
+  printf("reads: %lu (%.1f bytes per call), messages in: %lu\n", stats.read_calls,
+    stats.read_calls ? (double)stats.bytes_read / stats.read_calls : 0.0, stats.messages_in);
+  printf("bytes queued: %lu (deepest client queue %lu)\n", stats.bytes_queued, stats.max_queue_depth);
+  printf("fan-out latency: p50 %lu us, p99 %lu us, p99.9 %lu us (%lu messages)\n", hpercentile(&fan_out, 0.5),
+    hpercentile(&fan_out, 0.99), hpercentile(&fan_out, 0.999), fan_out.count);
+  printf("dropped frames: %lu, evicted clients: %lu\n", stats.dropped_frames, stats.evicted_clients);
+  printf("request timeouts: %lu\n", stats.timeouts);
+  printf("history: %lu KB\n", stats.history_bytes / KB);
+  printf("clients: %lu (%lu KB of %lu KB admitted)\n", stats.clients,
+    count_memory(&stats) / KB, server_data.memory_limit / KB);
+  if (server_data.flush_window > 0) {
+    printf("delayed flushes: %lu (%.0f us added on average, max %lu us)\n", stats.delayed_flushes,
+      stats.delayed_flushes ? (double)stats.flush_delay / stats.delayed_flushes : 0.0, stats.max_flush_delay);
+  }
+  printf("buffers held: %lu KB (%lu bytes per client, %lu KB carved by the pools)\n", stats.buffers / KB,
+    stats.clients ? (stats.clients * pblock_len(sizeof(client_t)) + stats.buffers) / stats.clients : 0, pcarved() / KB);
+  printf("wrapped frames: %lu\n", stats.wrapped_frames);
+  printf("migrations: %lu\n", stats.migrations);
+  printf("mailbox overflows: %lu\n", stats.mailbox_overflows);
+  printf("log records dropped: %lu\n", ldropped());
+  for (int i = 0; i < server_data.cores; i++) {
+    worker_t *worker = server_data.workers + i;
+    printf("worker %d: %d sockets, %lu events/s, %lu KB/s\n", i, worker->saved_fds,
+      worker->rate_events, worker->rate_bytes / KB);
+  }
+}
+
+void usage(char *name) {
+  printf("usage: %s [PORT] [events:poll|epoll|uring] [backlog:N] [memory:MB] [flush:MS] [flushbytes:N] [queue:KB] [slow:close|drop|summary] [history:N] [timeout:S] [workers:N] [log:error|warn|info|debug]\n", name);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  server_data.port = PORT;
+  server_data.backlog = MAX_CONNECTIONS;
+  server_data.memory_limit = MEMORY_LIMIT;
+  server_data.flush_bytes = FLUSH_BYTES;
+  server_data.queue_budget = CLIENT_QUEUE_BYTES;
+  server_data.slow_policy = SLOW_CLOSE;
+  server_data.history_len = HISTORY_LEN;
+  server_data.request_timeout = REQUEST_TIMEOUT;
+  log_level_t level = LOG_INFO;
+  server_data.backend = EVENTS_EPOLL;
+  for (int i = 1; i < argc; i++) {
+    if (starts_with(argv[i], "events:")) {
+      char *ptr = argv[i] + strlen("events:");
+      if (strcmp(ptr, "poll") == 0) {
+        server_data.backend = EVENTS_POLL;
+      } else if (strcmp(ptr, "epoll") == 0) {
+        server_data.backend = EVENTS_EPOLL;
+      } else if (strcmp(ptr, "uring") == 0) {
+        server_data.backend = EVENTS_URING;
+      } else {
+        printf("%s is not a valid event backend\n", ptr);
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "backlog:")) {
+      server_data.backlog = atoi(argv[i] + strlen("backlog:"));
+      if (server_data.backlog < 1) {
+        printf("%s is not a valid backlog\n", argv[i] + strlen("backlog:"));
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "memory:")) {
+      long mb = atol(argv[i] + strlen("memory:"));
+      if (mb < 1) {
+        printf("%s is not a valid memory limit\n", argv[i] + strlen("memory:"));
+        usage(argv[0]);
+      }
+      server_data.memory_limit = (unsigned long)mb * KB * KB;
+    } else if (starts_with(argv[i], "flush:")) {
+      server_data.flush_window = atoi(argv[i] + strlen("flush:"));
+      if (server_data.flush_window < 0) {
+        printf("%s is not a valid flush window\n", argv[i] + strlen("flush:"));
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "flushbytes:")) {
+      server_data.flush_bytes = atoi(argv[i] + strlen("flushbytes:"));
+      if (server_data.flush_bytes < 1) {
+        printf("%s is not a valid flush threshold\n", argv[i] + strlen("flushbytes:"));
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "queue:")) {
+      //the largest frames have to fit
+      int kb = atoi(argv[i] + strlen("queue:"));
+      if (kb < 16) {
+        printf("%s is not a valid queue budget\n", argv[i] + strlen("queue:"));
+        usage(argv[0]);
+      }
+      server_data.queue_budget = kb * KB;
+    } else if (starts_with(argv[i], "slow:")) {
+      char *ptr = argv[i] + strlen("slow:");
+      if (strcmp(ptr, "close") == 0) {
+        server_data.slow_policy = SLOW_CLOSE;
+      } else if (strcmp(ptr, "drop") == 0) {
+        server_data.slow_policy = SLOW_DROP;
+      } else if (strcmp(ptr, "summary") == 0) {
+        server_data.slow_policy = SLOW_SUMMARY;
+      } else {
+        printf("%s is not a valid slow client policy\n", ptr);
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "history:")) {
+      //0 keeps no history
+      server_data.history_len = atoi(argv[i] + strlen("history:"));
+      if (server_data.history_len < 0 || server_data.history_len > MAX_HISTORY) {
+        printf("%s is not a valid history length\n", argv[i] + strlen("history:"));
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "timeout:")) {
+      server_data.request_timeout = atoi(argv[i] + strlen("timeout:"));
+      if (server_data.request_timeout < 1) {
+        printf("%s is not a valid request timeout\n", argv[i] + strlen("timeout:"));
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "workers:")) {
+      server_data.cores = atoi(argv[i] + strlen("workers:"));
+      if (server_data.cores < 1) {
+        printf("%s is not a valid number of workers\n", argv[i] + strlen("workers:"));
+        usage(argv[0]);
+      }
+    } else if (starts_with(argv[i], "log:")) {
+      int parsed = llevel_parse(argv[i] + strlen("log:"));
+      if (parsed < 0) {
+        printf("%s is not a valid log level\n", argv[i] + strlen("log:"));
+        usage(argv[0]);
+      }
+      level = parsed;
+    } else {
+      server_data.port = atoi(argv[i]);
+      if (server_data.port < 1) {
+        printf("%s is not a valid port\n", argv[i]);
+        usage(argv[0]);
+      }
+    }
+  }
+
+  //a client hanging up mid-write must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  lstart(level);
+
+  if (server_data.cores == 0) {
+    server_data.cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Cores detected: %d\n", server_data.cores);
+  } else {
+    printf("Workers: %d\n", server_data.cores);
+  }
+
+  //every connection is a descriptor, take as many as the system allows
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  getrlimit(RLIMIT_NOFILE, &limit);
+  //whichever runs out first, idle clients only hold their client_t
+  unsigned long by_memory = server_data.memory_limit / pblock_len(sizeof(client_t));
+  unsigned long by_fds = limit.rlim_cur;
+  printf("Max users possible: %lu (memory allows %lu, descriptor limit %lu)\n",
+    by_fds < by_memory ? by_fds : by_memory, by_memory, by_fds);
+
+  //files are cached before any worker serves them
+  server_data.assets = acreate();
+  if (server_data.assets == NULL) {
+    perror("Assets setup error");
     exit(0);
   }
+  aadd(server_data.assets, "/", "webassets/index.html", "text/html; charset=utf-8");
+  aadd(server_data.assets, "/download", "downloads/client.c", "text/plain; charset=utf-8");
+  awatch(server_data.assets);
 
-  server_data.list = lcreate();
+  server_data.registry = rcreate();
+  server_data.rooms = rooms_create(server_data.cores, server_data.history_len);
+  server_data.lobby = rooms_find(server_data.rooms, LOBBY, strlen(LOBBY), true);
   server_data.workers = calloc(server_data.cores, sizeof(worker_t));
   for (int i = 0; i < server_data.cores; i++) {
-    server_data.workers[i].saved_fds = 0;
-    server_data.workers[i].nfds = FDS_PER_THREAD;
-    pipe(server_data.workers[i].pipeptr);
-    for (int j = 0; j < FDS_PER_THREAD; j++) {
-      server_data.workers[i].fds[j].fd = j == 0 ? server_data.workers[i].pipeptr[0] : VACANT_FD;
-      server_data.workers[i].fds[j].events = POLLIN | POLLHUP;
+    worker_t *worker = server_data.workers + i;
+    worker->index = i;
+    worker->saved_fds = 0;
+    worker->listenfd = open_listener(server_data.port, server_data.backlog);
+    if (worker->listenfd < 0) {
+      exit(0);
     }
+    worker->events = ecreate(server_data.backend, FDS_PER_THREAD);
+    worker->mailbox = mcreate(MAILBOX_LEN);
+    worker->scratch = malloc(CLIENT_BUFFER_LEN);
+    worker->batch_iov = malloc(WRITES_PER_BATCH * IOV_PER_WRITE * sizeof(struct iovec));
+    if (worker->events == NULL || worker->mailbox == NULL || worker->scratch == NULL || worker->batch_iov == NULL) {
+      perror("Worker setup error");
+      exit(0);
+    }
+    if (worker->events->backend != server_data.backend) {
+      //the next workers go straight to what this one fell back to
+      printf("%s is not supported, falling back\n", ebackend_name(server_data.backend));
+      server_data.backend = worker->events->backend;
+    }
+    eadd(worker->events, worker->mailbox->fd);
+    eadd(worker->events, worker->listenfd);
+  }
+  //a worker posts to every mailbox as soon as its first client logs in
+  for (int i = 0; i < server_data.cores; i++) {
     pthread_create(&server_data.workers[i].thread, NULL, watch_sockets, server_data.workers + i);
-    pthread_mutex_init(&server_data.workers[i].mutex, NULL);
-    pthread_mutex_init(&server_data.workers[i].pipe_mutex, NULL);
   }
+  printf("Event backend: %s\n", ebackend_name(server_data.backend));
+  if (server_data.flush_window > 0) {
+    printf("Flush window: %d ms or %d bytes\n", server_data.flush_window, server_data.flush_bytes);
+  }
+  const char *policies[] = {"closed", "drop chat frames", "get chat summed up"};
+  printf("Slow clients: %s past %d KB queued\n", policies[server_data.slow_policy], server_data.queue_budget / KB);
+  printf("History: %d messages per room\n", server_data.history_len);
+  pthread_create(&server_data.balancing_thread, NULL, balance_workers, NULL);
 
-  pthread_create(&server_data.listening_thread, NULL, accept_connections, NULL);
-  printf("Server is listening to connections on port %d, press e to stop\n", port);
-  char key = 0;
+  printf("Log level: %s\n", llevel_name(level));
+  printf("Server is listening to connections on port %d, press e to stop, s for stats, l for the log level\n", server_data.port);
+  int key = 0;
   while (key != 'e') {
     key = getchar();
+    if (key == 's') {
+      print_stats();
+    } else if (key == 'l') {
+      //cycles through the levels, message contents are only logged at debug
+      level = (level + 1) % (LOG_DEBUG + 1);
+      lset_level(level);
+      printf("Log level: %s\n", llevel_name(level));
+    }
   }
   server_cleanup();
+  aclear(server_data.assets);
+  lstop();
+  metrics_clear();
   return 0;
 }
\ No newline at end of file
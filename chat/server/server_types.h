@@ -13,44 +13,285 @@ typedef struct sockaddr_in SA_IN;
 #define PORT 8000
 #define BUFFER_LEN 4096
 #define MAX_MESSAGE 8192
-#define MAX_CONNECTIONS 100
-#define HTTP_200 "HTTP/1.0 200 OK\r\n\r\n"
-#define HTTP_404 "HTTP/1.0 404 Not Found\r\n\r\n"
+#define MAX_CONNECTIONS 1024
+#define NOT_FOUND "Page not found"
 
 #define KB 1024
+//a power of two, read buffers are rings indexed with a mask
 #define CLIENT_BUFFER_LEN (KB * 8)
-#define CLIENTS_PER_THREAD 100
-#define FDS_PER_THREAD (CLIENTS_PER_THREAD + 1)
-#define PIPE_READ 0
-#define PIPE_WRITE 1
-#define PIPE_ADD 0
-#define PIPE_REMOVE 1
-#define PIPE_DATATYPE 0
-#define PIPE_INDEX 1
-#define PIPE_VAL 2
+//initial size of a worker's fd table, it grows with the number of clients
+#define FDS_PER_THREAD 128
+//clients are admitted while their memory fits in this limit
+#define MEMORY_LIMIT ((unsigned long)KB * KB * 512)
+#define COMMAND_BROADCAST 0
+#define COMMAND_MIGRATE 1
+#define COMMAND_RELEASE 2
+#define COMMAND_ADOPT 3
+#define COMMAND_DIRECT 4
+#define MAILBOX_LEN 16384
 #define VACANT_FD -1
+#define EVENTS_PER_WAKEUP 64
+#define FRAME_HEADER_LEN ((int)sizeof(int))
+//one byte of the read buffer stays free to NUL terminate a body in place
+#define MAX_FRAME_LEN (CLIENT_BUFFER_LEN - FRAME_HEADER_LEN - 1)
+#define CLIENT_QUEUE_LEN 256
+//the default outbound byte budget of a client
+#define CLIENT_QUEUE_BYTES (KB * 64)
+#define IOV_PER_WRITE 64
+//queues whose flush is due are written in batches of this many, io_uring
+//submits a batch with one io_uring_enter
+#define WRITES_PER_BATCH 64
+//with a flush window, frames wait up to that many ms to be written together
+//unless this many bytes are queued first
+#define FLUSH_BYTES (KB * 16)
+//the text protocol frames are a 4 byte length and a text command, binary
+//frames (negotiated with "LOGIN name v2") are an opcode, a varint length and
+//a payload that names users by their 32 bit id
+#define PROTOCOL_TEXT 1
+#define PROTOCOL_BINARY 2
+//text protocol commands carried in WebSocket messages, see ws/ws.h
+#define PROTOCOL_WS 3
+#define OP_MSG 1
+#define OP_NEW 2
+#define OP_OUT 3
+#define OP_LOGOUT 4
+#define OP_JOIN 5
+#define OP_PART 6
+#define OP_SAY 7
+#define OP_DM 8
+#define OP_MISSED 9
+#define OP_HISTORY 10
+#define OP_REPLAY 11
+#define OPCODES 12
+#define MAX_VARINT_LEN 5
+//every client starts in the lobby, whose messages keep the MSG, NEW and OUT
+//commands older clients understand
+#define LOBBY "lobby"
+#define ROOM_NAME_LEN 20
+#define ROOMS_PER_CLIENT 16
+#define MAX_ROOMS 4096
+//chat messages every room keeps for clients that join it later, at most
+//MAX_HISTORY with history:N
+#define HISTORY_LEN 64
+#define MAX_HISTORY 1024
+//load is counted in events, this many bytes weigh as much as one event
+#define LOAD_BYTES_PER_EVENT KB
+//seconds a new connection has to send a complete request or its LOGIN, and
+//a kept alive one to send its next request, see timeout:S
+#define REQUEST_TIMEOUT 10
+//seconds between two rebalancing rounds
+#define BALANCE_INTERVAL 1
+//workers below this many events per second are never rebalanced
+#define BALANCE_MIN_LOAD 1000
+//a worker is overloaded once it has this many times the load of the idlest one
+#define BALANCE_RATIO 2
 
+//what happens to a client whose queue goes over its budget, chat frames can
+//be dropped oldest first or be counted and summed up with MISSED once the
+//client caught up, presence frames are always kept
+typedef enum {
+  SLOW_CLOSE,
+  SLOW_DROP,
+  SLOW_SUMMARY
+} slow_policy_t;
+
+typedef enum {
+  PARSE_HEADER,
+  PARSE_BODY
+} parse_state_t;
+
+struct worker_t;
+typedef struct frame_t frame_t;
+typedef struct room_t room_t;
+
+//a room the client joined and its slot in the room's member list on the
+//owning worker, -1 while it isn't in one, and the newest message of the room
+//it was sent from the history
 typedef struct {
+  room_t *room;
+  int slot;
+  unsigned int seen;
+} membership_t;
+
+typedef enum {
+  CLIENT_HANDSHAKE,
+  CLIENT_CHAT,
+  CLIENT_HTTP,
+  //upgraded to a WebSocket, waiting for its LOGIN
+  CLIENT_WEBSOCKET
+} client_state_t;
+
+//frames held for a migrating client, allocated with the first one, with the
+//room each was broadcast to or NULL for direct messages
+typedef struct {
+  int len;
+  int cap;
+  struct {
+    frame_t *frame;
+    room_t *room;
+  } held[];
+} pending_t;
+
+typedef struct client_t {
   int socket;
-  SA address;
-  socklen_t address_len;
-  pthread_t thread;
+  client_state_t state;
+  int protocol;
   pthread_mutex_t mutex;
-  char read_buf[CLIENT_BUFFER_LEN];
-  char write_buf[CLIENT_BUFFER_LEN];
+  //a ring taken from the pool while a partial frame is kept between wakeups
+  //and given back once the client is idle, frames are handled where they
+  //were read unless they wrap around its end
+  char *read_buf;
+  //where the unparsed bytes start and how many there are
+  int read_head;
+  int read_len;
+  //what io_uring received for the socket and the old worker didn't read, the
+  //new one reads it first once the client settles there
+  char *unread;
+  int unread_len;
+  //how much of a partial HTTP request was already searched for the end of
+  //its head, once upgraded the mask of the WebSocket frame being read
+  union {
+    int http_scanned;
+    unsigned int frame_mask;
+  };
+  parse_state_t parse_state;
+  int frame_len;
+  int frame_op;
+  //outbound queue, a ring of shared frame references guarded by mutex, taken
+  //from the pool with the first frame and given back once it's all written
+  frame_t **queue;
+  int queue_head;
+  int queue_count;
+  //bytes of the first frame already written
+  int queue_offset;
+  int queue_bytes;
+  //chat frames dropped since the client was last told with MISSED
+  int missed;
+  //position in the owner's list of queues waiting for the flush window, -1
+  //while the client isn't in it, and when its window ends in microseconds
+  int dirty_slot;
+  long flush_at;
+  //the owning worker, only changes under mutex when the client migrates
+  struct worker_t *worker;
+  //position in the owner's client list once logged in and in its list of
+  //connections waiting for a request before, -1 while in neither
+  int worker_slot;
+  //the small fields share the padding after worker_slot
+  int registry_index;
+  bool want_out;
+  bool closing;
+  //an HTTP connection that stays open for the next request
+  bool keep_alive;
+  //set while the client moves to another worker, broadcasts the new worker
+  //handles before the old one let go are held back in pending
+  bool migrating;
+  bool released;
+  //the worker a migrating client moves to, set with migrating under mutex
+  struct worker_t *adopter;
+  pending_t *pending;
+  //recent load, halved every second by the owner
+  unsigned long load;
+  time_t load_time;
+  //set by the registry, the id resolves to the client in O(1) and is never
+  //reused, binary frames carry its low 32 bits which the socket in them
+  //keeps apart for the clients logged in at the same time
+  unsigned long id;
+  //the next client in the registry's bucket for the same name hash
+  struct client_t *name_next;
+  //only changed by the owning worker
+  membership_t rooms[ROOMS_PER_CLIENT];
+  int room_count;
   char name[20];
 } client_t;
 
+//clients are carved from the 512 byte pool class, with room for the pool's
+//16 byte header to spare
+_Static_assert(sizeof(client_t) + 16 <= 512, "client_t outgrew its pool class");
+
+typedef struct events_t events_t;
+typedef struct mailbox_t mailbox_t;
+
+//a connection that hasn't logged in and when it's closed unless a complete
+//request arrives first, in microseconds
 typedef struct {
+  client_t *client;
+  long deadline;
+} waiting_t;
+
+typedef struct worker_t {
   pthread_t thread;
-  pthread_mutex_t mutex;
-  pthread_mutex_t pipe_mutex;
-  struct pollfd fds[FDS_PER_THREAD];
-  int nfds;
+  mailbox_t *mailbox;
+  events_t *events;
+  int index;
+  int listenfd;
   int saved_fds;
-  int pipeptr[2];
+  //logged in clients, only touched by the worker itself
+  client_t **clients;
+  int clients_len;
+  int clients_cap;
+  //clients migrating here that the old worker hasn't released yet
+  client_t **incoming;
+  int incoming_len;
+  int incoming_cap;
+  //clients whose queued frames wait for the flush window
+  client_t **dirty;
+  int dirty_len;
+  int dirty_cap;
+  //connections that haven't logged in, swept for the ones past their
+  //deadline once a second
+  waiting_t *waiting;
+  int waiting_len;
+  int waiting_cap;
+  long sweep_at;
+  //where a body that wrapped around a read ring is copied to be handled
+  char *scratch;
+  //the iovecs of a batch of writes, IOV_PER_WRITE for each
+  struct iovec *batch_iov;
+  //counted by the worker, turned into rates by the balancer
+  unsigned long load_events;
+  unsigned long load_bytes;
+  unsigned long seen_events;
+  unsigned long seen_bytes;
+  unsigned long rate_events;
+  unsigned long rate_bytes;
+  unsigned long migrate_budget;
 } worker_t;
 
-typedef struct doubly_linked_list_t list_t;
+//every thread counts into its own copy, see metrics/
+typedef struct {
+  unsigned long writev_calls;
+  unsigned long frames_written;
+  unsigned long bytes_written;
+  unsigned long bytes_queued;
+  //the most bytes one client had queued
+  unsigned long max_queue_depth;
+  unsigned long read_calls;
+  unsigned long bytes_read;
+  //frames from clients and returns from ewait
+  unsigned long messages_in;
+  unsigned long wakeups;
+  //chat frames slow clients never got and clients dropped for falling behind
+  unsigned long dropped_frames;
+  unsigned long evicted_clients;
+  //connections closed for not sending a request in time
+  unsigned long timeouts;
+  unsigned long clients;
+  unsigned long migrations;
+  unsigned long mailbox_overflows;
+  //read buffers and queue rings clients hold right now
+  unsigned long buffers;
+  //bodies copied out of a read ring because they wrapped around its end
+  unsigned long wrapped_frames;
+  //writes put off by the flush window and how long they waited in microseconds
+  unsigned long delayed_flushes;
+  unsigned long flush_delay;
+  unsigned long max_flush_delay;
+  //frames the rooms' histories hold
+  unsigned long history_bytes;
+} stats_t;
+
+typedef struct registry_t registry_t;
+typedef struct roster_t roster_t;
+typedef struct rooms_t rooms_t;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,151 @@
+#ifndef __TESTS_CHAT
+#define __TESTS_CHAT
+
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "tests.h"
+
+//tests that talk to a real server run server.c's main in a thread, make test
+//builds it with main renamed, and stop it with the e key through its stdin
+
+int server_main(int argc, char **argv);
+
+static int server_port;
+static int server_keys[2];
+static pthread_t server_thread;
+static char *server_argv[16];
+
+static void *run_server(void *arg) {
+  int argc = 0;
+  while (server_argv[argc]) argc++;
+  server_main(argc, server_argv);
+  return arg;
+}
+
+static int connect_client(void) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(fd >= 0);
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  //a frame that never comes fails the test instead of hanging it
+  struct timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+//options is NULL terminated
+static void start_server(char **options) {
+  static char port[8];
+  server_port = 20000 + getpid() % 20000;
+  snprintf(port, sizeof(port), "%d", server_port);
+  int argc = 0;
+  server_argv[argc++] = "server";
+  server_argv[argc++] = port;
+  while (*options && argc < 15) server_argv[argc++] = *options++;
+  server_argv[argc] = NULL;
+  CHECK(pipe(server_keys) == 0);
+  CHECK(dup2(server_keys[0], STDIN_FILENO) == STDIN_FILENO);
+  CHECK(freopen("/dev/null", "w", stdout) != NULL);
+  CHECK(pthread_create(&server_thread, NULL, run_server, NULL) == 0);
+  for (int tries = 0; tries < 100; tries++) {
+    int fd = connect_client();
+    if (fd >= 0) {
+      close(fd);
+      return;
+    }
+    usleep(50000);
+  }
+  CHECK(!"the server never listened");
+}
+
+static void stop_server(void) {
+  CHECK(write(server_keys[1], "e", 1) == 1);
+  pthread_join(server_thread, NULL);
+}
+
+static void read_all(int fd, void *buf, int len) {
+  while (len > 0) {
+    int res = read(fd, buf, len);
+    CHECK(res > 0);
+    buf = (char *)buf + res;
+    len -= res;
+  }
+}
+
+static void write_all(int fd, const void *buf, int len) {
+  CHECK(write(fd, buf, len) == len);
+}
+
+//text frames, a 4 byte length and the body, returned NUL terminated
+static char *read_text(int fd, char *buf, int size) {
+  unsigned int len;
+  read_all(fd, &len, sizeof(len));
+  len = ntohl(len);
+  CHECK(len < (unsigned int)size);
+  read_all(fd, buf, len);
+  buf[len] = '\0';
+  return buf;
+}
+
+static void send_text(int fd, const char *body) {
+  unsigned int len = htonl(strlen(body));
+  char frame[256];
+  memcpy(frame, &len, sizeof(len));
+  memcpy(frame + sizeof(len), body, strlen(body));
+  write_all(fd, frame, sizeof(len) + strlen(body));
+}
+
+//binary frames, the opcode, a varint length and the payload, returns the length
+static int read_binary(int fd, int *op, char *buf, int size) {
+  unsigned char byte;
+  read_all(fd, &byte, 1);
+  *op = byte;
+  int len = 0;
+  for (int shift = 0; ; shift += 7) {
+    read_all(fd, &byte, 1);
+    len |= (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) break;
+  }
+  CHECK(len <= size);
+  read_all(fd, buf, len);
+  return len;
+}
+
+static void send_binary(int fd, int op, const char *payload, int len) {
+  //payloads in the tests stay under 128 bytes, a one byte varint
+  char frame[130] = {(char)op, (char)len};
+  memcpy(frame + 2, payload, len);
+  write_all(fd, frame, 2 + len);
+}
+
+//sends LOGIN and reads frames up to the LOGGED answer
+static int login(const char *name, bool binary) {
+  int fd = connect_client();
+  CHECK(fd >= 0);
+  char login[64];
+  int len = snprintf(login, sizeof(login), "LOGIN %s%s", name, binary ? " v2" : "");
+  write_all(fd, login, len);
+  char buf[256];
+  CHECK(strcmp(read_text(fd, buf, sizeof(buf)), binary ? "LOGGED v2" : "LOGGED") == 0);
+  return fd;
+}
+
+//skips text frames up to the one that's equal to body
+static void expect_text(int fd, const char *body) {
+  char buf[256];
+  while (strcmp(read_text(fd, buf, sizeof(buf)), body) != 0);
+}
+
+#endif
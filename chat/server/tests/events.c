@@ -0,0 +1,180 @@
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "tests.h"
+#include "../events/events.h"
+
+#define PAIRS 8
+
+static int socks[PAIRS][2];
+
+static void open_pairs(void) {
+  //every watched end has a byte waiting, so all of them are ready at once
+  for (int i = 0; i < PAIRS; i++) {
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, socks[i]) == 0);
+    CHECK(write(socks[i][1], "x", 1) == 1);
+  }
+}
+
+static void close_pairs(void) {
+  for (int i = 0; i < PAIRS; i++) {
+    close(socks[i][0]);
+    close(socks[i][1]);
+  }
+}
+
+static int pair_of(int fd) {
+  for (int i = 0; i < PAIRS; i++) {
+    if (socks[i][0] == fd) return i;
+  }
+  return -1;
+}
+
+static void test_poll_fairness(void) {
+  //more ready sockets than a wakeup takes, each one is taken within as many
+  //wakeups as it takes to go around them all
+  struct events_t *ev = ecreate(EVENTS_POLL, 4);
+  open_pairs();
+  for (int i = 0; i < PAIRS; i++) {
+    CHECK(eadd(ev, socks[i][0]) == 0);
+  }
+  event_t ready[3];
+  for (int round = 0; round < 4; round++) {
+    bool seen[PAIRS] = {false};
+    for (int wakeup = 0; wakeup < (PAIRS + 2) / 3; wakeup++) {
+      int n = ewait(ev, ready, 3, 0);
+      CHECK(n == 3);
+      for (int i = 0; i < n; i++) {
+        CHECK(pair_of(ready[i].fd) >= 0);
+        CHECK(ready[i].events & EVENT_IN);
+        seen[pair_of(ready[i].fd)] = true;
+      }
+    }
+    for (int i = 0; i < PAIRS; i++) {
+      CHECK(seen[i]);
+    }
+  }
+  eclear(ev);
+  close_pairs();
+}
+
+static void test_poll_table(void) {
+  //adding, removing and changing a socket finds it by its fd
+  struct events_t *ev = ecreate(EVENTS_POLL, 2);
+  open_pairs();
+  for (int i = 0; i < PAIRS; i++) {
+    CHECK(eadd(ev, socks[i][0]) == 0);
+  }
+  CHECK(eadd(ev, socks[0][0]) == 2);
+  CHECK(eremove(ev, socks[0][1]) == 1);
+  CHECK(emodify(ev, socks[0][1], EVENT_IN) == 1);
+  CHECK(eremove(ev, socks[2][0]) == 0);
+  CHECK(eremove(ev, socks[2][0]) == 1);
+  CHECK(emodify(ev, socks[5][0], EVENT_IN | EVENT_OUT) == 0);
+  CHECK(emodify(ev, socks[6][0], 0) == 0);
+  event_t ready[PAIRS];
+  int n = ewait(ev, ready, PAIRS, 0);
+  CHECK(n == PAIRS - 2);
+  bool seen[PAIRS] = {false};
+  for (int i = 0; i < n; i++) {
+    int pair = pair_of(ready[i].fd);
+    CHECK(pair >= 0 && !seen[pair]);
+    seen[pair] = true;
+    CHECK(((ready[i].events & EVENT_OUT) != 0) == (pair == 5));
+  }
+  CHECK(!seen[2] && !seen[6]);
+  CHECK(eadd(ev, socks[2][0]) == 0);
+  CHECK(ewait(ev, ready, PAIRS, 0) == PAIRS - 1);
+  eclear(ev);
+  close_pairs();
+}
+
+static int read_uring(struct events_t *ev, int fd, char *buf, int size) {
+  //waits for the socket and reads what its recv has received
+  event_t ready[PAIRS];
+  int n = ewait(ev, ready, PAIRS, 1000);
+  CHECK(n >= 1);
+  bool seen = false;
+  for (int i = 0; i < n; i++) {
+    seen |= ready[i].fd == fd && (ready[i].events & EVENT_IN);
+  }
+  CHECK(seen);
+  struct iovec iov = {buf, size};
+  return ereadv(ev, fd, &iov, 1);
+}
+
+static void test_uring(void) {
+  //reads come out of the provided buffers, unread bytes follow a socket to
+  //another ring and writes go out in one batch
+  struct events_t *ev = ecreate(EVENTS_URING, 4);
+  CHECK(ev != NULL);
+  if (ev->backend != EVENTS_URING) {
+    //the kernel can't, ecreate fell back
+    eclear(ev);
+    return;
+  }
+  open_pairs();
+  char buf[64];
+  CHECK(eadd(ev, socks[0][0]) == 0);
+  CHECK(read_uring(ev, socks[0][0], buf, sizeof(buf)) == 1 && buf[0] == 'x');
+  struct iovec iov = {buf, sizeof(buf)};
+  CHECK(ereadv(ev, socks[0][0], &iov, 1) == -1);
+  //split across two iovecs
+  CHECK(write(socks[0][1], "hello", 5) == 5);
+  event_t ready[PAIRS];
+  CHECK(ewait(ev, ready, PAIRS, 1000) == 1);
+  struct iovec halves[2] = {{buf, 2}, {buf + 2, 8}};
+  CHECK(ereadv(ev, socks[0][0], halves, 2) == 5 && memcmp(buf, "hello", 5) == 0);
+  //end of file once the other end closes
+  close(socks[0][1]);
+  socks[0][1] = -1;
+  CHECK(read_uring(ev, socks[0][0], buf, sizeof(buf)) == 0);
+  CHECK(eremove(ev, socks[0][0]) == 0);
+
+  //what the first ring received and nobody read is read first on the second
+  struct events_t *other = ecreate(EVENTS_URING, 4);
+  CHECK(other != NULL && other->backend == EVENTS_URING);
+  CHECK(eadd(ev, socks[1][0]) == 0);
+  CHECK(write(socks[1][1], "abc", 3) == 3);
+  CHECK(ewait(ev, ready, PAIRS, 1000) == 1);
+  int len;
+  char *unread = etake(ev, socks[1][0], &len);
+  CHECK(unread != NULL && len == 4 && memcmp(unread, "xabc", 4) == 0);
+  CHECK(eremove(ev, socks[1][0]) == 0);
+  CHECK(eadd(other, socks[1][0]) == 0);
+  egive(other, socks[1][0], unread, len);
+  CHECK(write(socks[1][1], "de", 2) == 2);
+  int total = 0;
+  while (total < 6) {
+    int r = read_uring(other, socks[1][0], buf + total, sizeof(buf) - total);
+    CHECK(r > 0);
+    total += r;
+  }
+  CHECK(total == 6 && memcmp(buf, "xabcde", 6) == 0);
+
+  //a batch of writes, one of them empty
+  ewrite_t writes[3];
+  struct iovec out[3][2];
+  for (int i = 0; i < 3; i++) {
+    out[i][0] = (struct iovec){"ab", 2};
+    out[i][1] = (struct iovec){"cd", 2};
+    writes[i] = (ewrite_t){socks[2 + i][0], out[i], i == 1 ? 0 : 2, -1};
+  }
+  ewritev(other, writes, 3);
+  for (int i = 0; i < 3; i++) {
+    CHECK(writes[i].res == (i == 1 ? 0 : 4));
+  }
+  CHECK(read(socks[2][1], buf, sizeof(buf)) == 4 && memcmp(buf, "abcd", 4) == 0);
+  CHECK(read(socks[4][1], buf, sizeof(buf)) == 4 && memcmp(buf, "abcd", 4) == 0);
+  eclear(other);
+  eclear(ev);
+  close_pairs();
+}
+
+int main(void) {
+  test_poll_fairness();
+  test_poll_table();
+  test_uring();
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include "chat.h"
+#include "../server_types.h"
+
+#define KEPT 4
+
+//the next SAY frame of room r, skipping presence
+static char *next_say(int fd, char *buf, int size) {
+  while (strncmp(read_text(fd, buf, size), "SAY r ", strlen("SAY r ")) != 0);
+  return buf;
+}
+
+static void test_replay_once(int alice) {
+  //a joiner gets the kept messages oldest first, then only live ones, and
+  //none of them twice
+  char buf[256];
+  char expected[64];
+  for (int i = 1; i <= 6; i++) {
+    snprintf(buf, sizeof(buf), "SAY r m%d", i);
+    send_text(alice, buf);
+  }
+  //the sender is sent its own messages, once it has the last one they're kept
+  expect_text(alice, "SAY r alice: m6");
+  int bob = login("bob", false);
+  send_text(bob, "JOIN r");
+  for (int i = 6 - KEPT + 1; i <= 6; i++) {
+    snprintf(expected, sizeof(expected), "SAY r alice: m%d", i);
+    CHECK(strcmp(next_say(bob, buf, sizeof(buf)), expected) == 0);
+  }
+  CHECK(strcmp(read_text(bob, buf, sizeof(buf)), "HISTORY r 6") == 0);
+  send_text(alice, "SAY r m7");
+  send_text(alice, "SAY r m8");
+  CHECK(strcmp(next_say(bob, buf, sizeof(buf)), "SAY r alice: m7") == 0);
+  CHECK(strcmp(next_say(bob, buf, sizeof(buf)), "SAY r alice: m8") == 0);
+  //asking again after 5
+  send_text(bob, "HISTORY r 5");
+  for (int i = 6; i <= 8; i++) {
+    snprintf(expected, sizeof(expected), "SAY r alice: m%d", i);
+    CHECK(strcmp(read_text(bob, buf, sizeof(buf)), expected) == 0);
+  }
+  CHECK(strcmp(read_text(bob, buf, sizeof(buf)), "HISTORY r 8") == 0);
+  //since at or past the newest message, up to the largest one there is,
+  //gets nothing but the marker
+  const char *past[] = {"HISTORY r 8", "HISTORY r 9", "HISTORY r 4294967295", "HISTORY r -1"};
+  for (int i = 0; i < (int)(sizeof(past) / sizeof(past[0])); i++) {
+    send_text(bob, past[i]);
+    CHECK(strcmp(read_text(bob, buf, sizeof(buf)), "HISTORY r 8") == 0);
+  }
+  send_text(bob, "HISTORY lobby -1");
+  CHECK(strncmp(read_text(bob, buf, sizeof(buf)), "HISTORY lobby ", strlen("HISTORY lobby ")) == 0);
+  close(bob);
+}
+
+static void test_replay_binary(int alice) {
+  //binary clients are replayed REPLAY frames that name the sender, who has
+  //logged out by now
+  send_text(alice, "LOGOUT");
+  close(alice);
+  int carol = login("carol", true);
+  char buf[256];
+  int op;
+  int len;
+  //the lobby's history ends with its marker
+  while (read_binary(carol, &op, buf, sizeof(buf)) > 0 && op != OP_HISTORY);
+  send_binary(carol, OP_JOIN, "r", 1);
+  for (int i = 8 - KEPT + 1; i <= 8; i++) {
+    //after the members' JOIN, and alice's OUT that may still be on its way
+    while ((len = read_binary(carol, &op, buf, sizeof(buf))) > 0 && op != OP_REPLAY) {
+      CHECK(op == OP_JOIN || op == OP_OUT);
+    }
+    //the sender's id, the room, the sender's name and the text
+    char expected[64];
+    int expected_len = 4 + snprintf(expected + 4, sizeof(expected) - 4, "%cr%calicem%d", 1, 5, i);
+    CHECK(len == expected_len);
+    CHECK(memcmp(buf + 4, expected + 4, len - 4) == 0);
+  }
+  len = read_binary(carol, &op, buf, sizeof(buf));
+  CHECK(op == OP_HISTORY);
+  unsigned int last;
+  memcpy(&last, buf, sizeof(last));
+  CHECK(ntohl(last) == 8);
+  close(carol);
+}
+
+int main(void) {
+  char *options[] = {"workers:4", "history:4", NULL};
+  start_server(options);
+  int alice = login("alice", false);
+  send_text(alice, "JOIN r");
+  expect_text(alice, "HISTORY r 0");
+  test_replay_once(alice);
+  test_replay_binary(alice);
+  stop_server();
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include <pthread.h>
+#include <sched.h>
+#include "tests.h"
+#include "../mailbox/mailbox.h"
+
+#define PRODUCERS 4
+#define POSTS 100000
+
+static void test_overflow_order(void) {
+  //a full ring overflows into the list, nothing is dropped and the commands
+  //come out in the order they were posted in
+  struct mailbox_t *box = mcreate(4);
+  for (int i = 0; i < 100; i++) {
+    command_t command = {0, i, NULL, NULL};
+    CHECK(mpost(box, command) == (i < 4 ? 0 : 1));
+  }
+  command_t command;
+  mwoken(box);
+  for (int i = 0; i < 100; i++) {
+    CHECK(mtake(box, &command) == 1);
+    CHECK(command.val == i);
+  }
+  CHECK(mtake(box, &command) == 0);
+  //once it's all taken posts go through the ring again
+  command.val = 100;
+  CHECK(mpost(box, command) == 0);
+  CHECK(mtake(box, &command) == 1 && command.val == 100);
+  CHECK(mtake(box, &command) == 0);
+  mclear(box);
+}
+
+static void *produce(void *arg) {
+  struct mailbox_t *box = (struct mailbox_t *)((void **)arg)[0];
+  int producer = (int)(long)((void **)arg)[1];
+  for (int i = 0; i < POSTS; i++) {
+    command_t command = {producer, i, NULL, NULL};
+    CHECK(mpost(box, command) >= 0);
+  }
+  return NULL;
+}
+
+static void test_producers(void) {
+  //every producer's commands arrive in its own order, with a consumer slow
+  //enough that the ring keeps filling up
+  struct mailbox_t *box = mcreate(16);
+  pthread_t threads[PRODUCERS];
+  void *args[PRODUCERS][2];
+  for (int p = 0; p < PRODUCERS; p++) {
+    args[p][0] = box;
+    args[p][1] = (void *)(long)p;
+    pthread_create(threads + p, NULL, produce, args[p]);
+  }
+  long next[PRODUCERS] = {0};
+  long taken = 0;
+  while (taken < (long)PRODUCERS * POSTS) {
+    mwoken(box);
+    command_t command;
+    while (mtake(box, &command)) {
+      CHECK(command.type >= 0 && command.type < PRODUCERS);
+      CHECK(command.val == next[command.type]);
+      next[command.type]++;
+      if (++taken % 64 == 0) sched_yield();
+    }
+  }
+  for (int p = 0; p < PRODUCERS; p++) {
+    pthread_join(threads[p], NULL);
+  }
+  command_t command;
+  CHECK(mtake(box, &command) == 0);
+  mclear(box);
+}
+
+int main(void) {
+  test_overflow_order();
+  test_producers();
+  return 0;
+}
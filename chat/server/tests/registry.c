@@ -0,0 +1,50 @@
+#include "tests.h"
+#include "../registry/registry.h"
+
+static void test_id_reused_socket(void) {
+  //an id kept while its socket is reconnected over and over never finds the
+  //client that has the socket now
+  struct registry_t *reg = rcreate();
+  client_t *first = calloc(1, sizeof(client_t));
+  client_t *other = calloc(1, sizeof(client_t));
+  first->socket = other->socket = 5;
+  CHECK(radd(reg, first) == 0);
+  unsigned long id = first->id;
+  CHECK(rget_id(reg, id) == first);
+  CHECK(rremove(reg, first) == first);
+  CHECK(rget_id(reg, id) == NULL);
+  for (int i = 0; i < (1 << 16); i++) {
+    CHECK(radd(reg, other) == 0);
+    CHECK(other->id != id);
+    CHECK(rget_id(reg, id) == NULL);
+    CHECK(rget_id(reg, other->id) == other);
+    CHECK(rremove(reg, other) == other);
+  }
+  free(first);
+  free(other);
+  rclear(reg);
+}
+
+static void test_id_other_socket(void) {
+  struct registry_t *reg = rcreate();
+  client_t *first = calloc(1, sizeof(client_t));
+  client_t *second = calloc(1, sizeof(client_t));
+  first->socket = 5;
+  second->socket = 5 + REGISTRY_SHARDS;
+  CHECK(radd(reg, first) == 0 && radd(reg, second) == 0);
+  CHECK(rget_id(reg, first->id) == first);
+  CHECK(rget_id(reg, second->id) == second);
+  CHECK(rget(reg, second->socket) == second);
+  CHECK(rremove(reg, first) == first);
+  CHECK(rget_id(reg, second->id) == second);
+  CHECK(rremove(reg, second) == second);
+  free(first);
+  free(second);
+  rclear(reg);
+}
+
+int main(void) {
+  test_id_reused_socket();
+  test_id_other_socket();
+  return 0;
+}
@@ -0,0 +1,164 @@
+#include <limits.h>
+#include "tests.h"
+#include "../rooms/rooms.h"
+#include "../frame/frame.h"
+#include "../metrics/metrics.h"
+
+static void record(struct room_t *room, int count) {
+  for (int i = 0; i < count; i++) {
+    frame_t *frame = fformat("SAY %s a: %d", room->name, i);
+    CHECK(frame != NULL);
+    pthread_mutex_lock(&room->mutex);
+    frame_t *old = rooms_record(room, frame);
+    pthread_mutex_unlock(&room->mutex);
+    funhold(old);
+    frelease(frame);
+  }
+}
+
+static int history(struct room_t *room, unsigned int since) {
+  //every message comes once, oldest first and up to the newest
+  frame_t *frames[MAX_HISTORY + 1];
+  unsigned int last;
+  int count = rooms_history(room, since, frames, &last);
+  CHECK(last == room->seq);
+  CHECK(count <= room->history_len);
+  for (int i = 0; i < count; i++) {
+    CHECK(frames[i]->seq == last - count + 1 + i);
+    funhold(frames[i]);
+  }
+  return count;
+}
+
+static void test_history_since(void) {
+  struct rooms_t *rooms = rooms_create(1, 4);
+  struct room_t *room = rooms_find(rooms, "a", 1, true);
+  CHECK(history(room, 0) == 0);
+  CHECK(history(room, UINT_MAX) == 0);
+  //fewer messages than the ring keeps
+  record(room, 2);
+  CHECK(history(room, 0) == 2);
+  CHECK(history(room, 1) == 1);
+  CHECK(history(room, room->seq) == 0);
+  CHECK(history(room, room->seq + 1) == 0);
+  CHECK(history(room, UINT_MAX) == 0);
+  //more than it keeps
+  record(room, 4);
+  CHECK(history(room, 0) == 4);
+  CHECK(history(room, 4) == 2);
+  CHECK(history(room, room->seq) == 0);
+  CHECK(history(room, room->seq + 1) == 0);
+  CHECK(history(room, UINT_MAX) == 0);
+  rooms_release(rooms, room);
+  rooms_clear(rooms);
+}
+
+static void test_history_full(void) {
+  //the largest ring, past the frames a caller has room for when unclamped
+  struct rooms_t *rooms = rooms_create(1, MAX_HISTORY);
+  struct room_t *room = rooms_find(rooms, "a", 1, true);
+  record(room, MAX_HISTORY + 100);
+  CHECK(history(room, 0) == MAX_HISTORY);
+  CHECK(history(room, room->seq - 1) == 1);
+  CHECK(history(room, room->seq) == 0);
+  CHECK(history(room, room->seq + 1) == 0);
+  CHECK(history(room, UINT_MAX) == 0);
+  rooms_release(rooms, room);
+  rooms_clear(rooms);
+}
+
+static struct room_t *find(struct rooms_t *rooms, int number, bool create) {
+  char name[ROOM_NAME_LEN];
+  int len = snprintf(name, sizeof(name), "r%d", number);
+  return rooms_find(rooms, name, len, create);
+}
+
+static void test_free_unused(void) {
+  //a room nobody talked in goes with its last reference
+  struct rooms_t *rooms = rooms_create(1, 4);
+  struct room_t *room = find(rooms, 0, true);
+  room_retain(room, 2);
+  rooms_release(rooms, room);
+  rooms_release(rooms, room);
+  CHECK(rooms->count == 1);
+  rooms_release(rooms, room);
+  CHECK(rooms->count == 0);
+  CHECK(find(rooms, 0, false) == NULL);
+  rooms_clear(rooms);
+}
+
+static void test_keep_idle(void) {
+  //one with a history is kept for the next to join it
+  struct rooms_t *rooms = rooms_create(1, 4);
+  struct room_t *room = find(rooms, 0, true);
+  record(room, 3);
+  rooms_release(rooms, room);
+  CHECK(rooms->count == 1);
+  CHECK(find(rooms, 0, false) == room);
+  CHECK(!room->idle);
+  CHECK(history(room, 0) == 3);
+  rooms_release(rooms, room);
+  rooms_clear(rooms);
+}
+
+static void test_evict_idle(void) {
+  //joining, talking in and leaving more rooms than MAX_ROOMS never runs out
+  //of them, the rooms idle for the longest make space
+  struct rooms_t *rooms = rooms_create(1, 4);
+  for (int i = 0; i < 2 * MAX_ROOMS; i++) {
+    struct room_t *room = find(rooms, i, true);
+    CHECK(room != NULL);
+    record(room, 1);
+    rooms_release(rooms, room);
+    CHECK(rooms->count <= MAX_ROOMS);
+  }
+  CHECK(find(rooms, 0, false) == NULL);
+  CHECK(find(rooms, MAX_ROOMS - 1, false) == NULL);
+  struct room_t *room = find(rooms, MAX_ROOMS, false);
+  CHECK(room != NULL && history(room, 0) == 1);
+  //found again it's the newest idle one once it's let go
+  rooms_release(rooms, room);
+  for (int i = 0; i < MAX_ROOMS - 1; i++) {
+    room = find(rooms, 2 * MAX_ROOMS + i, true);
+    CHECK(room != NULL);
+    record(room, 1);
+    rooms_release(rooms, room);
+  }
+  CHECK(find(rooms, MAX_ROOMS + 1, false) == NULL);
+  CHECK(find(rooms, 2 * MAX_ROOMS - 1, false) == NULL);
+  room = find(rooms, MAX_ROOMS, false);
+  CHECK(room != NULL);
+  rooms_release(rooms, room);
+  rooms_clear(rooms);
+  CHECK(metrics_local()->stats.history_bytes == 0);
+}
+
+static void test_keep_referenced(void) {
+  //rooms with members are never made space from
+  struct rooms_t *rooms = rooms_create(1, 4);
+  struct room_t *rooms_held[MAX_ROOMS];
+  for (int i = 0; i < MAX_ROOMS; i++) {
+    rooms_held[i] = find(rooms, i, true);
+    CHECK(rooms_held[i] != NULL);
+    record(rooms_held[i], 1);
+  }
+  CHECK(find(rooms, MAX_ROOMS, true) == NULL);
+  rooms_release(rooms, rooms_held[0]);
+  struct room_t *room = find(rooms, MAX_ROOMS, true);
+  CHECK(room != NULL);
+  rooms_release(rooms, room);
+  for (int i = 1; i < MAX_ROOMS; i++) {
+    rooms_release(rooms, rooms_held[i]);
+  }
+  rooms_clear(rooms);
+}
+
+int main(void) {
+  test_history_since();
+  test_history_full();
+  test_free_unused();
+  test_keep_idle();
+  test_evict_idle();
+  test_keep_referenced();
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef __TESTS
+#define __TESTS
+
+#include <stdio.h>
+#include <stdlib.h>
+
+//every file in tests is a program of its own linked with the server's modules,
+//a failed check says where and exits with 1
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    exit(1); \
+  } \
+} while (0)
+
+#endif
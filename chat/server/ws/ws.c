@@ -0,0 +1,163 @@
+#include <string.h>
+#include <stdint.h>
+#include "ws.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+static uint32_t rotl(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static void sha1_block(uint32_t *state, const unsigned char *block) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+      (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+static void sha1(const unsigned char *data, int len, unsigned char *digest) {
+  //only ever hashes a key and the GUID, so the message is at most a few blocks
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  int full = len / 64;
+  for (int i = 0; i < full; i++) {
+    sha1_block(state, data + i * 64);
+  }
+  unsigned char tail[128] = {0};
+  int rest = len - full * 64;
+  memcpy(tail, data + full * 64, rest);
+  tail[rest] = 0x80;
+  int tail_len = rest + 9 > 64 ? 128 : 64;
+  uint64_t bits = (uint64_t)len * 8;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_len - 1 - i] = (unsigned char)(bits >> (i * 8));
+  }
+  for (int i = 0; i < tail_len; i += 64) {
+    sha1_block(state, tail + i);
+  }
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4] = state[i] >> 24;
+    digest[i * 4 + 1] = state[i] >> 16;
+    digest[i * 4 + 2] = state[i] >> 8;
+    digest[i * 4 + 3] = state[i];
+  }
+}
+
+static void base64(const unsigned char *data, int len, char *out) {
+  static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  int o = 0;
+  for (int i = 0; i < len; i += 3) {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < len) group |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < len) group |= data[i + 2];
+    out[o++] = digits[(group >> 18) & 63];
+    out[o++] = digits[(group >> 12) & 63];
+    out[o++] = i + 1 < len ? digits[(group >> 6) & 63] : '=';
+    out[o++] = i + 2 < len ? digits[group & 63] : '=';
+  }
+  out[o] = '\0';
+}
+
+void waccept(const char *key, int len, char *accept) {
+  unsigned char buf[128];
+  int guid_len = strlen(WS_GUID);
+  if (len > (int)sizeof(buf) - guid_len) len = sizeof(buf) - guid_len;
+  memcpy(buf, key, len);
+  memcpy(buf + len, WS_GUID, guid_len);
+  unsigned char digest[20];
+  sha1(buf, len + guid_len, digest);
+  base64(digest, sizeof(digest), accept);
+}
+
+int wparse(const char *buf, int available, int *op, int *len, unsigned int *mask) {
+  if (available < 2) return 0;
+  unsigned char first = buf[0];
+  unsigned char second = buf[1];
+  *op = first & 0x0f;
+  //every client frame is masked, whole and without extensions
+  if (!(first & 0x80) || (first & 0x70) || !(second & 0x80) || *op == WS_CONTINUATION) return -1;
+  if (*op != WS_TEXT && *op != WS_BINARY && *op != WS_CLOSE && *op != WS_PING && *op != WS_PONG) return -1;
+  unsigned long length = second & 0x7f;
+  int header = 2;
+  if (length == 126 || length == 127) {
+    int bytes = length == 126 ? 2 : 8;
+    if (available < header + bytes) return 0;
+    length = 0;
+    for (int i = 0; i < bytes; i++) {
+      length = length << 8 | (unsigned char)buf[header + i];
+      if (length > MAX_FRAME_LEN) return -1;
+    }
+    header += bytes;
+  }
+  //control frames carry at most 125 bytes
+  if (length > MAX_FRAME_LEN || (*op >= WS_CLOSE && length > 125)) return -1;
+  if (available < header + 4) return 0;
+  memcpy(mask, buf + header, 4);
+  *len = length;
+  return header + 4;
+}
+
+void wunmask(char *payload, int len, unsigned int mask) {
+  //four bytes at a time, the mask repeats every four
+  int i = 0;
+  for (; i + 4 <= len; i += 4) {
+    unsigned int word;
+    memcpy(&word, payload + i, 4);
+    word ^= mask;
+    memcpy(payload + i, &word, 4);
+  }
+  const unsigned char *bytes = (const unsigned char *)&mask;
+  for (; i < len; i++) {
+    payload[i] ^= bytes[i & 3];
+  }
+}
+
+int wheader(char *buf, int op, int len) {
+  buf[0] = (char)(0x80 | op);
+  if (len < 126) {
+    buf[1] = (char)len;
+    return 2;
+  }
+  if (len < 65536) {
+    buf[1] = 126;
+    buf[2] = (char)(len >> 8);
+    buf[3] = (char)len;
+    return 4;
+  }
+  buf[1] = 127;
+  for (int i = 0; i < 8; i++) {
+    buf[2 + i] = (char)((unsigned long)len >> (56 - i * 8));
+  }
+  return 10;
+}
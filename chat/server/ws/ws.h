@@ -0,0 +1,30 @@
+#ifndef __WS
+#define __WS
+
+#include "../server_types.h"
+
+//browsers upgrade an HTTP request on the chat port to a WebSocket and then
+//speak the text protocol, a command per WebSocket message
+#define WS_PATH "/chat"
+#define WS_CONTINUATION 0
+#define WS_TEXT 1
+#define WS_BINARY 2
+#define WS_CLOSE 8
+#define WS_PING 9
+#define WS_PONG 10
+//two bytes, a 64 bit length and the mask
+#define WS_MAX_HEADER 14
+//the Sec-WebSocket-Accept value with its terminator
+#define WS_ACCEPT_LEN 29
+
+//the answer to a Sec-WebSocket-Key, accept takes WS_ACCEPT_LEN bytes
+void waccept(const char *key, int len, char *accept);
+//parses a client frame's header, returns its length, 0 while it's incomplete
+//and -1 for a frame the gateway doesn't take, fragmented messages included
+int wparse(const char *buf, int available, int *op, int *len, unsigned int *mask);
+//unmasks a payload in place, mask is in the byte order it was read in
+void wunmask(char *payload, int len, unsigned int mask);
+//the header of an unmasked server frame, returns its length
+int wheader(char *buf, int op, int len);
+
+#endif